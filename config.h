@@ -0,0 +1,64 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in. 
+ * $Id$
+ *
+ */
+
+
+/* Define if you have the ANSI C header files.  */
+#define STDC_HEADERS 1
+
+/* The number of bytes in a int.  */
+#define SIZEOF_INT 4
+
+/* The number of bytes in a long.  */
+#define SIZEOF_LONG 8
+
+/* Define if you have the getopt_long function.  */
+#define HAVE_GETOPT_LONG 1
+
+/* Define if you have strlcpy function. */
+/* #undef HAVE_STRLCPY */
+
+/* Define if you have strlcat function. */
+/* #undef HAVE_STRLCAT */
+
+/* Define if you have execvpe function. */
+#define HAVE_EXECVPE 1
+
+/* Define if you have posix_spawn function. */
+#define HAVE_POSIX_SPAWN 1
+
+/* Define if you have posix_spawn_file_actions_addclosefrom_np function. */
+#define HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP 1
+
+/* Define if you have close_range function. */
+#define HAVE_CLOSE_RANGE 1
+
+/* Define if you have the <getopt.h> header file.  */
+#define HAVE_GETOPT_H 1
+
+/* Define if you have the <string.h> header file.  */
+#define HAVE_STRING_H 1
+
+/* Define if you have the <unistd.h> header file.  */
+#define HAVE_UNISTD_H 1
+
+/* Define if you have the <libgen.h> header file.  */
+/* #undef HAVE_LIBGEN_H */
+
+/* Define if you have the <linux/futex.h> header file.  */
+#define HAVE_LINUX_FUTEX_H 1
+
+/* Define if you have the <spawn.h> header file.  */
+#define HAVE_SPAWN_H 1
+
+/* Define if you have the mxml library (-lmxml).  */
+/* #undef HAVE_LIBMXML */
+
+
+
+#define HOST_TYPE "x86_64-pc-linux-gnu"
+
+
+/* eof */
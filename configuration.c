@@ -22,9 +22,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -33,6 +35,44 @@
 #include "nxgipd.h"
 
 
+/* zone type names for debounce settings (type_flags[0] bits), fire and
+   24-hour zones are never debounced */
+static const char *zone_type_names[NX_ZONE_TYPE_BITS] = {
+  NULL, NULL, "keyswitch", "follower", "entry1", "entry2", "interior", "local"
+};
+
+
+/* parse list of "<zone>[-<zone>]:<seconds>" (or "<type>:<seconds>")
+   entries separated by commas */
+static int parse_debounce_list(const char *str, short *table, int size, const char **names)
+{
+  char buf[1024], *tok, *p, *saveptr;
+  int first, last, secs, i;
+
+  strlcpy(buf,str,sizeof(buf));
+  for (tok=strtok_r(buf,", \t\r\n",&saveptr); tok; tok=strtok_r(NULL,", \t\r\n",&saveptr)) {
+    if (!(p=strchr(tok,':')) || sscanf(p+1,"%d",&secs) != 1 || secs < 0 || secs > 3600)
+      return -1;
+    *p=0;
+    if (names) {
+      for (i=0; i<size && (!names[i] || strcmp(names[i],tok)); i++);
+      if (i >= size) return -2;
+      first=last=i;
+    } else {
+      i=sscanf(tok,"%d-%d",&first,&last);
+      if (i < 1) return -2;
+      if (i == 1) last=first;
+      if (first < 1 || last < first || last > size) return -3;
+      first--;
+      last--;
+    }
+    for (i=first; i<=last; i++) table[i]=secs;
+  }
+
+  return 0;
+}
+
+
 mxml_node_t* load_xml_file(const char *filename)
 {
   FILE *fp;
@@ -80,9 +120,10 @@ const char* xml_whitespace_cb(mxml_node_t *node, int where)
 {
   const char *name = mxmlGetElement(node);
 
-  if ( !strcmp(name,"AlarmZones") || !strcmp(name,"AlarmPartitions") || strstr(name,"?xml ")==name ) {
+  if ( !strcmp(name,"AlarmZones") || !strcmp(name,"AlarmPartitions") ||
+       !strcmp(name,"BusTopology") || strstr(name,"?xml ")==name ) {
     if ( where == MXML_WS_AFTER_OPEN || where == MXML_WS_AFTER_CLOSE ) return("\n");
-  } else if ( !strcmp(name,"Zone") || !strcmp(name,"Partition") ) {
+  } else if ( !strcmp(name,"Zone") || !strcmp(name,"Partition") || !strcmp(name,"Node") ) {
     if (where == MXML_WS_BEFORE_OPEN || where == MXML_WS_BEFORE_CLOSE) return("  ");
     return("\n");
   } else {
@@ -102,6 +143,178 @@ const char* xml_whitespace_cb(mxml_node_t *node, int where)
   }
 
 
+/* parse list of numbers and ranges ("1-8,12") */
+static int parse_range_list(const char *str, uchar *set, int min, int max)
+{
+  char buf[1024], *tok, *saveptr;
+  int first, last, i;
+
+  strlcpy(buf,str,sizeof(buf));
+  for (tok=strtok_r(buf,", \t\r\n",&saveptr); tok; tok=strtok_r(NULL,", \t\r\n",&saveptr)) {
+    i=sscanf(tok,"%d-%d",&first,&last);
+    if (i < 1) return -1;
+    if (i == 1) last=first;
+    if (first < min || last < first || last > max) return -2;
+    for (i=first; i<=last; i++) set[i-min]=1;
+  }
+
+  return 0;
+}
+
+
+/* parse list of flag names, name+ matches only flag being set and
+   name- only flag being cleared */
+static int parse_flag_list(const char *str, const nx_flag_name_t *names, uint *set, uint *clear)
+{
+  char buf[1024], *tok, *saveptr;
+  size_t len;
+  int i, dir;
+
+  strlcpy(buf,str,sizeof(buf));
+  *set=0;
+  *clear=0;
+  for (tok=strtok_r(buf,", \t\r\n",&saveptr); tok; tok=strtok_r(NULL,", \t\r\n",&saveptr)) {
+    dir=0;
+    len=strlen(tok);
+    if (len > 1 && (tok[len-1] == '+' || tok[len-1] == '-')) {
+      dir=(tok[len-1] == '+' ? 1 : -1);
+      tok[len-1]=0;
+    }
+    for (i=0; names[i].name && strcmp(names[i].name,tok); i++);
+    if (!names[i].name) return -1;
+    if (dir >= 0) *set|=names[i].flag;
+    if (dir <= 0) *clear|=names[i].flag;
+  }
+
+  return 0;
+}
+
+
+/* compile trigger rule into rule lookup tables */
+static void compile_trigger_rule(nx_rule_table_t *t, int rule, const uchar *num, int nums,
+				 uint partmask, int flags, uint set, uint clear)
+{
+  uint32_t bit = 1U << rule;
+  int i, b;
+
+  for (i=0; i<nums && i<NX_ZONES_MAX; i++)
+    if (num[i]) t->num[i]|=bit;
+
+  for (i=0; i<256; i++)
+    if ((i & partmask) || partmask == 0xff) t->part[i]|=bit;
+
+  if (!flags) {
+    t->any|=bit;
+    return;
+  }
+  for (b=0; b<3; b++) {
+    for (i=0; i<256; i++) {
+      if (((uint)i << (b*8)) & set) t->set[b][i]|=bit;
+      if (((uint)i << (b*8)) & clear) t->clear[b][i]|=bit;
+    }
+  }
+}
+
+
+/* load <rule> entries from <triggers><rules> section */
+static nx_trigger_rules_t* load_trigger_rules(mxml_node_t *rules, const char *dir, int mode)
+{
+  nx_trigger_rules_t *r;
+  mxml_node_t *node;
+  const char *s, *event;
+  uchar num[NX_ZONES_MAX], parts[NX_PARTITIONS_MAX];
+  uint partmask, set, clear;
+  char tmpstr[1024];
+  int type = 0;
+  int i, n, rep;
+
+  if (!(r=calloc(1,sizeof(nx_trigger_rules_t))))
+    die("out of memory");
+
+  for (node=mxmlFindElement(rules,rules,"rule",NULL,NULL,MXML_DESCEND); node;
+       node=mxmlFindElement(node,rules,"rule",NULL,NULL,MXML_DESCEND)) {
+    n=r->count+1;
+    if (r->count >= TRIGGER_RULES_MAX)
+      die("too many trigger rules (max %d)",TRIGGER_RULES_MAX);
+
+    if (!(event=mxmlElementGetAttr(node,"event")))
+      die("trigger rule %d: missing 'event' attribute",n);
+    if (!strcmp(event,"zone")) type=NX_EVENT_ZONE;
+    else if (!strcmp(event,"partition")) type=NX_EVENT_PARTITION;
+    else if (!strcmp(event,"log")) type=NX_EVENT_LOG;
+    else die("trigger rule %d: invalid event type: %s",n,event);
+
+    /* partitions */
+    partmask=0xff;
+    if ((s=mxmlElementGetAttr(node,"partitions"))) {
+      memset(parts,0,sizeof(parts));
+      if (parse_range_list(s,parts,1,NX_PARTITIONS_MAX) < 0)
+	die("trigger rule %d: invalid partitions: %s",n,s);
+      for (partmask=0, i=0; i<NX_PARTITIONS_MAX; i++)
+	if (parts[i]) partmask|=(1 << i);
+    }
+
+    /* zones / partitions / log event types */
+    memset(num,(type == NX_EVENT_ZONE || type == NX_EVENT_LOG ? 1 : 0),sizeof(num));
+    if (type == NX_EVENT_PARTITION) {
+      for (i=0; i<NX_PARTITIONS_MAX; i++)
+	num[i]=(partmask & (1 << i) ? 1 : 0);
+      partmask=0xff;
+    }
+    if (type == NX_EVENT_ZONE && (s=mxmlElementGetAttr(node,"zones"))) {
+      memset(num,0,sizeof(num));
+      if (parse_range_list(s,num,1,NX_ZONES_MAX) < 0)
+	die("trigger rule %d: invalid zones: %s",n,s);
+    }
+    if (type == NX_EVENT_LOG) {
+      if ((s=mxmlElementGetAttr(node,"types"))) {
+	memset(num,0,sizeof(num));
+	if (parse_range_list(s,num,0,NX_EVENT_TYPE_MASK) < 0)
+	  die("trigger rule %d: invalid log event types: %s",n,s);
+      }
+      /* log event type with reporting bit (0x80) cleared is a reporting event */
+      for (i=0; i<=NX_EVENT_TYPE_MASK; i++) num[i | 0x80]=num[i];
+      if ((s=mxmlElementGetAttr(node,"reporting"))) {
+	if (sscanf(s,"%d",&rep) != 1) die("trigger rule %d: invalid reporting setting",n);
+	for (i=0; i<=NX_EVENT_TYPE_MASK; i++) {
+	  if (rep) num[i | 0x80]=0;
+	  else num[i]=0;
+	}
+      }
+    }
+
+    /* flag changes */
+    set=clear=0;
+    if ((s=mxmlElementGetAttr(node,"flags"))) {
+      if (type == NX_EVENT_LOG ||
+	  parse_flag_list(s,(type == NX_EVENT_ZONE ? nx_zone_flag_names : nx_partition_flag_names),
+			  &set,&clear) < 0)
+	die("trigger rule %d: invalid flags: %s",n,s);
+    }
+
+    if ((s=mxmlElementGetAttr(node,"name")))
+      r->name[r->count]=strdup(s);
+    if ((s=mxmlElementGetAttr(node,"program"))) {
+      if (mode == TRIGGER_MODE_PERSISTENT)
+	die("trigger rule %d: program cannot be set in persistent mode",n);
+      EXPAND_FILENAME(tmpstr,dir,s);
+      r->program[r->count]=strdup(tmpstr);
+    }
+    if ((s=mxmlElementGetAttr(node,"action"))) {
+      if (!strcmp(s,"ignore")) r->ignore|=(1U << r->count);
+      else if (strcmp(s,"run")) die("trigger rule %d: invalid action: %s",n,s);
+    }
+
+    compile_trigger_rule(&r->table[type-1],r->count,num,NX_ZONES_MAX,partmask,
+			 (mxmlElementGetAttr(node,"flags") != NULL),set,clear);
+    r->used[type-1]|=(1U << r->count);
+    r->count++;
+  }
+
+  return r;
+}
+
+
 int load_config(const char *configfile, nx_configuration_t *config, int logtest)
 {
   mxml_node_t *configxml, *node;
@@ -146,6 +359,34 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
     die("invalid serial protocol setting in configuration");
   }
 
+  config->serial_timeout=NX_DEFAULT_TIMEOUT;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","serial","timeout");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i > 0) config->serial_timeout=i;
+    else die("invalid serial timeout setting");
+  }
+
+  config->serial_frame_timeout=NX_DEFAULT_FRAME_TIMEOUT;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","serial","frametimeout");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i > 0) config->serial_frame_timeout=i;
+    else die("invalid serial frametimeout setting");
+  }
+
+  config->serial_retry=NX_DEFAULT_RETRY;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","serial","retry");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 0) config->serial_retry=i;
+    else die("invalid serial retry setting");
+  }
+
+  config->serial_window=NX_DEFAULT_WINDOW;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","serial","window");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i > 0) config->serial_window=i;
+    else die("invalid serial window setting");
+  }
+
 
   node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","alarm","partitions");
   if (!node) die("cannot find alarm partitions in configuration");
@@ -167,6 +408,12 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
   if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->statuscheck=i;
   else die("invalid alarm statuscheck setting");
 
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","alarm","faststart");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->fast_start=i;
+    else die("invalid alarm faststart setting");
+  }
+
 
   node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","shm","shmkey");
   if (!node) die("cannot find shm shmkey in configuration");
@@ -234,6 +481,21 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
     config->msg_uid=-1;
   }
 
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","shm","replykey");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%x",&i)==1) config->replykey=i;
+    else die("invalid shm replykey setting");
+  } else {
+    config->replykey=config->msgkey+1;
+  }
+
+  config->reply_backlog=IPC_REPLY_BACKLOG;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","shm","replybacklog");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i > 0) config->reply_backlog=i;
+    else die("invalid shm replybacklog setting");
+  }
+
 
 
   config->syslog_mode=0;
@@ -267,6 +529,30 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
     config->status_file=strdup(tmpstr);
   }
 
+  node=search_xml_tree(configxml,MXML_OPAQUE,2,"configuration","statefile");
+  if (node) {
+    EXPAND_FILENAME(tmpstr,dir,mxmlGetOpaque(node));
+    config->state_file=strdup(tmpstr);
+  }
+
+  config->state_save_interval=10;
+  node=search_xml_tree(configxml,MXML_OPAQUE,2,"configuration","savestate");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->state_save_interval=i;
+  }
+
+  node=search_xml_tree(configxml,MXML_OPAQUE,2,"configuration","commandsocket");
+  if (node) {
+    EXPAND_FILENAME(tmpstr,dir,mxmlGetOpaque(node));
+    config->cmd_socket=strdup(tmpstr);
+  }
+
+  node=search_xml_tree(configxml,MXML_OPAQUE,2,"configuration","topologyfile");
+  if (node) {
+    EXPAND_FILENAME(tmpstr,dir,mxmlGetOpaque(node));
+    config->topology_file=strdup(tmpstr);
+  }
+
   node=search_xml_tree(configxml,MXML_OPAQUE,2,"configuration","savestatus");
   if (node) {
     if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->status_save_interval=i;
@@ -300,6 +586,113 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
   if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->max_triggers=i;
   else die("invalid 'zonestatus' setting");
 
+  config->trigger_mode=TRIGGER_MODE_EXEC;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","triggers","mode");
+  if (node) {
+    if (strstr(mxmlGetOpaque(node),"exec")) config->trigger_mode=TRIGGER_MODE_EXEC;
+    else if (strstr(mxmlGetOpaque(node),"persistent")) config->trigger_mode=TRIGGER_MODE_PERSISTENT;
+    else die("invalid 'triggers::mode' setting");
+  }
+
+  config->trigger_format=TRIGGER_FORMAT_ENV;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","triggers","format");
+  if (node) {
+    if (strstr(mxmlGetOpaque(node),"env")) config->trigger_format=TRIGGER_FORMAT_ENV;
+    else if (strstr(mxmlGetOpaque(node),"json")) config->trigger_format=TRIGGER_FORMAT_JSON;
+    else die("invalid 'triggers::format' setting");
+  }
+
+  config->trigger_buffer=TRIGGER_BUFFER_SIZE;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","triggers","buffersize");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 1024) config->trigger_buffer=i;
+    else die("invalid 'triggers::buffersize' setting");
+  }
+
+  config->trigger_queue=TRIGGER_QUEUE_SIZE;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","triggers","queuesize");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 0) config->trigger_queue=i;
+    else die("invalid 'triggers::queuesize' setting");
+  }
+
+  config->trigger_coalesce=0;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","triggers","coalesce");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1) config->trigger_coalesce=i;
+    else die("invalid 'triggers::coalesce' setting");
+  }
+
+  config->mqtt_host=NULL;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","host");
+  if (node) config->mqtt_host=strdup(mxmlGetOpaque(node));
+
+  config->mqtt_port=MQTT_PORT;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","port");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i > 0 && i < 65536) config->mqtt_port=i;
+    else die("invalid 'mqtt::port' setting");
+  }
+
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","clientid");
+  config->mqtt_client_id=strdup(node ? mxmlGetOpaque(node) : MQTT_CLIENT_ID);
+
+  config->mqtt_user=NULL;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","user");
+  if (node) config->mqtt_user=strdup(mxmlGetOpaque(node));
+
+  config->mqtt_password=NULL;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","password");
+  if (node) config->mqtt_password=strdup(mxmlGetOpaque(node));
+
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","prefix");
+  config->mqtt_prefix=strdup(node ? mxmlGetOpaque(node) : MQTT_PREFIX);
+
+  config->mqtt_qos=0;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","qos");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 0 && i <= 2) config->mqtt_qos=i;
+    else die("invalid 'mqtt::qos' setting");
+  }
+
+  config->mqtt_keepalive=MQTT_KEEPALIVE;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","keepalive");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 5 && i <= 65535) config->mqtt_keepalive=i;
+    else die("invalid 'mqtt::keepalive' setting");
+  }
+
+  config->mqtt_queue=MQTT_QUEUE_SIZE;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","mqtt","queuesize");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 16) config->mqtt_queue=i;
+    else die("invalid 'mqtt::queuesize' setting");
+  }
+
+  config->trigger_rules=NULL;
+  node=search_xml_tree(configxml,MXML_ELEMENT,3,"configuration","triggers","rules");
+  if (node) config->trigger_rules=load_trigger_rules(node,dir,config->trigger_mode);
+
+  config->debounce_window=0;
+  for (i=0; i<NX_ZONES_MAX; i++) config->debounce_zone[i]=-1;
+  for (i=0; i<NX_ZONE_TYPE_BITS; i++) config->debounce_type[i]=-1;
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","debounce","window");
+  if (node) {
+    if (sscanf(mxmlGetOpaque(node),"%d",&i)==1 && i >= 0 && i <= 3600) config->debounce_window=i;
+    else die("invalid 'debounce::window' setting");
+  }
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","debounce","zones");
+  if (node) {
+    if (parse_debounce_list(mxmlGetOpaque(node),config->debounce_zone,NX_ZONES_MAX,NULL) < 0)
+      die("invalid 'debounce::zones' setting");
+  }
+  node=search_xml_tree(configxml,MXML_OPAQUE,3,"configuration","debounce","types");
+  if (node) {
+    if (parse_debounce_list(mxmlGetOpaque(node),config->debounce_type,NX_ZONE_TYPE_BITS,
+			    zone_type_names) < 0)
+      die("invalid 'debounce::types' setting");
+  }
+
 
 
   mxmlDelete(configxml);
@@ -310,7 +703,7 @@ int load_config(const char *configfile, nx_configuration_t *config, int logtest)
 int save_status_xml(const char *filename, nx_system_status_t *astat)
 {
   FILE *fp;
-  mxml_node_t *xml,*zones,*partitions,*z,*e,*p;
+  mxml_node_t *xml,*zones,*partitions,*log,*z,*e,*p;
   int i;
   int part_count = 0;
   int zone_count = 0;
@@ -319,7 +712,12 @@ int save_status_xml(const char *filename, nx_system_status_t *astat)
 
   xml=mxmlNewXML("1.0");
   zones=mxmlNewElement(xml,"AlarmZones");
+  mxmlElementSetAttrf(zones,"panelid","%u",astat->panel_id);
+  mxmlElementSetAttrf(zones,"zones","%d",astat->last_zone);
   partitions=mxmlNewElement(xml,"AlarmPartitions");
+  log=mxmlNewElement(xml,"AlarmLog");
+  mxmlElementSetAttrf(log,"cursor","%d",astat->log_cursor);
+  mxmlElementSetAttrf(log,"size","%d",astat->last_log);
 
 
   /* loop through partitions */
@@ -450,6 +848,25 @@ int load_status_xml(const char *filename, nx_system_status_t *astat)
   }
 
 
+  /* parse AlarmLog section (last log entry received) */
+
+  node=mxmlFindElement(xml,xml,"AlarmLog",NULL,NULL,MXML_DESCEND);
+  if (node) {
+    const char *cursor_s = mxmlElementGetAttr(node,"cursor");
+    const char *size_s = mxmlElementGetAttr(node,"size");
+    int cursor, size;
+
+    if (cursor_s && size_s &&
+	sscanf(cursor_s,"%d",&cursor) == 1 && sscanf(size_s,"%d",&size) == 1 &&
+	size > 0 && size <= NX_MAX_LOG_ENTRIES && cursor < size &&
+	astat->log_cursor < 0 && (astat->last_log == 0 || astat->last_log == size)) {
+      logmsg(3,"restore log position: %d (size %d)",cursor,size);
+      astat->log_cursor=cursor;
+      astat->last_log=size;
+    }
+  }
+
+
   /* parse AlarmPartitions section */
 
   node=partitions;
@@ -494,4 +911,133 @@ int load_status_xml(const char *filename, nx_system_status_t *astat)
   return 0;
 }
 
+
+/* restore zone names from status file (if it was saved for same panel),
+   returns number of zone names restored or < 0 on error */
+int load_zone_names(const char *filename, nx_system_status_t *astat)
+{
+  mxml_node_t *xml, *zones, *node;
+  const char *s;
+  int id, count = 0;
+
+  if (!filename || !astat) return -1;
+
+  xml=load_xml_file(filename);
+  if (!xml) return -2;
+
+  zones=mxmlFindElement(xml,xml,"AlarmZones",NULL,NULL,MXML_DESCEND);
+  if (!zones) {
+    mxmlDelete(xml);
+    return -3;
+  }
+
+  /* check that cached names are for the same panel */
+  if (!(s=mxmlElementGetAttr(zones,"panelid")) || sscanf(s,"%d",&id) != 1 ||
+      id != astat->panel_id) {
+    mxmlDelete(xml);
+    return -4;
+  }
+  if (!(s=mxmlElementGetAttr(zones,"zones")) || sscanf(s,"%d",&id) != 1 ||
+      id != astat->last_zone) {
+    mxmlDelete(xml);
+    return -5;
+  }
+
+  node=zones;
+  while ((node=mxmlFindElement(node,zones,"Zone",NULL,NULL,MXML_DESCEND))) {
+    const char *id_s = mxmlElementGetAttr(node,"id");
+    const char *name_s = mxmlElementGetAttr(node,"name");
+
+    if (id_s && name_s && sscanf(id_s,"%d",&id) == 1 &&
+	id > 0 && id <= astat->last_zone) {
+      strlcpy(astat->zones[id-1].name,name_s,sizeof(astat->zones[id-1].name));
+      count++;
+    }
+  }
+
+  mxmlDelete(xml);
+  return count;
+}
+
+
+int save_topology_xml(const char *filename, const nx_bus_node_t *nodes)
+{
+  FILE *fp;
+  mxml_node_t *xml,*bus,*n;
+  int i;
+
+  if (!filename || !nodes) return -1;
+
+  xml=mxmlNewXML("1.0");
+  bus=mxmlNewElement(xml,"BusTopology");
+  mxmlElementSetAttrf(bus,"updated","%lu",(unsigned long)time(NULL));
+
+  /* nodes not listed are considered absent */
+  for(i=0;i<NX_BUS_NODES;i++) {
+    if (nodes[i].state != NX_NODE_PRESENT) continue;
+    n=mxmlNewElement(bus,"Node");
+    mxmlElementSetAttrf(n,"id","%d",i);
+    mxmlElementSetAttrf(n,"len","%u",nodes[i].len);
+    mxmlElementSetAttrf(n,"type","%u",nodes[i].type);
+    mxmlElementSetAttrf(n,"rtt","%d",nodes[i].rtt);
+  }
+
+  fp=fopen(filename,"w");
+  if (!fp) {
+    warn("failed to create file: %s", filename);
+    mxmlDelete(xml);
+    return -2;
+  }
+
+  mxmlSetWrapMargin(0);
+  mxmlSaveFile(xml,fp,xml_whitespace_cb);
+  fclose(fp);
+
+  mxmlDelete(xml);
+
+  return 0;
+}
+
+
+int load_topology_xml(const char *filename, nx_bus_node_t *nodes)
+{
+  mxml_node_t *xml, *bus, *node;
+  const char *s;
+  int i, id, count = 0;
+
+  if (!filename || !nodes) return -1;
+
+  xml=load_xml_file(filename);
+  if (!xml) return -2;
+
+  bus=mxmlFindElement(xml,xml,"BusTopology",NULL,NULL,MXML_DESCEND);
+  if (!bus) {
+    mxmlDelete(xml);
+    return -3;
+  }
+
+  for(i=0;i<NX_BUS_NODES;i++) {
+    memset(&nodes[i],0,sizeof(nx_bus_node_t));
+    nodes[i].state=NX_NODE_ABSENT;
+  }
+
+  node=bus;
+  while ((node=mxmlFindElement(node,bus,"Node",NULL,NULL,MXML_DESCEND))) {
+    if (!(s=mxmlElementGetAttr(node,"id")) || sscanf(s,"%d",&id) != 1 ||
+	id < 0 || id >= NX_BUS_NODES)
+      continue;
+    nodes[id].state=NX_NODE_PRESENT;
+    if ((s=mxmlElementGetAttr(node,"len")) && sscanf(s,"%d",&i) == 1)
+      nodes[id].len=i;
+    if ((s=mxmlElementGetAttr(node,"type")) && sscanf(s,"%d",&i) == 1)
+      nodes[id].type=i;
+    if ((s=mxmlElementGetAttr(node,"rtt")) && sscanf(s,"%d",&i) == 1)
+      nodes[id].rtt=i;
+    count++;
+  }
+
+  mxmlDelete(xml);
+  return count;
+}
+
 /* eof :-) */
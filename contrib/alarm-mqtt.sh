@@ -2,6 +2,7 @@
 #
 # alarm-mqtt.sh  -- sample trigger script for writing events to mqtt for nxgipd daemon
 # requires mosquitto_pub to be installed
+# (nxgipd can also publish to MQTT broker directly, see <mqtt> in nxgipd.conf)
 #
 # This gets called in response to events in monitored alarm system.
 # Information about the even is passed in environment variables to
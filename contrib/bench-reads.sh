@@ -0,0 +1,120 @@
+#!/bin/sh
+#
+# bench-reads.sh  -- compare number of serial read() calls between two
+#                    nxgipd versions
+#
+# Builds nxgipd from an older revision (default: the last version that
+# read serial data one byte at a time) and dumps the panel log from the
+# simulated panel (contrib/nxsim.py) with both the old and the given
+# nxgipd binary. Read calls on the serial device are counted with
+# contrib/readcount.c (LD_PRELOAD) and reported per received message.
+#
+# usage: bench-reads.sh [nxgipd binary] [old revision]
+#
+# Environment: PROTOCOL (binary or ascii, default binary),
+#              BAUD (default 9600)
+#              (CPPFLAGS/LDFLAGS are passed to configure when building
+#              the old revision)
+#
+
+NXGIPD=${1:-./nxgipd}
+REV=${2:-5952ac1}
+PROTOCOL=${PROTOCOL:-binary}
+BAUD=${BAUD:-9600}
+CONTRIB=`cd \`dirname $0\` && pwd`
+TOP=`dirname $CONTRIB`
+KEY=0x6e784e01
+
+if [ ! -x "$NXGIPD" ]; then
+  echo "$NXGIPD: not found (build nxgipd first)"
+  exit 1
+fi
+NXGIPD=`cd \`dirname $NXGIPD\` && pwd`/`basename $NXGIPD`
+
+TMP=`mktemp -d /tmp/nxbench.XXXXXX` || exit 1
+cleanup() {
+  [ -n "$SIMPID" ] && kill $SIMPID 2>/dev/null
+  ipcrm -M $KEY 2>/dev/null
+  ipcrm -Q $KEY 2>/dev/null
+  rm -rf $TMP
+}
+trap cleanup EXIT INT TERM
+
+gcc -shared -fPIC -O2 -o $TMP/readcount.so $CONTRIB/readcount.c -ldl || exit 1
+
+echo "building nxgipd from revision $REV..."
+mkdir $TMP/old
+(git -C $TOP archive $REV | tar -x -C $TMP/old) || exit 1
+(cd $TMP/old && ./configure && make nxgipd) > $TMP/build.log 2>&1
+if [ ! -x $TMP/old/nxgipd ]; then
+  cat $TMP/build.log
+  exit 1
+fi
+
+[ "$PROTOCOL" = "ascii" ] && SIMOPT=--ascii
+
+run() {
+  python3 $CONTRIB/nxsim.py --link $TMP/tty --ctl $TMP/ctl --baud $BAUD \
+	  $SIMOPT > $TMP/sim.log 2>&1 &
+  SIMPID=$!
+  while [ ! -e $TMP/tty ]; do sleep 0.1; done
+
+  cat > $TMP/nxgipd.conf <<EOC
+<?xml version="1.0"?>
+<configuration>
+  <serial>
+    <device>$TMP/tty</device>
+    <speed>$BAUD</speed>
+    <mode>8N1</mode>
+    <protocol>$PROTOCOL</protocol>
+  </serial>
+  <alarm>
+    <partitions>0</partitions>
+    <zones>0</zones>
+    <statuscheck>0</statuscheck>
+    <timesync>0</timesync>
+  </alarm>
+  <syslog>-1</syslog>
+  <log>1</log>
+  <triggers>
+    <logentry>0</logentry>
+    <partitionstatus>0</partitionstatus>
+    <zonestatus>0</zonestatus>
+    <maxprocesses>0</maxprocesses>
+  </triggers>
+  <shm>
+    <shmkey>$KEY</shmkey>
+    <shmmode>0600</shmmode>
+    <msgkey>$KEY</msgkey>
+    <msgmode>0600</msgmode>
+  </shm>
+  <directory>$TMP</directory>
+  <logfile>nxgipd.log</logfile>
+  <statusfile>status.xml</statusfile>
+  <savestatus>0</savestatus>
+</configuration>
+EOC
+  (cd $TMP && LD_PRELOAD=$TMP/readcount.so $1 -c $TMP/nxgipd.conf --log-only \
+     < /dev/null > $TMP/out.log 2> $TMP/err.log)
+  echo quit > $TMP/ctl
+  wait $SIMPID 2>/dev/null; SIMPID=
+  ipcrm -M $KEY 2>/dev/null
+  ipcrm -Q $KEY 2>/dev/null
+  rm -f $TMP/tty $TMP/ctl
+
+  reads=`sed -n -e 's/^readcount: \([0-9]*\) reads.*$/\1/p' $TMP/err.log`
+  msgs=`sed -n -e "s/^stats.*'tx': \([0-9]*\).*$/\1/p" $TMP/sim.log`
+  if [ -z "$reads" ] || [ -z "$msgs" ] || [ "$msgs" -eq 0 ]; then
+    echo "$2: no results:"
+    cat $TMP/err.log $TMP/out.log
+    exit 1
+  fi
+  echo "$2: $msgs messages, $reads reads" | \
+    awk '{ printf("%s %d messages, %d reads (%.2f reads/message)\n",$1,$2,$4,$4/$2); }'
+}
+
+echo "protocol=$PROTOCOL baud=$BAUD"
+run $TMP/old/nxgipd "$REV"
+run $NXGIPD current
+
+# eof :-)
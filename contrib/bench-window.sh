@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# bench-window.sh  -- measure zone name/status sync time for different
+#                     request window sizes (<window> in nxgipd.conf)
+#
+# Runs nxgipd against the simulated panel (contrib/nxsim.py) once for
+# each window size and prints the time get_system_status() took to
+# read names and statuses of all zones.
+#
+# usage: bench-window.sh [nxgipd binary] [window sizes...]
+#
+# Environment: ZONES (default 192), DELAY (panel processing time in
+# seconds, default 0.02), BAUD (default 9600)
+#
+
+NXGIPD=${1:-./nxgipd}
+[ $# -gt 0 ] && shift
+WINDOWS=${*:-1 2 4}
+ZONES=${ZONES:-192}
+DELAY=${DELAY:-0.02}
+BAUD=${BAUD:-9600}
+SIM="`dirname $0`/nxsim.py"
+KEY=0x6e784e00
+
+if [ ! -x "$NXGIPD" ]; then
+  echo "$NXGIPD: not found (build nxgipd first)"
+  exit 1
+fi
+
+TMP=`mktemp -d /tmp/nxbench.XXXXXX` || exit 1
+cleanup() {
+  [ -n "$NXPID" ] && kill $NXPID 2>/dev/null
+  [ -n "$SIMPID" ] && kill $SIMPID 2>/dev/null
+  ipcrm -M $KEY 2>/dev/null
+  ipcrm -Q $KEY 2>/dev/null
+  rm -rf $TMP
+}
+trap cleanup EXIT INT TERM
+
+echo "zones=$ZONES baud=$BAUD panel delay=${DELAY}s"
+
+for w in $WINDOWS; do
+  python3 $SIM --link $TMP/tty --ctl $TMP/ctl --zones $ZONES \
+	  --delay $DELAY --baud $BAUD > $TMP/sim.log 2>&1 &
+  SIMPID=$!
+  while [ ! -e $TMP/tty ]; do sleep 0.1; done
+
+  cat > $TMP/nxgipd.conf <<EOC
+<?xml version="1.0"?>
+<configuration>
+  <serial>
+    <device>$TMP/tty</device>
+    <speed>$BAUD</speed>
+    <mode>8N1</mode>
+    <protocol>binary</protocol>
+    <window>$w</window>
+  </serial>
+  <alarm>
+    <partitions>0</partitions>
+    <zones>0</zones>
+    <statuscheck>0</statuscheck>
+    <timesync>0</timesync>
+    <faststart>0</faststart>
+  </alarm>
+  <syslog>-1</syslog>
+  <log>1</log>
+  <triggers>
+    <logentry>0</logentry>
+    <partitionstatus>0</partitionstatus>
+    <zonestatus>0</zonestatus>
+    <maxprocesses>0</maxprocesses>
+  </triggers>
+  <shm>
+    <shmkey>$KEY</shmkey>
+    <shmmode>0600</shmmode>
+    <msgkey>$KEY</msgkey>
+    <msgmode>0600</msgmode>
+  </shm>
+  <directory>$TMP</directory>
+  <logfile>nxgipd.log</logfile>
+  <statusfile>status.xml</statusfile>
+  <savestatus>0</savestatus>
+</configuration>
+EOC
+  rm -f $TMP/nxgipd.log
+  $NXGIPD -c $TMP/nxgipd.conf > $TMP/out.log 2>&1 &
+  NXPID=$!
+  i=0
+  while ! grep -q "Waiting for messages" $TMP/nxgipd.log 2>/dev/null; do
+    i=$((i+1))
+    if [ $i -gt 600 ] || ! kill -0 $NXPID 2>/dev/null; then
+      echo "window=$w: nxgipd did not start:"
+      cat $TMP/out.log $TMP/nxgipd.log 2>/dev/null
+      exit 1
+    fi
+    sleep 0.1
+  done
+  kill $NXPID; wait $NXPID 2>/dev/null; NXPID=
+  kill $SIMPID; wait $SIMPID 2>/dev/null; SIMPID=
+  ipcrm -M $KEY 2>/dev/null
+  ipcrm -Q $KEY 2>/dev/null
+
+  grep "Zone names and statuses received" $TMP/nxgipd.log | \
+    sed -e 's/^.*received: //'
+done
+
+# eof :-)
@@ -0,0 +1,339 @@
+#!/usr/bin/env python3
+#
+# nxsim.py  -- simulated NX-8E panel (NX-584 interface) for testing nxgipd
+#
+# Creates a pseudo terminal and a symlink to it (--link), which can be used
+# as <device> in the <serial> section of nxgipd.conf. Panel processing time
+# (--delay) and line speed (--baud) are simulated, so timings are
+# comparable between runs (and between nxgipd versions).
+#
+# Commands can be written to the control fifo (--ctl), one per line:
+#
+#   zone <n> fault|ok [ack]   change zone status and send zone message
+#   zcond <n> <flags>         change zone condition flags silently
+#   ztype <n> <type>          change zone type flags (byte 1)
+#   storm <n> <count>         toggle zone status <count> times
+#   burst <n> <count>         same as storm, but send all messages at once
+#   inject <n> ...            toggle zones between host requests
+#   noise <count>             send <count> random bytes
+#   log <event> <num>         add log entry and send log message
+#   quietlog <event> <num>    add log entry silently
+#   stats                     print message counters to stdout
+#   quit                      print message counters and exit
+#
+# Example:
+#   contrib/nxsim.py --link /tmp/nxsim.tty --ctl /tmp/nxsim.ctl &
+#   echo "zone 3 fault" > /tmp/nxsim.ctl
+#
+import os, pty, sys, time, select, tty, argparse, random, threading, queue
+
+ap = argparse.ArgumentParser(description='simulated NX-8E panel')
+ap.add_argument('--link', default='nxsim.tty', help='pty symlink to create')
+ap.add_argument('--ascii', action='store_true', help='use ASCII protocol')
+ap.add_argument('--zones', type=int, default=192)
+ap.add_argument('--panelid', type=int, default=4)
+ap.add_argument('--baud', type=int, default=9600)
+ap.add_argument('--delay', type=float, default=0.02, help='panel processing delay (s)')
+ap.add_argument('--ctl', default='nxsim.ctl', help='control fifo to create')
+ap.add_argument('--logsize', type=int, default=185)
+ap.add_argument('--lognext', type=int, default=40)
+ap.add_argument('--modules', default='8,192,193,72', help='bus devices with program data')
+ap.add_argument('--absent', default='failed', help='failed|noreply')
+args = ap.parse_args()
+
+master, slave = pty.openpty()
+tty.setraw(slave)
+name = os.ttyname(slave)
+try: os.unlink(args.link)
+except FileNotFoundError: pass
+os.symlink(name, args.link)
+print('pty', name, '->', args.link, flush=True)
+
+try: os.unlink(args.ctl)
+except FileNotFoundError: pass
+os.mkfifo(args.ctl)
+ctlfd = os.open(args.ctl, os.O_RDONLY | os.O_NONBLOCK)
+
+def fletcher(data):
+    s1 = s2 = 0
+    for b in data:
+        if 255 - s1 < b: s1 = (s1 + 1) & 0xff
+        s1 = (s1 + b) & 0xff
+        if s1 == 255: s1 = 0
+        if 255 - s2 < s1: s2 = (s2 + 1) & 0xff
+        s2 = (s2 + s1) & 0xff
+        if s2 == 255: s2 = 0
+    return s1, s2
+
+def encode(msgnum, data):
+    body = bytes([len(data) + 1, msgnum]) + bytes(data)
+    s1, s2 = fletcher(body)
+    full = body + bytes([s1, s2])
+    if args.ascii:
+        return b'\n' + full.hex().upper().encode() + b'\r'
+    out = bytearray([0x7e])
+    for b in full:
+        if b in (0x7e, 0x7d): out += bytes([0x7d, b ^ 0x20])
+        else: out.append(b)
+    return bytes(out)
+
+stats = {'rx': 0, 'tx': 0, 'req': {}}
+outq = []
+
+def send(msgnum, data, ack=False):
+    pkt = encode(msgnum | (0x80 if ack else 0), data)
+    outq.append(pkt)
+
+# UART transmitter: replies are sent while panel processes next request
+txq = queue.Queue()
+def txthread():
+    while True:
+        pkt = txq.get()
+        time.sleep(len(pkt) * 10.0 / args.baud)
+        os.write(master, pkt)
+        stats['tx'] += 1
+threading.Thread(target=txthread, daemon=True).start()
+
+def flush():
+    while outq:
+        txq.put(outq.pop(0))
+
+zones = []
+for i in range(args.zones):
+    zones.append({'pmask': 0x01 if i < 100 else 0x02, 'type': [0x02 if i == 5 else (0x01 if i == 6 else 0x10), 0x10, 0], 'cond': [0, 0], 'name': ('Zone %d name' % (i+1))[:16].ljust(16)})
+parts = [bytearray([0, 0x00, 0, 0, 0, 0, 0x04, 0]) for i in range(8)]
+logsize = args.logsize
+log = {}
+for i in range(args.lognext):
+    log[i] = [i % 64 if (i % 64) in (0,1,2,3,40,41) else 40, i % 8, 0, 10, 17, 12, (i % 60)]
+lognext = args.lognext
+prog = {}
+for dev in [int(x) for x in args.modules.split(',') if x]:
+    d = {}
+    for loc in range(0, 400 if dev == 8 else 60):
+        if 100 <= loc < 200 and dev == 8: continue   # unused block
+        ln = (loc % 16) + 1
+        t = loc % 4
+        nib = 1 if (loc % 5 == 0 and t != 3) else 0
+        data = [(loc + k) & (0x0f if nib else 0xff) for k in range(ln)]
+        if t == 3: data = [0x41 + (k % 26) for k in range(ln)]
+        d[loc] = [t, nib, ln, data]
+    prog[dev] = d
+
+def sysstatus():
+    return [args.panelid, 0, 0, 0, 0, 0, 0, 0, 0, 0x03, (lognext - 1) % logsize]
+
+def zonestatus(i):
+    z = zones[i]
+    return [i, z['pmask']] + z['type'] + z['cond']
+
+def snapshot(off):
+    out = [off]
+    for k in range(8):
+        b = 0
+        for h in range(2):
+            zi = off * 16 + k * 2 + h
+            if zi < len(zones):
+                c = zones[zi]['cond']
+                v = (1 if c[0] & 1 else 0) | (2 if c[0] & 8 else 0) | (4 if c[0] & 4 else 0) | (8 if c[1] & 1 else 0)
+                b |= v << (4 * h)
+        out.append(b)
+    return out
+
+def progreply(dev, loc, seg):
+    t, nib, ln, data = prog[dev][loc]
+    size = (ln + 1) // 2 if nib else ln
+    if nib:
+        packed = [(data[k] & 0x0f) | ((data[k+1] & 0x0f) << 4 if k + 1 < ln else 0) for k in range(0, ln, 2)]
+    else:
+        packed = list(data)
+    chunk = packed[seg*8:seg*8+8]
+    chunk += [0] * (8 - len(chunk))
+    return [dev, ((loc >> 8) & 0x0f) | (0x10 if nib else 0) | (0x40 if seg else 0), loc & 0xff, (t << 5) | (ln - 1)] + chunk
+
+def logreply(n):
+    if n not in log:
+        e = [0x7f, 0, 0, 1, 1, 0, 0]
+    else:
+        e = log[n]
+    return [n, logsize] + e
+
+def addlog(ev, num, part):
+    global lognext
+    t = time.localtime()
+    n = lognext % logsize
+    log[n] = [ev, num, part, t.tm_mon, t.tm_mday, t.tm_hour, t.tm_min]
+    lognext = (lognext + 1) % logsize
+    return n
+
+inject = []
+
+def handle(msgnum, data):
+    stats['rx'] += 1
+    while inject and (msgnum & 0x3f) not in (0x1d, 0x1e, 0x1f, 0x1c):
+        z = inject.pop(0)
+        zones[z]['cond'][0] ^= 1
+        send(0x04, zonestatus(z), ack=True)
+    m = msgnum & 0x3f
+    stats['req'][m] = stats['req'].get(m, 0) + 1
+    if m in (0x1d, 0x1e, 0x1f, 0x1c):
+        return
+    time.sleep(args.delay)
+    if m == 0x21:
+        send(0x01, list(b'1.00') + [0xff, 0xff, 0xff, 0xff, 0xff, 0xff])
+    elif m == 0x28:
+        send(0x08, sysstatus())
+    elif m == 0x27:
+        send(0x07, [0x07 if i < 2 else 0 for i in range(8)])
+    elif m == 0x26:
+        p = data[0]
+        send(0x06, [p] + list(parts[p][1:8]))
+    elif m == 0x23:
+        z = data[0]
+        if z >= len(zones): send(0x1f, [])
+        else: send(0x03, [z] + list(zones[z]['name'].encode()))
+    elif m == 0x24:
+        z = data[0]
+        if z >= len(zones): send(0x1f, [])
+        else: send(0x04, zonestatus(z))
+    elif m == 0x25:
+        off = data[0]
+        send(0x05, snapshot(off))
+    elif m == 0x2a:
+        send(0x0a, logreply(data[0]))
+    elif m == 0x30:
+        dev = data[0]; loc = ((data[1] & 0x0f) << 8) | data[2]; seg = 1 if data[1] & 0x40 else 0
+        if dev not in prog:
+            if args.absent == 'noreply':
+                return
+            time.sleep(1.0)   # absent node: panel times out on bus
+            send(0x1c, [])
+        elif loc not in prog[dev]:
+            send(0x1f, [])
+        else:
+            send(0x10, progreply(dev, loc, seg))
+    elif m == 0x31:
+        dev = data[0]; loc = ((data[1] & 0x0f) << 8) | data[2]; seg = 1 if data[1] & 0x40 else 0
+        if dev not in prog or loc not in prog[dev]:
+            send(0x1f, []); return
+        t, nib, ln, cur = prog[dev][loc]
+        vals = data[4:12]
+        if nib:
+            un = []
+            for v in vals: un += [v & 0x0f, (v >> 4) & 0x0f]
+            base = seg * 16
+            for k in range(16):
+                if base + k < ln: cur[base + k] = un[k]
+        else:
+            base = seg * 8
+            for k in range(8):
+                if base + k < ln: cur[base + k] = vals[k]
+        send(0x1d, [])
+    elif m in (0x3c, 0x3d):
+        fn = data[-2] if m == 0x3c else data[0]
+        pm = data[-1] if m == 0x3c else data[1]
+        send(0x1d, [])
+        for p in range(8):
+            if pm & (1 << p):
+                if fn == 1: parts[p][1] &= ~0x40
+                elif fn in (2, 3): parts[p][1] |= 0x40
+                flush()
+                send(0x06, [p] + list(parts[p][1:8]), ack=True)
+                n = addlog(41 if fn in (2,3) else 40, 0, p)
+                send(0x0a, logreply(n), ack=True)
+    elif m in (0x3e, 0x2b, 0x2c, 0x29, 0x3b):
+        send(0x1d, [])
+    elif m == 0x3f:
+        z = data[0]
+        zones[z]['cond'][0] ^= 0x08
+        send(0x1d, [])
+        flush()
+        send(0x04, zonestatus(z), ack=True)
+    else:
+        send(0x1f, [])
+
+def ctl(line):
+    w = line.split()
+    if not w: return
+    if w[0] == 'zone':
+        z = int(w[1]) - 1
+        if w[2] == 'fault': zones[z]['cond'][0] |= 1
+        elif w[2] == 'ok': zones[z]['cond'][0] &= ~1
+        send(0x04, zonestatus(z), ack=(len(w) > 3))
+    elif w[0] == 'zcond':    # change zone condition flags without notification
+        zones[int(w[1]) - 1]['cond'][0] = int(w[2], 0)
+    elif w[0] == 'ztype':
+        zones[int(w[1]) - 1]['type'][0] = int(w[2])
+    elif w[0] == 'storm':
+        z = int(w[1]) - 1; n = int(w[2])
+        for k in range(n):
+            zones[z]['cond'][0] ^= 1
+            send(0x04, zonestatus(z))
+    elif w[0] == 'burst':    # all messages in a single write
+        z = int(w[1]) - 1; n = int(w[2]); pkt = b''
+        for k in range(n):
+            zones[z]['cond'][0] ^= 1
+            pkt += encode(0x04, zonestatus(z))
+        outq.append(pkt)
+    elif w[0] == 'inject':
+        inject.extend([int(x) - 1 for x in w[1:]])
+    elif w[0] == 'noise':
+        outq.append(bytes(random.randrange(256) for _ in range(int(w[1]))))
+    elif w[0] == 'log':
+        n = addlog(int(w[1]), int(w[2]), 0)
+        send(0x0a, logreply(n))
+    elif w[0] == 'quietlog':   # log entry added without notification
+        addlog(int(w[1]), int(w[2]), 0)
+    elif w[0] == 'stats':
+        print('stats', stats, flush=True)
+    elif w[0] == 'quit':
+        print('stats', stats, flush=True); sys.exit(0)
+
+buf = bytearray()
+ctlbuf = b''
+while True:
+    flush()
+    r, _, _ = select.select([master, ctlfd], [], [], 0.5)
+    if ctlfd in r:
+        d = os.read(ctlfd, 4096)
+        if not d:
+            os.close(ctlfd); ctlfd = os.open(args.ctl, os.O_RDONLY | os.O_NONBLOCK)
+        ctlbuf += d
+        while b'\n' in ctlbuf:
+            l, ctlbuf = ctlbuf.split(b'\n', 1)
+            ctl(l.decode())
+    if master in r:
+        try: d = os.read(master, 4096)
+        except OSError: continue
+        buf += d
+        while True:
+            if args.ascii:
+                s = buf.find(b'\n')
+                if s < 0: buf.clear(); break
+                del buf[:s]
+                e = buf.find(b'\r')
+                if e < 0: break
+                frame = bytes.fromhex(buf[1:e].decode()); del buf[:e+1]
+            else:
+                s = buf.find(b'\x7e')
+                if s < 0: buf.clear(); break
+                del buf[:s]
+                if len(buf) < 2: break
+                # unstuff until we have len+3 bytes
+                out = []; i = 1
+                while i < len(buf) and (not out or len(out) < out[0] + 3):
+                    b = buf[i]
+                    if b == 0x7d:
+                        if i + 1 >= len(buf): break
+                        b = buf[i+1] ^ 0x20; i += 1
+                    out.append(b); i += 1
+                if not out or len(out) < out[0] + 3: break
+                del buf[:i]
+                frame = bytes(out)
+            ln = frame[0]
+            s1, s2 = fletcher(frame[:ln+1])
+            if (s1, s2) != (frame[ln+1], frame[ln+2]):
+                print('bad checksum from host', frame.hex(), flush=True)
+                send(0x1f, []); continue
+            handle(frame[1], frame[2:ln+1])
+            flush()
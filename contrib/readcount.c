@@ -0,0 +1,89 @@
+/* readcount.c - count read() calls on terminal devices (LD_PRELOAD)
+ *
+ * Used by bench-reads.sh to compare serial read counts between nxgipd
+ * versions. Counters are printed to stderr on exit.
+ *
+ * gcc -shared -fPIC -O2 -o readcount.so readcount.c -ldl
+ * LD_PRELOAD=./readcount.so nxgipd ...
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/uio.h>
+
+#define MAX_FD 1024
+
+static unsigned long read_calls = 0;
+static unsigned long read_bytes = 0;
+static signed char fd_tty[MAX_FD];
+
+
+static int is_tty(int fd)
+{
+  if (fd < 0 || fd >= MAX_FD)
+    return 0;
+  if (fd_tty[fd] == 0)
+    fd_tty[fd] = (isatty(fd) ? 1 : -1);
+  return (fd_tty[fd] > 0);
+}
+
+static void count(int fd, ssize_t r)
+{
+  if (!is_tty(fd))
+    return;
+  read_calls++;
+  if (r > 0)
+    read_bytes += r;
+}
+
+ssize_t read(int fd, void *buf, size_t count_)
+{
+  static ssize_t (*real_read)(int, void *, size_t) = NULL;
+  ssize_t r;
+
+  if (!real_read)
+    real_read = dlsym(RTLD_NEXT, "read");
+  r = real_read(fd, buf, count_);
+  count(fd, r);
+  return r;
+}
+
+ssize_t __read_chk(int fd, void *buf, size_t count_, size_t buflen)
+{
+  (void)buflen;
+  return read(fd, buf, count_);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  static ssize_t (*real_readv)(int, const struct iovec *, int) = NULL;
+  ssize_t r;
+
+  if (!real_readv)
+    real_readv = dlsym(RTLD_NEXT, "readv");
+  r = real_readv(fd, iov, iovcnt);
+  count(fd, r);
+  return r;
+}
+
+int close(int fd)
+{
+  static int (*real_close)(int) = NULL;
+
+  if (!real_close)
+    real_close = dlsym(RTLD_NEXT, "close");
+  if (fd >= 0 && fd < MAX_FD)
+    fd_tty[fd] = 0;
+  return real_close(fd);
+}
+
+static void __attribute__((destructor)) report(void)
+{
+  if (read_calls > 0)
+    fprintf(stderr, "readcount: %lu reads, %lu bytes\n",
+	    read_calls, read_bytes);
+}
+
+/* eof :-) */
@@ -1,4 +1,4 @@
-/* ipc.c - IPC shared memory and message queue hanling
+/* ipc.c - IPC shared memory and message queue hanling (and state image)
  *
  *
  * Copyright (C) 2009-2015 Timo Kokkonen <tjko@iki.fi>
@@ -22,13 +22,20 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
 
 #include "nxgipd.h"
 
@@ -90,7 +97,7 @@ int init_shared_memory(int shmkey, int shmmode, size_t size, int *shmidptr, nx_s
   /* initialize shared memory segment */
 
   memset(shm,0,size);
-  strlcpy(shm->shmversion,SHMVERSION,sizeof(shm->shmversion));
+  shm_init_header(shm);
   *shmptr=shm;
 
   return 0;
@@ -202,4 +209,240 @@ int read_message_queue(int msgid, nx_ipc_msg_t *msg)
 }
 
 
+
+/* send reply to a client, returns 1 if reply was sent, 0 if reply queue
+   is full (and sending should be retried later) */
+int send_message_reply(int msgid, long pid, const nx_ipc_msg_reply_t *reply)
+{
+  nx_ipc_reply_msg_t msg;
+
+  if (msgid < 0 || pid < 1 || !reply) return -1;
+
+  msg.msgtype=pid;
+  msg.reply=*reply;
+  if (msgsnd(msgid,&msg,sizeof(msg)-sizeof(long),IPC_NOWAIT) == 0)
+    return 1;
+
+  if (errno == EAGAIN || errno == EINTR)
+    return 0;
+
+  logmsg(0,"failed to send reply: %s (errno=%d)",strerror(errno),errno);
+  return -2;
+}
+
+
+/* remove replies to clients that are not running anymore from the
+   reply queue, returns number of replies removed */
+int purge_reply_queue(int msgid)
+{
+  nx_ipc_reply_msg_t msg;
+  struct msqid_ds info;
+  size_t msgsize = sizeof(nx_ipc_reply_msg_t) - sizeof(long);
+  int count, removed = 0;
+
+  if (msgid < 0) return -1;
+  if (msgctl(msgid,IPC_STAT,&info) < 0) return -2;
+
+  /* go through the queue once, putting back replies to running clients */
+  for (count=info.msg_qnum; count > 0; count--) {
+    if (msgrcv(msgid,&msg,msgsize,0,IPC_NOWAIT) != msgsize) break;
+    if (kill(msg.msgtype,0) < 0 && errno == ESRCH) {
+      removed++;
+      continue;
+    }
+    if (msgsnd(msgid,&msg,msgsize,IPC_NOWAIT) < 0) {
+      logmsg(0,"failed to requeue reply: %s (errno=%d)",strerror(errno),errno);
+      removed++;
+    }
+  }
+
+  if (removed > 0)
+    logmsg(2,"removed %d stale replies from reply queue",removed);
+
+  return removed;
+}
+
+
+
+int init_command_socket(const char *path, int mode)
+{
+  int sock;
+  struct sockaddr_un addr;
+
+  if (!path) return -1;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    logmsg(0,"command socket path too long: %s",path);
+    return -1;
+  }
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strlcpy(addr.sun_path,path,sizeof(addr.sun_path));
+
+  if ((sock = socket(AF_UNIX,SOCK_DGRAM,0)) < 0) {
+    logmsg(0,"socket() failed: %s (%d)",strerror(errno),errno);
+    return -2;
+  }
+
+  /* remove stale socket left behind by previous instance */
+  unlink(path);
+
+  if (bind(sock,(struct sockaddr*)&addr,sizeof(addr)) < 0) {
+    logmsg(0,"failed to bind command socket: %s: %s (%d)",path,strerror(errno),errno);
+    close(sock);
+    return -3;
+  }
+
+  /* socket should be accessible to the same users as the message queue */
+  if (chmod(path,(mode & 0777)) < 0)
+    logmsg(0,"failed to set command socket permissions: %s (%d)",strerror(errno),errno);
+  if (config->msg_uid >= 0 || config->msg_gid >= 0) {
+    if (chown(path,config->msg_uid,config->msg_gid) < 0)
+      logmsg(0,"failed to set command socket owner: %s (%d)",strerror(errno),errno);
+  }
+
+  fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) | O_NONBLOCK);
+  fcntl(sock,F_SETFD,FD_CLOEXEC);
+
+  return sock;
+}
+
+
+
+void release_command_socket(int sock, const char *path)
+{
+  if (sock < 0) return;
+
+  close(sock);
+  if (path) unlink(path);
+}
+
+
+
+int read_command_socket(int sock, nx_ipc_doorbell_t *db)
+{
+  ssize_t r;
+
+  if (sock < 0 || !db) return -1;
+
+  do {
+    r = recv(sock,db,sizeof(nx_ipc_doorbell_t),0);
+  } while (r < 0 && errno == EINTR);
+
+  if (r < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    logmsg(0,"failed to read command socket: %s (errno=%d)",strerror(errno),errno);
+    return -2;
+  }
+
+  /* clients may also send just an empty notification */
+  if (r != sizeof(nx_ipc_doorbell_t))
+    memset(db,0,sizeof(nx_ipc_doorbell_t));
+
+  return 1;
+}
+
+
+static uint state_image_checksum(const uchar *data, size_t len)
+{
+  uint sum1 = 0xffff, sum2 = 0xffff;
+  size_t i;
+
+  /* Fletcher-32 (over bytes) */
+  for (i=0; i<len; i++) {
+    sum1=(sum1 + data[i]) % 65535;
+    sum2=(sum2 + sum1) % 65535;
+  }
+
+  return (sum2 << 16) | sum1;
+}
+
+
+/* save shared memory contents to state image file (atomically) */
+int save_state_image(const char *filename, const nx_shm_t *shm)
+{
+  nx_state_image_header_t hdr;
+  char tmpfile[1024];
+  int fd, r;
+
+  if (!filename || !shm) return -1;
+
+  memset(&hdr,0,sizeof(hdr));
+  strlcpy(hdr.magic,STATE_IMAGE_MAGIC,sizeof(hdr.magic));
+  strlcpy(hdr.shmversion,SHMVERSION,sizeof(hdr.shmversion));
+  hdr.size=sizeof(nx_shm_t);
+  hdr.saved=time(NULL);
+  hdr.checksum=state_image_checksum((const uchar*)shm,sizeof(nx_shm_t));
+
+  snprintf(tmpfile,sizeof(tmpfile),"%s.tmp",filename);
+  if ((fd=open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0600)) < 0) {
+    logmsg(0,"failed to create state file: %s (%s)",tmpfile,strerror(errno));
+    return -2;
+  }
+
+  r=0;
+  if (write(fd,&hdr,sizeof(hdr)) != sizeof(hdr) ||
+      write(fd,shm,sizeof(nx_shm_t)) != sizeof(nx_shm_t)) {
+    logmsg(0,"failed to write state file: %s (%s)",tmpfile,strerror(errno));
+    r=-3;
+  }
+  if (r == 0 && fsync(fd) < 0) r=-4;
+  close(fd);
+
+  if (r == 0 && rename(tmpfile,filename) < 0) {
+    logmsg(0,"failed to rename state file: %s (%s)",filename,strerror(errno));
+    r=-5;
+  }
+  if (r < 0) unlink(tmpfile);
+
+  return r;
+}
+
+
+/* load state image saved by save_state_image() (possibly by another
+   version), sections compatible with this version are restored and
+   the rest are left zeroed. returns 0 if image was loaded and system
+   status could be restored from it */
+int load_state_image(const char *filename, nx_shm_t *image, time_t *saved)
+{
+  nx_state_image_header_t hdr;
+  nx_shm_t *data = NULL;
+  int fd, r;
+
+  if (!filename || !image) return -1;
+
+  if ((fd=open(filename,O_RDONLY)) < 0)
+    return -2;
+
+  r=0;
+  if (read(fd,&hdr,sizeof(hdr)) != sizeof(hdr) ||
+      strncmp(hdr.magic,STATE_IMAGE_MAGIC,sizeof(hdr.magic))) {
+    r=-3;
+  } else if (hdr.size < NX_SHM_HEADER_SIZE || hdr.size > STATE_IMAGE_MAX_SIZE) {
+    r=-4;
+  } else {
+    if (!(data=malloc(hdr.size)))
+      die("out of memory");
+    if (read(fd,data,hdr.size) != hdr.size)
+      r=-5;
+    else if (state_image_checksum((const uchar*)data,hdr.size) != hdr.checksum)
+      r=-6;
+    else if (strncmp(data->magic,NX_SHM_MAGIC,sizeof(data->magic)) ||
+	     data->header_version != NX_SHM_HEADER_VERSION || data->size != hdr.size)
+      r=-4;
+  }
+  close(fd);
+
+  if (r == 0) {
+    shm_copy_image(data,image);
+    if (!shm_section(image,NX_SHM_SYSTEM)) r=-4;
+  }
+  free(data);
+
+  if (r == 0 && saved) *saved=hdr.saved;
+  return r;
+}
+
+
 /* eof :-) */
@@ -31,12 +31,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
 #if defined(__linux__)
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #endif
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include "nxgipd.h"
 
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif
+
 
 char *program_name = NULL;
 
@@ -257,5 +266,621 @@ int openserialdevice(const char *device, const char *speed, const char *mode)
   return fd;
 }
 
+/* format program data for displaying (as used in nxcmd replies) */
+int format_program_data(const nx_prog_location_t *data, char *buf, size_t size)
+{
+  static const char hex[] = "0123456789abcdef";
+  char *p, *end;
+  int i,va;
+
+  if (!data || !buf || size < 1) return -1;
+
+  p=buf;
+  /* each value takes at most 11 characters ("[12345678] ") */
+  end=buf + size - 12;
+
+  if (data->type == 3 && p < end) *p++='"';
+
+  for(i=0; i < data->len && p < end; i++) {
+    if (data->nibble) {
+      va=data->data[i/2];
+      va=(i%2 == 0 ? va & 0x0f : (va >> 4) & 0x0f);
+    } else {
+      va=data->data[i];
+    }
+
+    switch (data->type) {
+    case 0:
+      /* binary */
+      *p++='[';
+      *p++=(va&0x01?'1':'-');
+      *p++=(va&0x02?'2':'-');
+      *p++=(va&0x04?'3':'-');
+      *p++=(va&0x08?'4':'-');
+      *p++=(va&0x10?'5':'-');
+      *p++=(va&0x20?'6':'-');
+      *p++=(va&0x40?'7':'-');
+      *p++=(va&0x80?'8':'-');
+      *p++=']';
+      *p++=' ';
+      break;
+    case 1:
+      /* decimal */
+      if (va >= 100) *p++='0' + va/100;
+      if (va >= 10 || !data->nibble) *p++='0' + (va/10)%10;
+      *p++='0' + va%10;
+      *p++=' ';
+      break;
+    case 2:
+      /* hexadecimal */
+      if (!data->nibble) *p++=hex[va >> 4];
+      *p++=hex[va & 0x0f];
+      *p++=' ';
+      break;
+    case 3:
+      /* ASCII */
+      *p++=va;
+      break;
+    default:
+      *p++="0123456789ABCDEF"[va >> 4];
+      *p++="0123456789ABCDEF"[va & 0x0f];
+      *p++=' ';
+    }
+  }
+
+  if (data->type == 3 && p < buf + size - 1) *p++='"';
+  *p=0;
+
+  return p - buf;
+}
+
+
+/* find (valid) program data cache entry */
+const nx_prog_cache_entry_t* prog_cache_lookup(const nx_prog_cache_t *cache, int device, int location)
+{
+  const nx_prog_cache_entry_t *e;
+  uint key, i;
+  time_t now = time(NULL);
+
+  if (!cache) return NULL;
+
+  key=PROG_CACHE_KEY(device,location);
+  for(i=0; i < PROG_CACHE_PROBE; i++) {
+    e=&cache->e[(key+i) & (PROG_CACHE_SIZE-1)];
+    if (e->valid && e->device == device && e->location == location) {
+      if (now - e->updated > PROG_CACHE_MAX_AGE) return NULL;
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+/* shared memory is protected by a sequence counter (seqlock): daemon
+   increments counter before and after each update, so it is odd while
+   update is in progress. Write sections can be nested.
+   After an update that changed state clients are interested in (marked
+   with shm_changed()) change counter is incremented and clients waiting
+   for it (in shm_wait_change()) are woken up. */
+static int shm_write_depth = 0;
+static int shm_write_changed = 0;
+
+void shm_write_begin(nx_shm_t *shm)
+{
+  if (!shm) return;
+  if (shm_write_depth++ == 0) {
+    shm->seq++;
+    __sync_synchronize();
+  }
+}
+
+
+void shm_write_end(nx_shm_t *shm)
+{
+  if (!shm || shm_write_depth < 1) return;
+  if (--shm_write_depth == 0) {
+    __sync_synchronize();
+    shm->seq++;
+    if (shm_write_changed) {
+      shm_write_changed=0;
+      shm->changes++;
+      __sync_synchronize();
+#ifdef HAVE_LINUX_FUTEX_H
+      if (shm->loopstats.waiters > 0)
+	syscall(SYS_futex,&shm->changes,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+#endif
+    }
+  }
+}
+
+
+/* mark current write section as a change that clients should be woken
+   up for (zone/partition/log events, replies to clients, etc.) */
+void shm_changed(nx_shm_t *shm)
+{
+  if (!shm) return;
+  shm_write_begin(shm);
+  shm_write_changed=1;
+  shm_write_end(shm);
+}
+
+
+/* copy (part of) shared memory so that daemon did not modify it
+   during the copy. Returns 0 on success, -1 if no consistent copy
+   could be made in SHM_READ_TIMEOUT (copy is still made). */
+int shm_read(const nx_shm_t *shm, void *dest, const void *src, size_t size)
+{
+  long long start = nx_time_ms();
+  uint seq;
+
+  if (!shm || !dest || !src) return -2;
+
+  do {
+    seq=shm->seq;
+    __sync_synchronize();
+    if (!(seq & 1)) {
+      memcpy(dest,src,size);
+      __sync_synchronize();
+      if (shm->seq == seq) return 0;
+    }
+    sched_yield();
+  } while (nx_time_ms() - start < SHM_READ_TIMEOUT);
+
+  memcpy(dest,src,size);
+  return -1;
+}
+
+
+/* shared memory sections (layout of nx_shm_t as compiled into this program) */
+static const nx_shm_section_t shm_sections[] = {
+  { NX_SHM_INTERFACE, NX_SHM_INTERFACE_VERSION, offsetof(nx_shm_t,intstatus),
+    sizeof(nx_interface_status_t), 0, 0, 0 },
+  { NX_SHM_SYSTEM, NX_SHM_SYSTEM_VERSION, offsetof(nx_shm_t,alarmstatus),
+    sizeof(nx_system_status_t), 0, 0, 0 },
+  { NX_SHM_LOOPSTATS, NX_SHM_LOOPSTATS_VERSION, offsetof(nx_shm_t,loopstats),
+    sizeof(nx_loop_stats_t), 0, 0, 0 },
+  { NX_SHM_PROGCACHE, NX_SHM_PROGCACHE_VERSION, offsetof(nx_shm_t,progcache),
+    sizeof(nx_prog_cache_t), offsetof(nx_prog_cache_t,e),
+    sizeof(nx_prog_cache_entry_t), PROG_CACHE_SIZE },
+  { NX_SHM_JOURNAL, NX_SHM_JOURNAL_VERSION, offsetof(nx_shm_t,journal),
+    sizeof(nx_journal_t), offsetof(nx_journal_t,e),
+    sizeof(nx_journal_event_t), NX_JOURNAL_SIZE },
+  { NX_SHM_ZONEMAP, NX_SHM_ZONEMAP_VERSION, offsetof(nx_shm_t,zonemap),
+    sizeof(nx_zone_bitmaps_t), 0, 0, 0 },
+  { NX_SHM_TRIGGERS, NX_SHM_TRIGGERS_VERSION, offsetof(nx_shm_t,triggerstats),
+    sizeof(nx_trigger_stats_t), 0, 0, 0 },
+  { NX_SHM_MQTT, NX_SHM_MQTT_VERSION, offsetof(nx_shm_t,mqttstats),
+    sizeof(nx_mqtt_stats_t), 0, 0, 0 },
+  { 0, 0, 0, 0, 0, 0, 0 }
+};
+
+
+static const nx_shm_section_t* find_section(const nx_shm_section_t *table, int count, uint id)
+{
+  int i;
+
+  for (i=0; i<count && i<NX_SHM_SECTIONS_MAX && table[i].id; i++) {
+    if (table[i].id == id) return &table[i];
+  }
+  return NULL;
+}
+
+
+/* find section in shared memory (daemon) that is compatible with given
+   local section */
+static const nx_shm_section_t* shm_find_section(const nx_shm_t *shm, const nx_shm_section_t *local)
+{
+  const nx_shm_section_t *s;
+
+  s=find_section(shm->section,shm->sections,local->id);
+  if (!s || s->version != local->version) return NULL;
+  if (s->offset < NX_SHM_HEADER_SIZE || s->size > shm->size ||
+      s->offset > shm->size - s->size)
+    return NULL;
+  if (s->stride > 0 &&
+      (s->first != local->first || s->first > s->size ||
+       (unsigned long long)s->stride * s->count > s->size - s->first))
+    return NULL;
+  return s;
+}
+
+
+/* initialize shared memory segment header (daemon) */
+void shm_init_header(nx_shm_t *shm)
+{
+  int i;
+
+  if (!shm) return;
+
+  strlcpy(shm->magic,NX_SHM_MAGIC,sizeof(shm->magic));
+  shm->header_version=NX_SHM_HEADER_VERSION;
+  shm->size=sizeof(nx_shm_t);
+  strlcpy(shm->shmversion,SHMVERSION,sizeof(shm->shmversion));
+  for (i=0; shm_sections[i].id && i<NX_SHM_SECTIONS_MAX; i++)
+    shm->section[i]=shm_sections[i];
+  shm->sections=i;
+}
+
+
+/* segment attached with shm_attach() (for shm_waiter_count()) */
+static const nx_shm_t *attached_shm = NULL;
+static int attached_id = -1;
+static char *attached_rw = NULL;
+
+/* attach to shared memory segment created by the daemon (read-only) */
+int shm_attach(int shmkey, int *shmidptr, nx_shm_t **shmptr)
+{
+  struct shmid_ds shminfo;
+  nx_shm_t *shm;
+  int id;
+
+  if ((id=shmget(shmkey,0,0)) < 0) return -1;
+  if (shmctl(id,IPC_STAT,&shminfo) < 0) return -2;
+  if (shminfo.shm_segsz < NX_SHM_HEADER_SIZE) return -3;
+
+  shm=shmat(id,NULL,SHM_RDONLY);
+  if (shm == (void*)-1) return -2;
+
+  if (strncmp(shm->magic,NX_SHM_MAGIC,sizeof(shm->magic)) ||
+      shm->header_version != NX_SHM_HEADER_VERSION ||
+      shm->size > shminfo.shm_segsz || shm->size < NX_SHM_HEADER_SIZE) {
+    shmdt(shm);
+    return -3;
+  }
+
+  if (shmidptr) *shmidptr=id;
+  *shmptr=shm;
+  attached_shm=shm;
+  attached_id=id;
+  return 0;
+}
+
+
+/* return pointer to section in shared memory, if its layout matches
+   exactly the layout compiled into this program, otherwise NULL */
+const void* shm_section(const nx_shm_t *shm, uint id)
+{
+  const nx_shm_section_t *local, *s;
+
+  if (!shm) return NULL;
+  if (!(local=find_section(shm_sections,NX_SHM_SECTIONS_MAX,id))) return NULL;
+  if (!(s=shm_find_section(shm,local))) return NULL;
+  if (s->size < local->size || s->stride != local->stride || s->count != local->count)
+    return NULL;
+  return (const char*)shm + s->offset;
+}
+
+
+/* copy sections that are compatible with this program from the shared
+   memory segment, missing or incompatible sections are left zeroed */
+static void shm_copy_sections(const nx_shm_t *shm, nx_shm_t *copy)
+{
+  const nx_shm_section_t *local, *s;
+  const char *src;
+  char *dst;
+  uint i, n, len;
+
+  memcpy(copy,shm,NX_SHM_HEADER_SIZE);
+
+  for (local=shm_sections; local->id; local++) {
+    dst=(char*)copy + local->offset;
+    memset(dst,0,local->size);
+    if (!(s=shm_find_section(shm,local))) continue;
+    src=(const char*)shm + s->offset;
+
+    if (local->stride == 0 || s->stride == 0) {
+      memcpy(dst,src,(s->size < local->size ? s->size : local->size));
+      continue;
+    }
+    /* copy records one at a time, as record size may differ */
+    memcpy(dst,src,local->first);
+    n=(s->count < local->count ? s->count : local->count);
+    len=(s->stride < local->stride ? s->stride : local->stride);
+    for (i=0; i<n; i++)
+      memcpy(dst + local->first + i*local->stride,src + s->first + i*s->stride,len);
+  }
+}
+
+
+/* update section table of a copy to describe sections found in the copy */
+static void shm_copy_table(const nx_shm_t *shm, nx_shm_t *copy)
+{
+  const nx_shm_section_t *local;
+  int i;
+
+  copy->size=sizeof(nx_shm_t);
+  for (i=0, local=shm_sections; local->id; local++) {
+    if (shm_find_section(shm,local))
+      copy->section[i++]=*local;
+  }
+  copy->sections=i;
+}
+
+
+int shm_snapshot(const nx_shm_t *shm, nx_shm_t *copy)
+{
+  long long start = nx_time_ms();
+  uint seq;
+  int ret = -1;
+
+  if (!shm || !copy) return -2;
+
+  do {
+    seq=shm->seq;
+    __sync_synchronize();
+    if (!(seq & 1)) {
+      shm_copy_sections(shm,copy);
+      __sync_synchronize();
+      if (shm->seq == seq) {
+	ret=0;
+	break;
+      }
+    }
+    sched_yield();
+  } while (nx_time_ms() - start < SHM_READ_TIMEOUT);
+
+  if (ret < 0)
+    shm_copy_sections(shm,copy);
+  shm_copy_table(shm,copy);
+
+  return ret;
+}
+
+
+/* copy compatible sections from a saved shared memory image (that may
+   have been saved by another version of the daemon) */
+void shm_copy_image(const nx_shm_t *image, nx_shm_t *copy)
+{
+  if (!image || !copy) return;
+
+  shm_copy_sections(image,copy);
+  shm_copy_table(image,copy);
+}
+
+
+#ifdef HAVE_LINUX_FUTEX_H
+/* return (writable) pointer to the count of clients waiting for changes,
+   NULL if we don't have write access to the segment. *present is set if
+   daemon keeps the count (and wakes up only clients that are counted) */
+static volatile uint* shm_waiter_count(const nx_shm_t *shm, int *present)
+{
+  const nx_loop_stats_t *ls;
+  void *rw;
+
+  ls=shm_section(shm,NX_SHM_LOOPSTATS);
+  *present=(ls != NULL);
+  if (!ls || shm != attached_shm || attached_id < 0) return NULL;
+
+  if (!attached_rw) {
+    if ((rw=shmat(attached_id,NULL,0)) == (void*)-1) {
+      attached_id=-1;
+      return NULL;
+    }
+    attached_rw=rw;
+  }
+  return (volatile uint*)(attached_rw + ((const char*)&ls->waiters - (const char*)shm));
+}
+#endif
+
+
+/* wait until shared memory has been updated (change counter differs
+   from given value), returns 1 if changed, 0 on timeout (ms) */
+int shm_wait_change(const nx_shm_t *shm, uint changes, int timeout)
+{
+  long long end = nx_time_ms() + timeout;
+  long long left;
+#ifdef HAVE_LINUX_FUTEX_H
+  volatile uint *waiters;
+  struct timespec ts;
+  int counting, r;
+#endif
+
+  if (!shm) return -1;
+
+#ifdef HAVE_LINUX_FUTEX_H
+  /* daemon skips wakeups if nobody is waiting, so clients that cannot
+     add themselves to the waiter count (no write access) have to poll */
+  waiters=shm_waiter_count(shm,&counting);
+#endif
+
+  while (shm->changes == changes) {
+    left=end - nx_time_ms();
+    if (left <= 0) return 0;
+#ifdef HAVE_LINUX_FUTEX_H
+    if (waiters || !counting) {
+      ts.tv_sec=left / 1000;
+      ts.tv_nsec=(left % 1000) * 1000000;
+      if (waiters) __sync_fetch_and_add(waiters,1);
+      r=syscall(SYS_futex,&shm->changes,FUTEX_WAIT,changes,&ts,NULL,0);
+      if (waiters) __sync_fetch_and_sub(waiters,1);
+      if (r < 0 && errno == ENOSYS)
+	usleep(SHM_POLL_INTERVAL*1000);
+      continue;
+    }
+#endif
+    usleep((left < SHM_POLL_INTERVAL ? left : SHM_POLL_INTERVAL) * 1000);
+  }
+
+  return 1;
+}
+
+
+uint nx_zone_flags(const nx_zone_status_t *zone)
+{
+  return ((zone->fault ? NX_ZONE_FAULT : 0) |
+	  (zone->tamper ? NX_ZONE_TAMPER : 0) |
+	  (zone->trouble ? NX_ZONE_TROUBLE : 0) |
+	  (zone->bypass ? NX_ZONE_BYPASS : 0) |
+	  (zone->inhibited ? NX_ZONE_INHIBITED : 0) |
+	  (zone->low_battery ? NX_ZONE_LOW_BATTERY : 0) |
+	  (zone->loss_supervision ? NX_ZONE_LOSS_SUPERVISION : 0) |
+	  (zone->alarm_mem ? NX_ZONE_ALARM_MEM : 0) |
+	  (zone->bypass_mem ? NX_ZONE_BYPASS_MEM : 0));
+}
+
+
+/* zone and partition status flag names (used in configuration, MQTT, etc.) */
+const nx_flag_name_t nx_zone_flag_names[] = {
+  { "fault", NX_ZONE_FAULT },
+  { "tamper", NX_ZONE_TAMPER },
+  { "trouble", NX_ZONE_TROUBLE },
+  { "bypass", NX_ZONE_BYPASS },
+  { "inhibited", NX_ZONE_INHIBITED },
+  { "lowbattery", NX_ZONE_LOW_BATTERY },
+  { "supervision", NX_ZONE_LOSS_SUPERVISION },
+  { "alarmmem", NX_ZONE_ALARM_MEM },
+  { "bypassmem", NX_ZONE_BYPASS_MEM },
+  { NULL, 0 }
+};
+
+const nx_flag_name_t nx_partition_flag_names[] = {
+  { "armed", NX_PART_ARMED },
+  { "ready", NX_PART_READY },
+  { "stay", NX_PART_STAY_MODE },
+  { "chime", NX_PART_CHIME_MODE },
+  { "entrydelay", NX_PART_ENTRY_DELAY },
+  { "exitdelay", NX_PART_EXIT_DELAY },
+  { "prevalarm", NX_PART_PREV_ALARM },
+  { "fire", NX_PART_FIRE },
+  { "firetrouble", NX_PART_FIRE_TROUBLE },
+  { "instant", NX_PART_INSTANT },
+  { "tamper", NX_PART_TAMPER },
+  { "alarmmem", NX_PART_ALARM_MEM },
+  { "siren", NX_PART_SIREN },
+  { "buzzer", NX_PART_BUZZER },
+  { "lowbattery", NX_PART_LOW_BATTERY },
+  { "supervision", NX_PART_LOST_SUPERVISION },
+  { "bypassed", NX_PART_ZONES_BYPASSED },
+  { "alarmsent", NX_PART_ALARM_SENT },
+  { NULL, 0 }
+};
+
+
+uint nx_partition_flags(const nx_partition_status_t *part)
+{
+  return ((part->armed ? NX_PART_ARMED : 0) |
+	  (part->ready ? NX_PART_READY : 0) |
+	  (part->stay_mode ? NX_PART_STAY_MODE : 0) |
+	  (part->chime_mode ? NX_PART_CHIME_MODE : 0) |
+	  (part->entry_delay ? NX_PART_ENTRY_DELAY : 0) |
+	  (part->exit_delay ? NX_PART_EXIT_DELAY : 0) |
+	  (part->prev_alarm ? NX_PART_PREV_ALARM : 0) |
+	  (part->fire ? NX_PART_FIRE : 0) |
+	  (part->fire_trouble ? NX_PART_FIRE_TROUBLE : 0) |
+	  (part->instant ? NX_PART_INSTANT : 0) |
+	  (part->tamper ? NX_PART_TAMPER : 0) |
+	  (part->alarm_mem ? NX_PART_ALARM_MEM : 0) |
+	  (part->siren_on || part->steadysiren_on ? NX_PART_SIREN : 0) |
+	  (part->buzzer_on ? NX_PART_BUZZER : 0) |
+	  (part->low_battery ? NX_PART_LOW_BATTERY : 0) |
+	  (part->lost_supervision ? NX_PART_LOST_SUPERVISION : 0) |
+	  (part->zones_bypassed ? NX_PART_ZONES_BYPASSED : 0) |
+	  (part->alarm_sent ? NX_PART_ALARM_SENT : 0));
+}
+
+
+/* read next event from the journal (after event cursor points to),
+   returns 1 if event was read, 0 if there are no new events, and -1 if
+   events have been overwritten (cursor is moved to oldest event available) */
+int journal_read(const nx_journal_t *journal, unsigned long *cursor, nx_journal_event_t *event)
+{
+  const nx_journal_event_t *e;
+  unsigned long head, next;
+
+  if (!journal || !cursor || !event) return -2;
+
+  head=journal->head;
+  next=*cursor + 1;
+  if (next > head) return 0;
+
+  if (head - next < NX_JOURNAL_SIZE) {
+    e=&journal->e[next & (NX_JOURNAL_SIZE-1)];
+    if (e->seq == next) {
+      __sync_synchronize();
+      memcpy(event,(const void*)e,sizeof(nx_journal_event_t));
+      __sync_synchronize();
+      if (e->seq == next) {
+	*cursor=next;
+	return 1;
+      }
+    }
+  }
+
+  /* writer has passed us */
+  head=journal->head;
+  *cursor=(head > NX_JOURNAL_SIZE-1 ? head - (NX_JOURNAL_SIZE-1) : 0);
+  return -1;
+}
+
+
+/* update zone bitmaps from zone status (zonenum 0..) */
+void zone_bitmaps_update(nx_zone_bitmaps_t *map, int zonenum, const nx_zone_status_t *zone)
+{
+  int w = zonenum / 64;
+  uint64_t bit = (uint64_t)1 << (zonenum % 64);
+  uint flags;
+  int i;
+
+  if (!map || !zone || zonenum < 0 || zonenum >= NX_ZONES_MAX) return;
+
+  flags=(zone->valid > 0 ? nx_zone_flags(zone) : 0);
+  for (i=0; i<NX_ZONE_FLAG_BITS; i++) {
+    if (flags & (1 << i)) map->flags[i][w] |= bit;
+    else map->flags[i][w] &= ~bit;
+  }
+  for (i=0; i<NX_PARTITIONS_MAX; i++) {
+    if (zone->valid > 0 && (zone->partition_mask & (1 << i)))
+      map->partition[i][w] |= bit;
+    else
+      map->partition[i][w] &= ~bit;
+  }
+  if (zone->valid > 0) map->valid[w] |= bit;
+  else map->valid[w] &= ~bit;
+}
+
+
+void zone_bitmaps_rebuild(nx_zone_bitmaps_t *map, const nx_system_status_t *astat)
+{
+  int i;
+
+  if (!map || !astat) return;
+
+  memset(map,0,sizeof(nx_zone_bitmaps_t));
+  for (i=0; i<astat->last_zone && i<NX_ZONES_MAX; i++)
+    zone_bitmaps_update(map,i,&astat->zones[i]);
+}
+
+
+/* find (valid) zones that have any of the given flags set (or all zones
+   if flags is 0), optionally only zones in given partition (1..).
+   returns number of zones found, result bitmap is stored in result */
+int zone_bitmaps_query(const nx_zone_bitmaps_t *map, uint flags, int partition, uint64_t *result)
+{
+  uint64_t m;
+  int w, i;
+  int count = 0;
+
+  if (!map || !result || partition > NX_PARTITIONS_MAX) return -1;
+
+  for (w=0; w<NX_ZONE_BITMAP_WORDS; w++) {
+    if (flags) {
+      m=0;
+      for (i=0; i<NX_ZONE_FLAG_BITS; i++) {
+	if (flags & (1 << i)) m|=map->flags[i][w];
+      }
+    } else {
+      m=~(uint64_t)0;
+    }
+    m&=map->valid[w];
+    if (partition > 0) m&=map->partition[partition-1][w];
+    result[w]=m;
+    count+=__builtin_popcountll(m);
+  }
+
+  return count;
+}
+
 
 /* eof :-) */
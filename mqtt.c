@@ -0,0 +1,828 @@
+/* mqtt.c - publish alarm status and events to MQTT broker
+ *
+ * Copyright (C) 2015 Timo Kokkonen <tjko@iki.fi>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include "nxgipd.h"
+
+
+/* minimal MQTT 3.1.1 client: publishes retained state topics and
+   event topics over one persistent connection, messages are queued
+   while broker is not reachable */
+
+#define MQTT_RECONNECT_INTERVAL  5      /* seconds between connection attempts */
+#define MQTT_CONNECT_TIMEOUT     10     /* seconds to wait for CONNACK */
+#define MQTT_RESOLVE_INTERVAL    60     /* min. seconds between DNS lookups */
+#define MQTT_INFLIGHT_MAX        16     /* unacknowledged QoS 1/2 messages */
+#define MQTT_OUTBUF_SIZE         65536
+#define MQTT_INBUF_SIZE          1024
+
+/* control packet types */
+#define MQTT_CONNECT      0x10
+#define MQTT_CONNACK      0x20
+#define MQTT_PUBLISH      0x30
+#define MQTT_PUBACK       0x40
+#define MQTT_PUBREC       0x50
+#define MQTT_PUBREL       0x62
+#define MQTT_PUBCOMP      0x70
+#define MQTT_PINGREQ      0xc0
+#define MQTT_PINGRESP     0xd0
+#define MQTT_DISCONNECT   0xe0
+
+/* connection states */
+#define MQTT_DISCONNECTED 0
+#define MQTT_CONNECTING   1   /* TCP connection in progress */
+#define MQTT_WAIT_CONNACK 2
+#define MQTT_CONNECTED    3
+
+/* message states */
+#define MSG_QUEUED        0
+#define MSG_SENT          1   /* waiting for PUBACK (QoS 1) or PUBREC (QoS 2) */
+#define MSG_RELEASED      2   /* PUBREL sent, waiting for PUBCOMP (QoS 2) */
+#define MSG_DONE          3
+
+typedef struct mqtt_msg {
+  char   *topic;
+  char   *payload;
+  int    len;
+  uchar  retain;
+  uchar  state;
+  ushort id;      /* packet identifier (0 = not sent yet) */
+} mqtt_msg_t;
+
+
+static int mqtt_sock = -1;
+static int mqtt_state = MQTT_DISCONNECTED;
+static struct addrinfo *mqtt_addrs = NULL;  /* broker addresses (cached) */
+static int mqtt_addr_count = 0;
+static int mqtt_addr_index = 0;
+static time_t mqtt_last_resolve = 0;
+static int mqtt_failures = 0;
+static time_t mqtt_last_attempt = 0;
+static time_t mqtt_last_rx = 0;
+static time_t mqtt_last_tx = 0;
+static int mqtt_ping_sent = 0;
+static ushort mqtt_next_id = 0;
+
+/* message queue (ring buffer), messages before mqtt_queue_sent (from
+   head) have been written to the socket */
+static mqtt_msg_t *mqtt_queue = NULL;
+static int mqtt_queue_head = 0;
+static int mqtt_queue_len = 0;
+static int mqtt_queue_sent = 0;
+static int mqtt_inflight = 0;
+
+static uchar *mqtt_out = NULL;
+static size_t mqtt_out_len = 0;
+static uchar mqtt_in[MQTT_INBUF_SIZE];
+static size_t mqtt_in_len = 0;
+
+/* last published state (retained topics) */
+#define MQTT_FLAGS_UNKNOWN 0xffffffff
+static uint mqtt_zone_flags[NX_ZONES_MAX];
+static uint mqtt_part_flags[NX_PARTITIONS_MAX];
+static char mqtt_system_state[512];
+
+static nx_mqtt_stats_t mqtt_stats;
+
+
+
+/* append JSON string (quoted) to buffer */
+static size_t json_str(char *buf, size_t size, size_t len, const char *s)
+{
+  if (len < size) buf[len++]='"';
+  for (; *s && len + 7 < size; s++) {
+    if (*s == '"' || *s == '\\') {
+      buf[len++]='\\';
+      buf[len++]=*s;
+    } else if ((unsigned char)*s < 0x20) {
+      len+=snprintf(buf+len,size-len,"\\u%04x",*s);
+    } else {
+      buf[len++]=*s;
+    }
+  }
+  if (len < size) buf[len++]='"';
+  if (len < size) buf[len]=0;
+  return len;
+}
+
+
+/* append status flags as JSON members ("name":0/1) */
+static size_t json_flags(char *buf, size_t size, size_t len, const nx_flag_name_t *names, uint flags)
+{
+  int i;
+
+  for (i=0; names[i].name && len < size; i++)
+    len+=snprintf(buf+len,size-len,",\"%s\":%d",names[i].name,(flags & names[i].flag ? 1 : 0));
+  return (len < size ? len : size-1);
+}
+
+
+static void mqtt_free_msg(mqtt_msg_t *m)
+{
+  free(m->topic);
+  free(m->payload);
+  m->topic=NULL;
+  m->payload=NULL;
+}
+
+
+/* add message to the queue */
+static void mqtt_publish(const char *topic, const char *payload, int retain)
+{
+  mqtt_msg_t *m;
+
+  if (!mqtt_queue) return;
+
+  if (mqtt_queue_len >= config->mqtt_queue) {
+    if (mqtt_queue_sent > 0) {
+      /* oldest messages are being sent, drop this one */
+      logmsg(2,"MQTT queue full, message dropped: %s",topic);
+      mqtt_stats.dropped++;
+      return;
+    }
+    logmsg(2,"MQTT queue full, dropping oldest message");
+    mqtt_free_msg(&mqtt_queue[mqtt_queue_head]);
+    mqtt_queue_head=(mqtt_queue_head+1) % config->mqtt_queue;
+    mqtt_queue_len--;
+    mqtt_stats.dropped++;
+  }
+
+  m=&mqtt_queue[(mqtt_queue_head+mqtt_queue_len) % config->mqtt_queue];
+  if (!(m->topic=strdup(topic)) || !(m->payload=strdup(payload)))
+    die("out of memory");
+  m->len=strlen(payload);
+  m->retain=(retain ? 1 : 0);
+  m->state=MSG_QUEUED;
+  m->id=0;
+  mqtt_queue_len++;
+  if (mqtt_queue_len > mqtt_stats.queue_max) mqtt_stats.queue_max=mqtt_queue_len;
+}
+
+
+/* remove completed messages from head of the queue */
+static void mqtt_queue_pop()
+{
+  mqtt_msg_t *m;
+
+  while (mqtt_queue_len > 0) {
+    m=&mqtt_queue[mqtt_queue_head];
+    if (m->state != MSG_DONE) break;
+    mqtt_free_msg(m);
+    mqtt_queue_head=(mqtt_queue_head+1) % config->mqtt_queue;
+    mqtt_queue_len--;
+    if (mqtt_queue_sent > 0) mqtt_queue_sent--;
+  }
+}
+
+
+static size_t put_varint(uchar *p, size_t val)
+{
+  size_t n = 0;
+
+  do {
+    p[n]=val & 0x7f;
+    val>>=7;
+    if (val > 0) p[n]|=0x80;
+    n++;
+  } while (val > 0);
+  return n;
+}
+
+
+static size_t put_str(uchar *p, const char *s)
+{
+  size_t len = strlen(s);
+
+  p[0]=(len >> 8) & 0xff;
+  p[1]=len & 0xff;
+  memcpy(p+2,s,len);
+  return len+2;
+}
+
+
+/* reserve space for packet in the output buffer */
+static uchar* mqtt_out_reserve(size_t len)
+{
+  if (mqtt_out_len + len + 5 > MQTT_OUTBUF_SIZE) return NULL;
+  return mqtt_out + mqtt_out_len;
+}
+
+
+/* packet without variable header or payload (PINGREQ, DISCONNECT) */
+static int mqtt_put_simple(uchar type)
+{
+  uchar *p;
+
+  if (!(p=mqtt_out_reserve(2))) return -1;
+  p[0]=type;
+  p[1]=0;
+  mqtt_out_len+=2;
+  return 0;
+}
+
+
+static int mqtt_put_ack(uchar type, ushort id)
+{
+  uchar *p;
+
+  if (!(p=mqtt_out_reserve(4))) return -1;
+  p[0]=type;
+  p[1]=2;
+  p[2]=id >> 8;
+  p[3]=id & 0xff;
+  mqtt_out_len+=4;
+  return 0;
+}
+
+
+static int mqtt_put_connect()
+{
+  const char *user = config->mqtt_user;
+  const char *pass = config->mqtt_password;
+  char will[256];
+  size_t len;
+  uchar *p, flags;
+
+  snprintf(will,sizeof(will),"%s/status",config->mqtt_prefix);
+
+  /* clean session, will message "offline" (retained) */
+  flags=0x02 | 0x04 | (config->mqtt_qos << 3) | 0x20;
+  if (user) flags|=0x80;
+  if (user && pass) flags|=0x40;
+
+  len=10 + 2+strlen(config->mqtt_client_id) + 2+strlen(will) + 2+strlen("offline");
+  if (user) len+=2+strlen(user);
+  if (user && pass) len+=2+strlen(pass);
+
+  if (!(p=mqtt_out_reserve(len))) return -1;
+  *p++=MQTT_CONNECT;
+  p+=put_varint(p,len);
+  p+=put_str(p,"MQTT");
+  *p++=4;  /* protocol level (3.1.1) */
+  *p++=flags;
+  *p++=(config->mqtt_keepalive >> 8) & 0xff;
+  *p++=config->mqtt_keepalive & 0xff;
+  p+=put_str(p,config->mqtt_client_id);
+  p+=put_str(p,will);
+  p+=put_str(p,"offline");
+  if (user) p+=put_str(p,user);
+  if (user && pass) p+=put_str(p,pass);
+  mqtt_out_len=p - mqtt_out;
+  return 0;
+}
+
+
+static int mqtt_put_publish(mqtt_msg_t *m)
+{
+  size_t len = 2 + strlen(m->topic) + (config->mqtt_qos > 0 ? 2 : 0) + m->len;
+  int dup = 0;
+  uchar *p;
+
+  if (!(p=mqtt_out_reserve(len))) return -1;
+
+  if (config->mqtt_qos > 0) {
+    if (m->id) dup=1;
+    else {
+      if (++mqtt_next_id == 0) mqtt_next_id=1;
+      m->id=mqtt_next_id;
+    }
+  }
+
+  *p++=MQTT_PUBLISH | (dup ? 0x08 : 0) | (config->mqtt_qos << 1) | m->retain;
+  p+=put_varint(p,len);
+  p+=put_str(p,m->topic);
+  if (config->mqtt_qos > 0) {
+    *p++=m->id >> 8;
+    *p++=m->id & 0xff;
+  }
+  memcpy(p,m->payload,m->len);
+  p+=m->len;
+  mqtt_out_len=p - mqtt_out;
+  return 0;
+}
+
+
+/* write queued messages to output buffer */
+static void mqtt_send_queued()
+{
+  mqtt_msg_t *m;
+
+  while (mqtt_queue_sent < mqtt_queue_len) {
+    m=&mqtt_queue[(mqtt_queue_head+mqtt_queue_sent) % config->mqtt_queue];
+
+    if (m->state == MSG_RELEASED) {
+      /* resend PUBREL after reconnect */
+      if (mqtt_put_ack(MQTT_PUBREL,m->id) < 0) break;
+      mqtt_inflight++;
+    } else if (m->state == MSG_QUEUED) {
+      if (config->mqtt_qos > 0 && mqtt_inflight >= MQTT_INFLIGHT_MAX) break;
+      if (mqtt_put_publish(m) < 0) break;
+      if (config->mqtt_qos > 0) {
+	m->state=MSG_SENT;
+	mqtt_inflight++;
+      } else {
+	m->state=MSG_DONE;
+	mqtt_stats.published++;
+      }
+    }
+    mqtt_queue_sent++;
+  }
+
+  mqtt_queue_pop();
+}
+
+
+static mqtt_msg_t* mqtt_find_sent(ushort id)
+{
+  mqtt_msg_t *m;
+  int i;
+
+  for (i=0; i<mqtt_queue_sent; i++) {
+    m=&mqtt_queue[(mqtt_queue_head+i) % config->mqtt_queue];
+    if (m->id == id && (m->state == MSG_SENT || m->state == MSG_RELEASED))
+      return m;
+  }
+  return NULL;
+}
+
+
+static void mqtt_close(const char *reason)
+{
+  mqtt_msg_t *m;
+  int i;
+
+  if (mqtt_sock < 0) return;
+
+  if (mqtt_state == MQTT_CONNECTED) {
+    logmsg(0,"MQTT connection closed: %s",reason);
+  } else {
+    logmsg((mqtt_failures++ > 0 ? 2 : 0),"MQTT connection to %s:%d failed: %s",
+	   config->mqtt_host,config->mqtt_port,reason);
+    mqtt_addr_index++;
+  }
+
+  close(mqtt_sock);
+  mqtt_sock=-1;
+  mqtt_state=MQTT_DISCONNECTED;
+  mqtt_out_len=0;
+  mqtt_in_len=0;
+  mqtt_ping_sent=0;
+
+  /* unacknowledged messages are sent again after reconnect */
+  for (i=0; i<mqtt_queue_sent; i++) {
+    m=&mqtt_queue[(mqtt_queue_head+i) % config->mqtt_queue];
+    if (m->state == MSG_SENT) m->state=MSG_QUEUED;
+  }
+  mqtt_queue_sent=0;
+  mqtt_inflight=0;
+  mqtt_stats.connected=0;
+}
+
+
+/* resolve broker address (getaddrinfo() may block, so this is done
+   at startup and after all cached addresses have failed) */
+static int mqtt_resolve(time_t now)
+{
+  struct addrinfo hints, *ai;
+  char port[16];
+  int r;
+
+  if (mqtt_addrs) freeaddrinfo(mqtt_addrs);
+  mqtt_addrs=NULL;
+  mqtt_addr_count=0;
+  mqtt_addr_index=0;
+  mqtt_last_resolve=now;
+
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  snprintf(port,sizeof(port),"%d",config->mqtt_port);
+  if ((r=getaddrinfo(config->mqtt_host,port,&hints,&mqtt_addrs)) != 0) {
+    logmsg((mqtt_failures++ > 0 ? 2 : 0),"MQTT: cannot resolve %s: %s",
+	   config->mqtt_host,gai_strerror(r));
+    mqtt_addrs=NULL;
+    return -1;
+  }
+
+  for (ai=mqtt_addrs; ai; ai=ai->ai_next) mqtt_addr_count++;
+  logmsg(3,"MQTT: %s resolved (%d addresses)",config->mqtt_host,mqtt_addr_count);
+  return 0;
+}
+
+
+static void mqtt_connect(time_t now)
+{
+  struct addrinfo *ai;
+  int i, r, s;
+
+  mqtt_last_attempt=now;
+
+  /* try next address after a failed connection attempt, look up
+     addresses again once all of them have failed */
+  if (!mqtt_addrs || mqtt_addr_index >= mqtt_addr_count) {
+    if (mqtt_last_resolve + MQTT_RESOLVE_INTERVAL <= now)
+      mqtt_resolve(now);
+    else
+      mqtt_addr_index=0;
+    if (!mqtt_addrs) return;
+  }
+  for (i=0, ai=mqtt_addrs; i < mqtt_addr_index; i++) ai=ai->ai_next;
+
+  if ((s=socket(ai->ai_family,ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		ai->ai_protocol)) < 0) {
+    logmsg(0,"MQTT: socket() failed: %s",strerror(errno));
+    mqtt_addr_index++;
+    return;
+  }
+  i=1;
+  setsockopt(s,IPPROTO_TCP,TCP_NODELAY,&i,sizeof(i));
+
+  r=connect(s,ai->ai_addr,ai->ai_addrlen);
+  mqtt_sock=s;
+  if (r < 0 && errno != EINPROGRESS) {
+    mqtt_state=MQTT_CONNECTING;
+    mqtt_close(strerror(errno));
+    return;
+  }
+
+  logmsg(2,"MQTT: connecting to %s:%d",config->mqtt_host,config->mqtt_port);
+  mqtt_state=MQTT_CONNECTING;
+  mqtt_last_rx=now;
+  if (r == 0) {
+    mqtt_state=MQTT_WAIT_CONNACK;
+    mqtt_put_connect();
+  }
+}
+
+
+/* (re)publish all state topics */
+static void mqtt_invalidate_state()
+{
+  char topic[256];
+  int i;
+
+  for (i=0; i<NX_ZONES_MAX; i++) mqtt_zone_flags[i]=MQTT_FLAGS_UNKNOWN;
+  for (i=0; i<NX_PARTITIONS_MAX; i++) mqtt_part_flags[i]=MQTT_FLAGS_UNKNOWN;
+  mqtt_system_state[0]=0;
+
+  snprintf(topic,sizeof(topic),"%s/status",config->mqtt_prefix);
+  mqtt_publish(topic,"online",1);
+}
+
+
+/* handle packet received from broker */
+static void mqtt_handle_packet(uchar type, const uchar *data, size_t len, time_t now)
+{
+  mqtt_msg_t *m;
+  ushort id = (len >= 2 ? (data[0] << 8) | data[1] : 0);
+
+  switch (type & 0xf0) {
+
+  case MQTT_CONNACK:
+    if (mqtt_state != MQTT_WAIT_CONNACK || len < 2) break;
+    if (data[1] != 0) {
+      char tmp[64];
+      snprintf(tmp,sizeof(tmp),"connection refused by broker (%d)",data[1]);
+      mqtt_close(tmp);
+      return;
+    }
+    logmsg(0,"MQTT: connected to %s:%d",config->mqtt_host,config->mqtt_port);
+    mqtt_state=MQTT_CONNECTED;
+    mqtt_failures=0;
+    mqtt_invalidate_state();
+    mqtt_stats.connected=1;
+    mqtt_stats.connected_since=now;
+    mqtt_stats.connects++;
+    break;
+
+  case MQTT_PUBACK:
+    if ((m=mqtt_find_sent(id)) && m->state == MSG_SENT) {
+      m->state=MSG_DONE;
+      mqtt_inflight--;
+      mqtt_stats.published++;
+    }
+    break;
+
+  case MQTT_PUBREC:
+    if ((m=mqtt_find_sent(id)) && m->state == MSG_SENT)
+      m->state=MSG_RELEASED;
+    mqtt_put_ack(MQTT_PUBREL,id);
+    break;
+
+  case MQTT_PUBCOMP:
+    if ((m=mqtt_find_sent(id)) && m->state == MSG_RELEASED) {
+      m->state=MSG_DONE;
+      mqtt_inflight--;
+      mqtt_stats.published++;
+    }
+    break;
+
+  case MQTT_PINGRESP:
+    mqtt_ping_sent=0;
+    break;
+
+  default:
+    logmsg(2,"MQTT: unexpected packet from broker: 0x%02x",type);
+    break;
+  }
+
+  mqtt_queue_pop();
+}
+
+
+static void mqtt_read(time_t now)
+{
+  size_t pos, len, hlen, mult;
+  ssize_t n;
+
+  n=read(mqtt_sock,mqtt_in+mqtt_in_len,sizeof(mqtt_in)-mqtt_in_len);
+  if (n == 0) {
+    mqtt_close("connection closed by broker");
+    return;
+  }
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      mqtt_close(strerror(errno));
+    return;
+  }
+  mqtt_in_len+=n;
+  mqtt_last_rx=now;
+
+  /* process all complete packets */
+  while (mqtt_sock >= 0 && mqtt_in_len >= 2) {
+    len=0;
+    mult=1;
+    for (hlen=1; hlen < mqtt_in_len && hlen <= 4; hlen++) {
+      len+=(mqtt_in[hlen] & 0x7f) * mult;
+      mult*=128;
+      if (!(mqtt_in[hlen] & 0x80)) break;
+    }
+    if (hlen > 4 || hlen + 1 + len > sizeof(mqtt_in)) {
+      mqtt_close("invalid packet from broker");
+      return;
+    }
+    if (hlen >= mqtt_in_len || hlen + 1 + len > mqtt_in_len) break;
+
+    pos=hlen+1;
+    mqtt_handle_packet(mqtt_in[0],mqtt_in+pos,len,now);
+    if (mqtt_sock < 0) return;
+    memmove(mqtt_in,mqtt_in+pos+len,mqtt_in_len-pos-len);
+    mqtt_in_len-=pos+len;
+  }
+}
+
+
+static void mqtt_flush(time_t now)
+{
+  ssize_t n;
+
+  while (mqtt_out_len > 0) {
+    n=write(mqtt_sock,mqtt_out,mqtt_out_len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) mqtt_close(strerror(errno));
+      return;
+    }
+    mqtt_out_len-=n;
+    memmove(mqtt_out,mqtt_out+n,mqtt_out_len);
+    mqtt_last_tx=now;
+  }
+}
+
+
+/* publish (retained) state topics that have changed */
+static void mqtt_update_state(nx_system_status_t *astat)
+{
+  char topic[256], buf[1024], name[sizeof(astat->zones[0].name)];
+  nx_zone_status_t *zone;
+  nx_partition_status_t *part;
+  size_t len;
+  uint flags;
+  int i;
+
+  /* state not published now (queue full) is published on next call */
+  for (i=0; i<astat->last_zone && i<NX_ZONES_MAX; i++) {
+    zone=&astat->zones[i];
+    if (!zone->valid) continue;
+    flags=nx_zone_flags(zone);
+    if (flags == mqtt_zone_flags[i]) continue;
+    if (mqtt_queue_len >= config->mqtt_queue) return;
+    mqtt_zone_flags[i]=flags;
+
+    strlcpy(name,zone->name,sizeof(name));
+    for (len=strlen(name); len > 0 && name[len-1] == ' '; len--) name[len-1]=0;
+    len=snprintf(buf,sizeof(buf),"{\"zone\":%d,\"name\":",i+1);
+    len=json_str(buf,sizeof(buf),len,name);
+    len=json_flags(buf,sizeof(buf),len,nx_zone_flag_names,flags);
+    snprintf(buf+len,sizeof(buf)-len,",\"last_tripped\":%lu}",(unsigned long)zone->last_tripped);
+    snprintf(topic,sizeof(topic),"%s/zone/%d",config->mqtt_prefix,i+1);
+    mqtt_publish(topic,buf,1);
+  }
+
+  for (i=0; i<astat->last_partition && i<NX_PARTITIONS_MAX; i++) {
+    part=&astat->partitions[i];
+    if (!part->valid) continue;
+    flags=nx_partition_flags(part);
+    if (flags == mqtt_part_flags[i]) continue;
+    if (mqtt_queue_len >= config->mqtt_queue) return;
+    mqtt_part_flags[i]=flags;
+
+    len=snprintf(buf,sizeof(buf),"{\"partition\":%d",i+1);
+    len=json_flags(buf,sizeof(buf),len,nx_partition_flag_names,flags);
+    snprintf(buf+len,sizeof(buf)-len,"}");
+    snprintf(topic,sizeof(topic),"%s/partition/%d",config->mqtt_prefix,i+1);
+    mqtt_publish(topic,buf,1);
+  }
+
+  snprintf(buf,sizeof(buf),"{\"model\":\"%s\",\"armed\":%d,\"ac_power\":%d,\"ac_fail\":%d,"
+	   "\"low_battery\":%d,\"box_tamper\":%d,\"siren_tamper\":%d,\"exp_tamper\":%d,"
+	   "\"phone_fault\":%d,\"fuse_fault\":%d,\"ground_fault\":%d,\"fail_to_comm\":%d,"
+	   "\"off_hook\":%d,\"comm_fail\":%d}",
+	   astat->panel_model,astat->armed,astat->ac_power,astat->ac_fail,
+	   astat->low_battery,astat->box_tamper,astat->siren_tamper,astat->exp_tamper,
+	   astat->phone_fault,astat->fuse_fault,astat->ground_fault,astat->fail_to_comm,
+	   astat->off_hook,shm->comm_fail);
+  if (strcmp(buf,mqtt_system_state) && mqtt_queue_len < config->mqtt_queue) {
+    strlcpy(mqtt_system_state,buf,sizeof(mqtt_system_state));
+    snprintf(topic,sizeof(topic),"%s/system",config->mqtt_prefix);
+    mqtt_publish(topic,buf,1);
+  }
+}
+
+
+/* publish event (added to the event journal) */
+void mqtt_event(int kind, int num, int part, uint old_flags, uint new_flags,
+		const char *text, time_t t)
+{
+  char topic[256], buf[1024];
+  const char *type;
+  size_t len;
+
+  if (!mqtt_queue) return;
+
+  if (kind == NX_EVENT_ZONE) type="zone";
+  else if (kind == NX_EVENT_PARTITION) type="partition";
+  else type="log";
+
+  len=snprintf(buf,sizeof(buf),"{\"time\":%lu,\"type\":\"%s\",\"num\":%d,\"partition\":%d,"
+	       "\"old_flags\":%u,\"new_flags\":%u,\"text\":",
+	       (unsigned long)t,type,num,part+1,old_flags,new_flags);
+  len=json_str(buf,sizeof(buf),len,(text ? text : ""));
+  snprintf(buf+len,sizeof(buf)-len,"}");
+  snprintf(topic,sizeof(topic),"%s/event/%s",config->mqtt_prefix,type);
+  mqtt_publish(topic,buf,0);
+}
+
+
+void mqtt_init()
+{
+  if (!config->mqtt_host || mqtt_queue) return;
+
+  if (!(mqtt_queue=calloc(config->mqtt_queue,sizeof(mqtt_msg_t))))
+    die("out of memory");
+  if (!(mqtt_out=malloc(MQTT_OUTBUF_SIZE)))
+    die("out of memory");
+
+  logmsg(1,"MQTT publisher enabled: %s:%d (QoS %d, topic prefix '%s')",
+	 config->mqtt_host,config->mqtt_port,config->mqtt_qos,config->mqtt_prefix);
+
+  mqtt_resolve(time(NULL));
+}
+
+
+/* returns socket to poll (and events to poll for), or -1 */
+int mqtt_fd(short *events)
+{
+  if (mqtt_sock < 0) return -1;
+
+  *events=POLLIN;
+  if (mqtt_state == MQTT_CONNECTING || mqtt_out_len > 0)
+    *events|=POLLOUT;
+  return mqtt_sock;
+}
+
+
+/* handle MQTT connection (called from main loop) */
+void mqtt_process(short revents, nx_system_status_t *astat)
+{
+  time_t now = time(NULL);
+  socklen_t len;
+  int err;
+
+  if (!mqtt_queue) return;
+
+  if (mqtt_sock < 0 && mqtt_last_attempt + MQTT_RECONNECT_INTERVAL <= now)
+    mqtt_connect(now);
+
+  if (mqtt_sock >= 0 && mqtt_state == MQTT_CONNECTING &&
+      (revents & (POLLOUT | POLLERR | POLLHUP))) {
+    err=0;
+    len=sizeof(err);
+    if (getsockopt(mqtt_sock,SOL_SOCKET,SO_ERROR,&err,&len) < 0) err=errno;
+    if (err) {
+      mqtt_close(strerror(err));
+    } else {
+      mqtt_state=MQTT_WAIT_CONNACK;
+      mqtt_put_connect();
+    }
+    revents=0;
+  }
+
+  if (mqtt_sock >= 0 && (revents & (POLLIN | POLLERR | POLLHUP)))
+    mqtt_read(now);
+
+  if (mqtt_sock >= 0 && mqtt_state != MQTT_CONNECTED &&
+      mqtt_last_attempt + MQTT_CONNECT_TIMEOUT < now)
+    mqtt_close("timeout");
+
+  if (mqtt_sock >= 0 && mqtt_state == MQTT_CONNECTED) {
+    /* keepalive */
+    if (mqtt_ping_sent && mqtt_last_rx + config->mqtt_keepalive < now) {
+      mqtt_close("no response from broker");
+    } else {
+      if (!mqtt_ping_sent && mqtt_last_tx + config->mqtt_keepalive/2 <= now &&
+	  mqtt_put_simple(MQTT_PINGREQ) == 0) {
+	mqtt_ping_sent=1;
+	mqtt_last_rx=now;
+      }
+      mqtt_update_state(astat);
+      mqtt_send_queued();
+    }
+  }
+
+  if (mqtt_sock >= 0 && mqtt_out_len > 0 && mqtt_state != MQTT_CONNECTING)
+    mqtt_flush(now);
+
+  mqtt_stats.queued=mqtt_queue_len;
+  if (memcmp(&mqtt_stats,&shm->mqttstats,sizeof(mqtt_stats))) {
+    shm_write_begin(shm);
+    shm->mqttstats=mqtt_stats;
+    shm_write_end(shm);
+  }
+}
+
+
+/* publish "offline" status and disconnect from broker (at exit) */
+void mqtt_shutdown()
+{
+  struct pollfd pfd;
+  char topic[256];
+  int i;
+
+  if (mqtt_sock < 0) return;
+
+  if (mqtt_state == MQTT_CONNECTED) {
+    snprintf(topic,sizeof(topic),"%s/status",config->mqtt_prefix);
+    mqtt_publish(topic,"offline",1);
+    mqtt_send_queued();
+    mqtt_put_simple(MQTT_DISCONNECT);
+
+    /* wait (briefly) for the data to be written */
+    for (i=0; i<10 && mqtt_out_len > 0 && mqtt_sock >= 0; i++) {
+      pfd.fd=mqtt_sock;
+      pfd.events=POLLOUT;
+      pfd.revents=0;
+      if (poll(&pfd,1,100) > 0) mqtt_flush(time(NULL));
+    }
+  }
+
+  if (mqtt_sock >= 0) close(mqtt_sock);
+  mqtt_sock=-1;
+  mqtt_state=MQTT_DISCONNECTED;
+}
+
+
+/* eof :-) */
@@ -27,6 +27,8 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #define DEBUG 0
 
@@ -248,170 +250,169 @@ const char* nx_log_event_str(const nx_log_event_t *event)
 }
 
 
-int nx_read_packet(int fd, nxmsg_t *msg, int protocol)
+void nx_conn_init(nx_conn_t *conn, int fd, int protocol)
 {
-  static unsigned char tmp[1024];
-  static int len = -1;
-  static int msglen = -1;
-  static int rawlen = -1;
+  if (!conn) return;
+
+  memset(conn,0,sizeof(nx_conn_t));
+  conn->fd=fd;
+  conn->protocol=protocol;
+  conn->timeout=NX_DEFAULT_TIMEOUT;
+  conn->frame_timeout=NX_DEFAULT_FRAME_TIMEOUT;
+  conn->retry=NX_DEFAULT_RETRY;
+  conn->window=NX_DEFAULT_WINDOW;
+}
 
-  int i,r;
-  unsigned char csum1,csum2,*tmpptr;
-  unsigned char checksumbuf[1024];
-  unsigned char startchar;
-  int multiplier;
 
+static inline int hexval(uchar c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
 
 
-  if (protocol == NX_PROTOCOL_ASCII) {
-    startchar=0x0a;
-    multiplier=2;
+/* read whatever is available from serial port into ring buffer,
+   returns number of bytes read (0 if nothing available) */
+static int nx_fill_rxbuf(nx_conn_t *conn)
+{
+  nx_rxbuf_t *rx = &conn->rx;
+  struct iovec iov[2];
+  unsigned int used = rx->head - rx->tail;
+  unsigned int space = NX_RXBUF_SIZE - used;
+  unsigned int pos = rx->head & (NX_RXBUF_SIZE-1);
+  int iovcnt = 1;
+  int r;
+
+  if (space == 0) {
+    /* should never happen as buffer fits several maximum size frames */
+    logmsg(3,"nx_fill_rxbuf(): receive buffer full, discarding data");
+    conn->stats.discarded_bytes+=used;
+    rx->tail=rx->head;
+    space=NX_RXBUF_SIZE;
+  }
+
+  iov[0].iov_base=&rx->buf[pos];
+  if (pos + space > NX_RXBUF_SIZE) {
+    iov[0].iov_len=NX_RXBUF_SIZE - pos;
+    iov[1].iov_base=&rx->buf[0];
+    iov[1].iov_len=space - iov[0].iov_len;
+    iovcnt=2;
   } else {
-    startchar=0x7e;
-    multiplier=1;
+    iov[0].iov_len=space;
   }
 
-  if (fd < 0 || !msg) {
-    fprintf(stderr,"nx_read_packet(): invalid arguments\n");
-    logmsg(0,"nx_read_packet(): invalid arguments");
+  do {
+    r = readv(conn->fd,iov,iovcnt);
+    conn->stats.read_calls++;
+  } while (r == -1 && errno==EINTR);
+
+  if (r < 0) {
+    if (errno == EAGAIN) return 0;
+    fprintf(stderr,"nx_read_packet(): read() failed (%d)\n",errno);
+    logmsg(0,"nx_read_packet(): read() failed (%d)",errno);
+    exit(1);
+  } else if (r == 0) {
+    fprintf(stderr,"nx_read_packet(): EOF while reading serial port\n");
+    logmsg(0,"nx_read_packet(): EOF while reading serial port");
     exit(1);
   }
 
-  if (len < 0) {
-    /* look for start of message */
-    do {
-      do {
-	r = read(fd,tmp,1);
-      } while (r == -1 && errno==EINTR);
-
-      if (r < 0) {
-	if (errno == EAGAIN) return 0;
-	fprintf(stderr,"nx_read_packet(): read() failed (%d) while looking start of message\n",errno);
-	logmsg(0,"nx_read_packet(): read() failed (%d) while looking start of message",errno);
-	exit(1);
-      } else if (r == 0) {
-	fprintf(stderr,"nx_read_packet(): EOF while looking start of message\n");
-	logmsg(0,"nx_read_packet(): EOF while looking start of message");
-	exit(1);
-      }
-    } while (tmp[0] != startchar);
-    len=0;
-  }
+  conn->stats.bytes_in+=r;
+  rx->head+=r;
+  return r;
+}
 
-  if (len < 1*multiplier) {
-    /* read packet size */
-    while (len < multiplier) {
-      do {
-	r = read(fd,&tmp[len],(multiplier-len));
-      } while (r == -1 && errno==EINTR);
-
-      if (r < 0) {
-	if (errno == EAGAIN) return 0;
-	fprintf(stderr,"nx_read_packet(): read() failed (%d) while reading message length\n",errno);
-	logmsg(0,"nx_read_packet(): read() failed (%d) while reading message length",errno);
-	exit(1);
-      }
 
-      len+=r;
-    }
+/* attempt to decode one frame from the receive buffer,
+   returns: 1 = message decoded, 0 = no complete message available,
+           -1 = invalid message (message discarded) */
+static int nx_parse_frame(nx_conn_t *conn, nxmsg_t *msg)
+{
+  nx_rxbuf_t *rx = &conn->rx;
+  int protocol = conn->protocol;
+  unsigned char checksumbuf[260];
+  unsigned char csum1,csum2;
+  unsigned char startchar = (protocol == NX_PROTOCOL_ASCII ? 0x0a : 0x7e);
+  unsigned int pos,avail;
+  int i,msglen,val,hi,lo;
+
+#define RXBYTE(n) (rx->buf[(rx->tail+(n)) & (NX_RXBUF_SIZE-1)])
+
+  /* look for start of message */
+  while (rx->tail != rx->head && RXBYTE(0) != startchar) {
+    rx->tail++;
+    conn->stats.discarded_bytes++;
   }
+  avail = rx->head - rx->tail;
+  if (avail < 1) return 0;
 
-  if (msglen == -1) {
-    if (protocol == NX_PROTOCOL_ASCII) {
-      tmp[2]=0;
-      if (sscanf((const char*)tmp,"%x",&msglen) != 1) {
-	logmsg(3,"nx_read_packet(): invalid packet (length)");
-	len=-1;
-	msglen=-1;
+  if (protocol == NX_PROTOCOL_ASCII) {
+    if (avail < 3) return 0;
+    hi=hexval(RXBYTE(1));
+    lo=hexval(RXBYTE(2));
+    if (hi < 0 || lo < 0) {
+      logmsg(3,"nx_read_packet(): invalid packet (length)");
+      rx->tail++;
+      conn->stats.invalid_frames++;
+      return -1;
+    }
+    msglen=(hi << 4) | lo;
+
+    /* start + length + message number + data + checksum + end (0x0d) */
+    if (avail < 1 + 2*(1+msglen+2) + 1) return 0;
+
+    for (i=1; i<=msglen+2; i++) {
+      hi=hexval(RXBYTE(1+i*2));
+      lo=hexval(RXBYTE(1+i*2+1));
+      if (hi < 0 || lo < 0) {
+	logmsg(3,"nx_read_packet(): invalid data in packet (pos=%d)",i);
+	rx->tail++;
+	conn->stats.invalid_frames++;
 	return -1;
       }
-    } else {
-      msglen=tmp[0];
+      checksumbuf[i]=(hi << 4) | lo;
     }
-
-    /* printf("message length = %d (%02x)\n",msglen,msglen); */
-    rawlen = multiplier * (1+msglen+2) + (protocol == NX_PROTOCOL_ASCII ? 1 : 0);
+    pos = 1 + 2*(1+msglen+2) + 1;
   }
-
-
-  /* read message data */
-
-  if (len <  rawlen) {
-    while (len < rawlen) {
-      do {
-	r = read(fd,&tmp[len],(rawlen-len));
-      } while (r == -1 && errno==EINTR);
-
-      if (r < 0) {
-	if (errno == EAGAIN) return 0;
-	fprintf(stderr,"nx_read_packet(): read() failed (%d) while reading message data\n",errno);
-	logmsg(0,"nx_read_packet(): read() failed (%d) while reading message data",errno);
-	exit(1);
+  else { /* NX_PROTOCOL_BINARY */
+    pos=1;
+    for (i=0; ; i++) {
+      if (pos >= avail) return 0;
+      val=RXBYTE(pos);
+      if (val == 0x7e) {
+	/* 0x7e should always be considered as start of new packet */
+	logmsg(3,"nx_read_packet(): invalid data in packet %x (pos=%d)",val,i);
+	rx->tail+=pos;
+	conn->stats.invalid_frames++;
+	return -1;
       }
-
-      if (protocol == NX_PROTOCOL_BINARY) {
-	/* any byte stuffed bytes means we need to read extra byte... */
-	int c = 0;
-	int j;
-	for (j=0;j<r;j++) {
-	  if (tmp[len+j] == 0x7d) c++;
-	}
-	rawlen+=c;
+      if (val == 0x7d) {
+	if (pos+1 >= avail) return 0;
+	pos++;
+	val=(RXBYTE(pos) ^ 0x20);
+      }
+      pos++;
+      if (i == 0) {
+	msglen=val;
+      } else {
+	checksumbuf[i]=val;
+	if (i == msglen+2) break;
       }
-
-      len+=r;
     }
   }
 
+#undef RXBYTE
 
-  /* decode message */
+  /* message received, remove it from the buffer */
+  rx->tail+=pos;
 
   msg->len=msglen;
-  i=1; /* skip the message length in the buffer already */
-  tmpptr=tmp+i;
-
-  while (i<=msglen+2) {
-    char buf[3];
-    int val;
-
-    if (protocol == NX_PROTOCOL_ASCII) {
-      buf[0]=tmp[i*2];
-      buf[1]=tmp[i*2+1];
-      buf[2]=0;
-      if (sscanf(buf,"%x",&val) != 1) {
-	logmsg(3,"nx_read_packet(): invalid data in packet '%s' (pos=%d)",tmp,i);
-	len=-1;
-	msglen=-1;
-	return -1;
-      }
-    } else { /* NX_PROTOCOL_BINARY */
-      if  (*tmpptr == 0x7e) {
-	logmsg(3,"nx_read_packet(): invalid data in packet %x (pos=%d)",*tmpptr,i);
-	len=0; /* 0x7e should always be considered as start of new packet */
-	msglen=-1;
-	return -1;
-      } else if (*tmpptr == 0x7d) {
-	tmpptr++;
-	val=(*tmpptr ^ 0x20);
-      } else {
-	val=*tmpptr;
-      }
-    }
-
-    if (i==1) {
-      msg->msgnum=val;
-    } else if (i==msglen+1) {
-      msg->sum1=val;
-    } else if (i==msglen+2) {
-      msg->sum2=val;
-    } else {
-      msg->msg[i-2]=val;
-    }
-    checksumbuf[i]=val;
-
-    i++;
-    tmpptr++;
-  }
+  msg->msgnum=checksumbuf[1];
+  if (msglen > 1) memcpy(msg->msg,&checksumbuf[2],msglen-1);
+  msg->sum1=checksumbuf[msglen+1];
+  msg->sum2=checksumbuf[msglen+2];
 
   checksumbuf[0]=msg->len;
   fletcher_checksum(checksumbuf,msg->len+1,&csum1,&csum2);
@@ -423,21 +424,65 @@ int nx_read_packet(int fd, nxmsg_t *msg, int protocol)
   fprintf(stderr,": chksum=%02X %02X %s\n",msg->sum1,msg->sum2,((msg->sum1==csum1 && msg->sum2==csum2)?"OK":"ERR"));
 #endif
 
-
-  len=-1;
-  msglen=-1;
-
   if ( (msg->sum1 != csum1) || (msg->sum2 != csum2) ) {
     logmsg(3,"nx_read_packet(): invalid packet checksum");
+    conn->stats.invalid_frames++;
     return -1;
   }
 
+  conn->stats.frames++;
   msg->r_time=time(NULL);
   msg->s_time=0;
   return 1;
 }
 
 
+/* return frame decoded earlier by nx_conn_pending(), or decode next one */
+static int nx_decode_frame(nx_conn_t *conn, nxmsg_t *msg)
+{
+  int r;
+
+  if (conn->held_r != 0) {
+    r = conn->held_r;
+    if (r > 0) *msg = conn->held;
+    conn->held_r = 0;
+    return r;
+  }
+  return nx_parse_frame(conn,msg);
+}
+
+
+/* check if a complete (or invalid) frame is waiting in the receive buffer,
+   so it can be processed without waiting for serial port to be readable */
+int nx_conn_pending(nx_conn_t *conn)
+{
+  if (!conn) return 0;
+  if (conn->held_r == 0 && conn->rx.head != conn->rx.tail)
+    conn->held_r = nx_parse_frame(conn,&conn->held);
+  return (conn->held_r != 0);
+}
+
+
+int nx_read_packet(nx_conn_t *conn, nxmsg_t *msg)
+{
+  int r;
+
+  if (!conn || conn->fd < 0 || !msg) {
+    fprintf(stderr,"nx_read_packet(): invalid arguments\n");
+    logmsg(0,"nx_read_packet(): invalid arguments");
+    exit(1);
+  }
+
+  /* return any message already in the buffer before reading more data */
+  r = nx_decode_frame(conn,msg);
+  if (r != 0) return r;
+
+  if (nx_fill_rxbuf(conn) < 1) return 0;
+
+  return nx_decode_frame(conn,msg);
+}
+
+
 static inline void byte_stuff(unsigned char **buf, unsigned char c)
 {
   if (buf) {
@@ -453,8 +498,9 @@ static inline void byte_stuff(unsigned char **buf, unsigned char c)
 }
 
 
-int nx_write_packet(int fd, nxmsg_t *msg, int protocol)
+int nx_write_packet(nx_conn_t *conn, nxmsg_t *msg)
 {
+  int protocol = conn->protocol;
   unsigned char out[1024];
   unsigned char tmp[1024];
   unsigned char *p = out;
@@ -507,9 +553,12 @@ int nx_write_packet(int fd, nxmsg_t *msg, int protocol)
   }
 
   do {
-    w=write(fd,out,p-out);
+    w=write(conn->fd,out,p-out);
+    conn->stats.write_calls++;
   } while (w == -1 && (errno == EAGAIN || errno == EINTR));
 
+  if (w > 0) conn->stats.bytes_out+=w;
+
   if (w == (p-out)) {
     msg->r_time = 0;
     msg->s_time = time(NULL);
@@ -520,104 +569,197 @@ int nx_write_packet(int fd, nxmsg_t *msg, int protocol)
 
 
 
-int nx_receive_message(int fd, int protocol, nxmsg_t *msg, int timeout)
+/* acknowledge (or reject) received message as needed */
+static void nx_ack_message(nx_conn_t *conn, nxmsg_t *msg, int r)
 {
-  fd_set rfds;
-  struct timeval tv;
-  int ret;
-  time_t etime,extratime;
   nxmsg_t msgout;
 
-  if (fd < 0 || !msg) return -3;
+  if (r == 1) {
+    logmsg(3,"nx_receive_message(): got message %02x (%02x)",msg->msgnum & NX_MSG_MASK, msg->msgnum);
+    if ( NX_IS_ACKMSG(msg->msgnum) ) {
+      logmsg(3,"nx_receive_message(): sending ACK as requested");
+      msgout.msgnum=NX_POSITIVE_ACK;
+      msgout.len=1;
+      if (nx_write_packet(conn,&msgout) < 0)
+	logmsg(3,"nx_receive_message(): error sending ACK");
+    }
+  } else if (r < 0) {
+    logmsg(3,"nx_receive_message(): invalid message received");
+    msgout.msgnum=NX_MSG_REJECTED;
+    msgout.len=1;
+    nx_write_packet(conn,&msgout);
+  }
+}
 
-  etime=time(NULL)+timeout;
-  extratime=0;
 
-  do {
+long long nx_time_ms()
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC,&ts) < 0)
+    return (long long)time(NULL) * 1000;
+
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* get next message if one is available (without waiting),
+   returns: 1 = message received, 0 = no (complete) message available,
+           -1 = invalid message received */
+int nx_poll_message(nx_conn_t *conn, nxmsg_t *msg)
+{
+  int r;
+
+  if (!conn || conn->fd < 0 || !msg) return -3;
+
+  r = nx_read_packet(conn,msg);
+  nx_ack_message(conn,msg,r);
+  return r;
+}
+
+
+/* wait for next message (up to timeout milliseconds),
+   returns: 1 = message received, 0 = timeout, -1 = invalid message received,
+           < -1 = error */
+int nx_receive_message(nx_conn_t *conn, nxmsg_t *msg, int timeout)
+{
+  struct pollfd pfd;
+  int ret,r,wait;
+  long long now,deadline;
+  int partial = 0;
+
+  if (!conn || conn->fd < 0 || !msg) return -3;
+
+  now=nx_time_ms();
+  deadline=now+(timeout > 0 ? timeout : 0);
+
+  while (1) {
+
+    /* check for (complete) messages already in the buffer first */
+    r = nx_decode_frame(conn,msg);
+    if (r != 0) break;
 
-    FD_ZERO(&rfds);
-    FD_SET(fd,&rfds);
-    tv.tv_sec=0;
-    tv.tv_usec=200000;
+    /* allow extra time for rest of the message to arrive, if we have
+       already received part of it */
+    if (!partial && conn->rx.head != conn->rx.tail) {
+      logmsg(3,"nx_receive_message(): partial message");
+      partial=1;
+      if (deadline < now + conn->frame_timeout)
+	deadline=now + conn->frame_timeout;
+    }
+
+    wait=(deadline > now ? deadline - now : 0);
+    pfd.fd=conn->fd;
+    pfd.events=POLLIN;
+    pfd.revents=0;
     do {
-      ret = select(fd+1,&rfds,NULL,NULL,&tv);
+      ret = poll(&pfd,1,wait);
     } while (ret == -1 && errno==EINTR);
     if (ret < 0) {
-      logmsg(2,"nx_receive_message(): select failed: %d (%s)",errno,strerror(errno));
+      logmsg(2,"nx_receive_message(): poll failed: %d (%s)",errno,strerror(errno));
       return -2;
     }
 
     if (ret > 0) {
-      /* printf("data waiting\n"); */
-
-      int r = nx_read_packet(fd,msg,protocol);
-      if (r==1) {
-	logmsg(3,"nx_receive_message(): got message %02x (%02x)",msg->msgnum & NX_MSG_MASK, msg->msgnum);
-	if ( NX_IS_ACKMSG(msg->msgnum) ) {
-	  logmsg(3,"nx_receive_message(): sending ACK as requested");
-	  msgout.msgnum=NX_POSITIVE_ACK;
-	  msgout.len=1;
-	  if (nx_write_packet(fd,&msgout,protocol) < 0)
-	    logmsg(3,"nx_receive_message(): error sending ACK");
-	}
-	return 1;
-      } else if (r==0) {
-	logmsg(3,"nx_receive_message(): partial message");
-	usleep(100000);
-	if (extratime==0) extratime=2;
-      } else {
-	logmsg(3,"nx_receive_message(): invalid message received");
-	msgout.msgnum=NX_MSG_REJECTED;
-	msgout.len=1;
-	nx_write_packet(fd,&msgout,protocol);
-	return -1;
+      if (nx_fill_rxbuf(conn) < 0) return -2;
+    }
+
+    now=nx_time_ms();
+    if (ret == 0 || now > deadline) {
+      /* last chance to get a message from what was just read */
+      r = nx_decode_frame(conn,msg);
+      if (r != 0) break;
+      if (now >= deadline) {
+	logmsg(4,"nx_receive_message(): timeout (no message received)");
+	return 0;
       }
     }
-  } while (time(NULL) <= (etime+extratime));
+  }
 
-  logmsg(4,"nx_receive_message(): timeout (no message received)");
-  return 0;
+  nx_ack_message(conn,msg,r);
+  return r;
+}
+
+
+/* check if received message is the reply to a request */
+int nx_reply_matches(const nxmsg_t *req, unsigned char replycmd, const nxmsg_t *reply)
+{
+  if (!req || !reply) return 0;
+
+  switch (reply->msgnum) {
+  case NX_CMD_FAILED:
+  case NX_POSITIVE_ACK:
+  case NX_NEGATIVE_ACK:
+  case NX_MSG_REJECTED:
+    return 1;
+  }
+
+  /* transition messages (ACK requested) are never replies to requests */
+  if (reply->msgnum != replycmd) return 0;
+
+  switch (replycmd) {
+  case NX_ZONE_NAME_MSG:
+  case NX_ZONE_STATUS_MSG:
+  case NX_ZONE_SNAPSHOT_MSG:
+  case NX_PART_STATUS_MSG:
+  case NX_LOG_EVENT_MSG:
+    /* zone / partition / log entry number (or snapshot offset) */
+    return (req->len > 1 && reply->msg[0] == req->msg[0]);
+  case NX_PROG_DATA_REPLY:
+    /* device, location and segment */
+    return (reply->msg[0] == req->msg[0] &&
+	    (reply->msg[1] & 0x4f) == (req->msg[1] & 0x4f) &&
+	    reply->msg[2] == req->msg[2]);
+  }
+
+  return 1;
 }
 
 
-int nx_send_message(int fd, int protocol, nxmsg_t *msg, int timeout, int retry, unsigned char replycmd, nxmsg_t *replymsg)
+int nx_send_message(nx_conn_t *conn, nxmsg_t *msg, unsigned char replycmd, nxmsg_t *replymsg)
 {
-  int res, t;
+  int res;
   int count = 0;
+  long long now, deadline, maxwait;
 
-  if (fd < 0 || !msg) return -2;
+  if (!conn || conn->fd < 0 || !msg) return -2;
 
 
   do {
 
-    if (nx_write_packet(fd,msg,protocol) < 0) {
+    if (nx_write_packet(conn,msg) < 0) {
       logmsg(3,"nx_send_message(): failed to send message %02d (errno=%d)",msg->msgnum & NX_MSG_MASK, errno);
       return -1;
     }
     logmsg(3,"nx_send_message(): message %02x sent",msg->msgnum & NX_MSG_MASK);
 
-    t=3;
-    while (t > 0) {
-      usleep(100000);
-      res=nx_receive_message(fd,protocol,replymsg,timeout);
-      char rnum = replymsg->msgnum;
+    /* unrelated messages received while waiting extend the wait (they do
+       not count as attempts), but limit total wait time in case panel
+       keeps sending them */
+    now=nx_time_ms();
+    deadline=now + conn->timeout;
+    maxwait=now + 3*conn->timeout;
+    while (now < deadline) {
+      res=nx_receive_message(conn,replymsg,deadline - now);
+      now=nx_time_ms();
       if (res==1) {
-	if ( rnum == replycmd ||
-	     rnum == NX_CMD_FAILED ||
-	     rnum == NX_POSITIVE_ACK ||
-	     rnum == NX_NEGATIVE_ACK ||
-	     rnum == NX_MSG_REJECTED ) {
-	  logmsg(3,"nx_send_message(): reply received %02x (%02x)",rnum & NX_MSG_MASK,replymsg->msgnum);
+	if (nx_reply_matches(msg,replycmd,replymsg)) {
+	  logmsg(3,"nx_send_message(): reply received %02x (%02x)",replymsg->msgnum & NX_MSG_MASK,replymsg->msgnum);
 	  return 1;
-	} else {
-	  logmsg(3,"nx_send_message(): wrong reply %02x (%02x) received",rnum & NX_MSG_MASK,replymsg->msgnum);
 	}
+	logmsg(3,"nx_send_message(): unsolicited message %02x (%02x) received",
+	       replymsg->msgnum & NX_MSG_MASK,replymsg->msgnum);
+	if (conn->unsolicited)
+	  conn->unsolicited(replymsg);
+	deadline=now + conn->timeout;
+	if (deadline > maxwait) deadline=maxwait;
+	continue;
       }
-      t--;
+      if (res < -1) break;
     }
     logmsg(3,"nx_send_message(): no response received");
 
-  } while (count++ < retry);
+  } while (count++ < conn->retry);
 
   return 0;
 }
@@ -1040,4 +1182,122 @@ const char* nx_prog_datatype_str(uchar datatype)
 }
 
 
+#define BATCH_IDLE 0
+#define BATCH_SENT 1
+#define BATCH_DONE 2
+
+/* send a batch of requests to the panel keeping up to conn->window
+   requests outstanding at a time, failed requests are retried
+   individually. Returns number of requests that got a reply. */
+int nx_send_batch(nx_conn_t *conn, nx_batch_item_t *items, int count, int flags)
+{
+  nxmsg_t msg;
+  nx_batch_item_t *it, *match;
+  int i, r;
+  int next = 0;
+  int pending = 0;
+  int replies = 0;
+  int stop = 0;
+  int window;
+  long long now, deadline;
+
+  if (!conn || conn->fd < 0 || !items || count < 0) return -2;
+
+  window=(conn->window > 0 ? conn->window : 1);
+  for (i=0; i<count; i++) {
+    items[i].result=0;
+    items[i].tries=0;
+    items[i].state=BATCH_IDLE;
+  }
+
+
+  while (pending > 0 || (!stop && next < count)) {
+
+    /* send more requests until window is full */
+    for (i=next; !stop && i<count && pending < window; i++) {
+      it=&items[i];
+      if (it->state != BATCH_IDLE) continue;
+      if (nx_write_packet(conn,&it->req) < 0) {
+	logmsg(3,"nx_send_batch(): failed to send message %02x (errno=%d)",
+	       it->req.msgnum & NX_MSG_MASK, errno);
+	return -1;
+      }
+      it->sent=nx_time_ms();
+      it->tries++;
+      it->state=BATCH_SENT;
+      pending++;
+    }
+    while (next < count && items[next].state != BATCH_IDLE) next++;
+    if (pending == 0) continue;
+
+
+    /* wait for reply until first outstanding request times out */
+    deadline=0;
+    for (i=0; i<count; i++) {
+      if (items[i].state == BATCH_SENT &&
+	  (deadline == 0 || items[i].sent + conn->timeout < deadline))
+	deadline=items[i].sent + conn->timeout;
+    }
+    now=nx_time_ms();
+    r=nx_receive_message(conn,&msg,(deadline > now ? deadline - now : 0));
+    if (r < -1) return -2;
+
+    if (r == 1) {
+      /* generic replies (ACK etc.) belong to the oldest outstanding request */
+      match=NULL;
+      for (i=0; i<count; i++) {
+	it=&items[i];
+	if (it->state == BATCH_SENT && nx_reply_matches(&it->req,it->replycmd,&msg) &&
+	    (!match || it->sent < match->sent))
+	  match=it;
+      }
+
+      if (!match) {
+	logmsg(3,"nx_send_batch(): unsolicited message %02x (%02x) received",
+	       msg.msgnum & NX_MSG_MASK,msg.msgnum);
+	if (conn->unsolicited)
+	  conn->unsolicited(&msg);
+      } else if (msg.msgnum == NX_NEGATIVE_ACK && match->tries <= conn->retry) {
+	logmsg(3,"nx_send_batch(): message %02x rejected, retrying",
+	       match->req.msgnum & NX_MSG_MASK);
+	match->state=BATCH_IDLE;
+	pending--;
+	if (match - items < next) next=match - items;
+      } else {
+	match->reply=msg;
+	match->result=1;
+	match->state=BATCH_DONE;
+	pending--;
+	replies++;
+	if ((flags & NX_BATCH_STOP_ON_ERROR) && msg.msgnum != match->replycmd)
+	  stop=1;
+      }
+    }
+
+
+    /* check for requests that have timed out */
+    now=nx_time_ms();
+    for (i=0; i<count; i++) {
+      it=&items[i];
+      if (it->state != BATCH_SENT || it->sent + conn->timeout > now) continue;
+      pending--;
+      if (it->tries <= conn->retry) {
+	logmsg(3,"nx_send_batch(): no response to message %02x, retrying",
+	       it->req.msgnum & NX_MSG_MASK);
+	it->state=BATCH_IDLE;
+	if (i < next) next=i;
+      } else {
+	logmsg(3,"nx_send_batch(): no response to message %02x",
+	       it->req.msgnum & NX_MSG_MASK);
+	it->state=BATCH_DONE;
+	if (flags & NX_BATCH_STOP_ON_ERROR)
+	  stop=1;
+      }
+    }
+  }
+
+  return replies;
+}
+
+
 /* eof :-) */
@@ -199,6 +199,64 @@ typedef struct nxmsg {
 } nxmsg_t;
 
 
+/* receive buffer size (must be power of 2) */
+#define NX_RXBUF_SIZE         2048
+
+typedef struct nx_rxbuf {
+  uchar buf[NX_RXBUF_SIZE];
+  uint head;  /* write position (free running counter) */
+  uint tail;  /* read position (free running counter) */
+} nx_rxbuf_t;
+
+
+typedef struct nx_io_stats {
+  unsigned long read_calls;      /* read() system calls */
+  unsigned long write_calls;     /* write() system calls */
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+  unsigned long frames;          /* valid messages received */
+  unsigned long invalid_frames;  /* messages with invalid data or checksum */
+  unsigned long discarded_bytes; /* bytes skipped while looking for start of message */
+} nx_io_stats_t;
+
+
+/* default protocol timeouts (ms) */
+#define NX_DEFAULT_TIMEOUT        2000
+#define NX_DEFAULT_FRAME_TIMEOUT  500
+#define NX_DEFAULT_RETRY          3
+#define NX_DEFAULT_WINDOW         1   /* no pipelining unless configured */
+
+/* NX-584 interface connection (context for all protocol I/O) */
+typedef struct nx_conn {
+  int fd;
+  int protocol;
+  int timeout;        /* timeout (ms) waiting for reply */
+  int frame_timeout;  /* max time (ms) to wait for rest of partial message */
+  int retry;          /* number of retries for commands */
+  int window;         /* max requests outstanding in nx_send_batch() */
+  nx_rxbuf_t rx;
+  nxmsg_t held;       /* frame decoded by nx_conn_pending() */
+  int held_r;         /* nx_conn_pending() result (0 = no frame held) */
+  nx_io_stats_t stats;
+  void (*unsolicited)(nxmsg_t *msg); /* handler for messages received while waiting for reply */
+} nx_conn_t;
+
+
+/* request in a batch sent using nx_send_batch() */
+typedef struct nx_batch_item {
+  nxmsg_t   req;
+  uchar     replycmd;
+  nxmsg_t   reply;
+  int       result;  /* 1 = reply received, 0 = no reply */
+  int       tries;
+  int       state;   /* internal */
+  long long sent;    /* internal: time (ms) request was last sent */
+} nx_batch_item_t;
+
+/* nx_send_batch() flags */
+#define NX_BATCH_STOP_ON_ERROR 0x01  /* stop sending after failed request */
+
+
 typedef struct nx_log_event_type {
   uchar type;
   char valtype;  /* Z = Zone, U = User, D = Device, N = None */
@@ -236,17 +294,23 @@ extern const nx_panel_model_t nx_panel_models[];
 extern const nx_log_event_type_t nx_log_event_types[];
 
 
-int nx_read_packet(int fd, nxmsg_t *msg, int protocol);
-int nx_write_packet(int fd, nxmsg_t *msg, int protocol);
+void nx_conn_init(nx_conn_t *conn, int fd, int protocol);
+int nx_read_packet(nx_conn_t *conn, nxmsg_t *msg);
+int nx_write_packet(nx_conn_t *conn, nxmsg_t *msg);
 void nx_print_msg(FILE *fp, nxmsg_t *msg);
-int nx_receive_message(int fd, int protocol, nxmsg_t *msg, int timeout);
-int nx_send_message(int fd, int protocol, nxmsg_t *msg, int timeout, int retry, unsigned char replycmd, nxmsg_t *replymsg);
+int nx_receive_message(nx_conn_t *conn, nxmsg_t *msg, int timeout);
+int nx_poll_message(nx_conn_t *conn, nxmsg_t *msg);
+int nx_conn_pending(nx_conn_t *conn);
+int nx_send_message(nx_conn_t *conn, nxmsg_t *msg, unsigned char replycmd, nxmsg_t *replymsg);
+int nx_send_batch(nx_conn_t *conn, nx_batch_item_t *items, int count, int flags);
+int nx_reply_matches(const nxmsg_t *req, unsigned char replycmd, const nxmsg_t *reply);
 const char* nx_timestampstr(time_t t);
 const char* nx_log_event_str(const nx_log_event_t *event);
 const char* nx_log_event_text(uchar eventnum);
 int nx_log_event_partinfo(uchar eventnum);
 char nx_log_event_valtype(uchar eventnum);
 const char* nx_prog_datatype_str(uchar datatype);
+long long nx_time_ms();
 
 
 void logmsg(int priority, char *format, ...);
@@ -34,6 +34,8 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
@@ -49,12 +51,66 @@
 
 int verbose_mode = 0;
 int msgid = -1;
+int replyid = -1;
 nx_configuration_t configuration;
 nx_configuration_t *config = &configuration;
 nx_shm_t *shm = NULL;
 int shmid = -1;
 
 
+/* notify server process (via command socket) that message has been queued */
+
+int ring_doorbell(const char *path, const nx_ipc_msg_t *msg)
+{
+  struct sockaddr_un addr;
+  nx_ipc_doorbell_t db;
+  int sock, r;
+
+  if (!path || strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+
+  if ((sock=socket(AF_UNIX,SOCK_DGRAM,0)) < 0)
+    return -2;
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strlcpy(addr.sun_path,path,sizeof(addr.sun_path));
+
+  db.msgid[0]=msg->msgid[0];
+  db.msgid[1]=msg->msgid[1];
+  db.sent=nx_time_ms();
+
+  r=sendto(sock,&db,sizeof(db),MSG_DONTWAIT,(struct sockaddr*)&addr,sizeof(addr));
+  close(sock);
+
+  return (r == sizeof(db) ? 0 : -3);
+}
+
+
+/* wait for next reply from server process (until given time),
+   returns 1 if reply was received, 0 on timeout */
+int wait_reply(nx_ipc_msg_reply_t *reply, time_t tm)
+{
+  nx_ipc_reply_msg_t msg;
+  size_t msgsize = sizeof(nx_ipc_reply_msg_t) - sizeof(long);
+  uint changes;
+
+  while (1) {
+    changes=shm->changes;
+    if (msgrcv(replyid,&msg,msgsize,getpid(),IPC_NOWAIT) == msgsize) {
+      *reply=msg.reply;
+      return 1;
+    }
+    if (errno != ENOMSG && errno != EINTR)
+      die("failed to read reply queue: %s (errno=%d)",strerror(errno),errno);
+    if (time(NULL) > tm)
+      return 0;
+    /* server updates shared memory after sending a reply */
+    shm_wait_change(shm,changes,1000);
+  }
+}
+
+
 /* Based on old GNU getpass() implementation
    http://www.gnu.org/s/hello/manual/libc/getpass.html */
 
@@ -194,6 +250,219 @@ void parse_program_data(int datatype, char *progdata, int *datalen, int argc, ch
   *datalen=len;
 }
 
+/* program_batch - program locations listed in a file (or stdin), each
+   line contains: <device> <location> <type> <data1> ... <dataN> */
+
+#define BATCH_LOCATIONS_MAX 4096
+#define BATCH_MESSAGES_PENDING 16
+
+typedef struct batch_location {
+  int  device;
+  int  location;
+  int  line;
+  char result;
+} batch_location_t;
+
+/* send batch messages to server process (keeping only limited number of
+   messages waiting for reply so that server is not flooded) and wait for
+   replies, result of each location is stored in locs */
+static void send_batch(nx_ipc_msg_t *msgs, int msgcount, batch_location_t *locs,
+		       int timeout, int nowait)
+{
+  nx_ipc_msg_reply_t reply;
+  int i,j,k,r,sent,replies;
+  char *s;
+  time_t tm;
+
+  sent=0;
+  replies=0;
+  tm=time(NULL) + timeout;
+  while (replies < msgcount && time(NULL) <= tm) {
+    while (sent < msgcount && (nowait || sent - replies < BATCH_MESSAGES_PENDING)) {
+      if (msgsnd(msgid,&msgs[sent],sizeof(nx_ipc_msg_t)-sizeof(long),0) < 0)
+	die("error sending message to server process: %s (errno=%d)\n",
+	    strerror(errno),errno);
+      if (config->cmd_socket)
+	ring_doorbell(config->cmd_socket,&msgs[sent]);
+      sent++;
+    }
+    if (nowait)
+      return;
+
+    if (!wait_reply(&reply,tm)) break;
+    for(i=0,j=0; i<sent; j+=msgs[i].data[0] & ~NX_PROG_BATCH_CHECK,i++) {
+      if (msgs[i].msgid[0] != reply.msgid[0] || locs[j].result >= 0) continue;
+
+      replies++;
+      tm=time(NULL) + timeout;
+      if (verbose_mode) printf("%s\n",reply.data);
+      s=strchr(reply.data,'[');
+      for(k=0; k<(msgs[i].data[0] & ~NX_PROG_BATCH_CHECK); k++) {
+	r=(s && s[1+k] >= '0' && s[1+k] <= '9' ? s[1+k] - '0' : -1);
+	locs[j+k].result=(r >= 0 ? r : 99);
+      }
+      if (!s && !verbose_mode) printf("%s\n",reply.data);
+      break;
+    }
+  }
+}
+
+
+int program_batch(const char *filename, int timeout, int nowait)
+{
+  static const char *results[] = {
+    "ok",
+    "cannot read current data",
+    "data type mismatch",
+    "data length mismatch",
+    "program data command failed",
+    "verify failed (data differs)",
+    "verify failed (cannot read data)",
+    "not programmed"
+  };
+  FILE *fp;
+  char line[1024], *argv[40], *s, *t;
+  char progdata[32];
+  batch_location_t *locs;
+  nx_ipc_msg_t *msgs;
+  int count = 0;
+  int msgcount = 0;
+  int pos = 0;
+  int lineno = 0;
+  int invalid = 0;
+  int i,argc,device,location,datatype,datalen,ok,r;
+
+  if (!strcmp(filename,"-")) fp=stdin;
+  else if (!(fp=fopen(filename,"r"))) die("cannot open file: %s",filename);
+
+  locs=calloc(BATCH_LOCATIONS_MAX,sizeof(batch_location_t));
+  msgs=calloc(BATCH_LOCATIONS_MAX,sizeof(nx_ipc_msg_t));
+  if (!locs || !msgs) die("out of memory");
+
+
+  /* parse and validate all lines before sending anything */
+  while (fgets(line,sizeof(line),fp)) {
+    lineno++;
+    for(s=line; isspace(*s); s++);
+    if (*s == 0 || *s == '#') continue;
+    argv[0]=strtok(line," \t\r\n");
+    argv[1]=strtok(NULL," \t\r\n");
+    argv[2]=strtok(NULL," \t\r\n");
+    if (!argv[1] || !argv[2]) die("line %d: missing arguments",lineno);
+
+    if (sscanf(argv[0],"%d",&device) != 1 || device < 0 || device > NX_BUS_ADDRESS_MAX)
+      die("line %d: invalid device '%s'",lineno,argv[0]);
+    if (sscanf(argv[1],"%d",&location) != 1 || location < 0 ||
+	location > NX_LOGICAL_LOCATION_MAX)
+      die("line %d: invalid location '%s'",lineno,argv[1]);
+    if (location == 910)
+      die("line %d: location 910 (factory reset) cannot be programmed in a batch",lineno);
+    datatype=-1;
+    if (!strncasecmp("binary",argv[2],strlen(argv[2]))) datatype=0;
+    else if (!strncasecmp("decimal",argv[2],strlen(argv[2]))) datatype=1;
+    else if (!strncasecmp("hexadecimal",argv[2],strlen(argv[2]))) datatype=2;
+    else if (!strncasecmp("ascii",argv[2],strlen(argv[2]))) datatype=3;
+    if (datatype < 0) die("line %d: invalid data type '%s'",lineno,argv[2]);
+
+    /* rest of the line is the data */
+    s=strtok(NULL,"\r\n");
+    argc=0;
+    if (datatype == 3) {
+      while (s && isspace(*s)) s++;
+      if (s && *s == '"') {
+	s++;
+	if ((t=strrchr(s,'"'))) *t=0;
+      }
+      if (s) argv[argc++]=s;
+    } else {
+      for(s=strtok(s," \t"); s && argc < 33; s=strtok(NULL," \t"))
+	argv[argc++]=s;
+    }
+    if (argc < 1) die("line %d: missing data",lineno);
+    parse_program_data(datatype,progdata,&datalen,argc,argv);
+
+    if (count >= BATCH_LOCATIONS_MAX) die("line %d: too many locations",lineno);
+
+    /* start new message if this location does not fit */
+    if (msgcount == 0 || msgs[msgcount-1].data[0] >= NX_PROG_BATCH_MAX ||
+	pos + 5 + datalen > NX_IPC_MSG_DATA_LEN) {
+      msgs[msgcount].msgtype=NX_IPC_MSG_SET_PROG_BATCH;
+      msgs[msgcount].msgid[0]=time(NULL) + msgcount;
+      msgs[msgcount].msgid[1]=(nowait ? 0 : getpid());
+      msgcount++;
+      pos=1;
+    }
+    msgs[msgcount-1].data[0]++;
+    msgs[msgcount-1].data[pos++]=device;
+    msgs[msgcount-1].data[pos++]=(location >> 8) & 0x0f;
+    msgs[msgcount-1].data[pos++]=location & 0xff;
+    msgs[msgcount-1].data[pos++]=datatype;
+    msgs[msgcount-1].data[pos++]=datalen;
+    memcpy(&msgs[msgcount-1].data[pos],progdata,datalen);
+    pos+=datalen;
+
+    locs[count].device=device;
+    locs[count].location=location;
+    locs[count].line=lineno;
+    locs[count].result=-1;
+    count++;
+  }
+  if (fp != stdin) fclose(fp);
+
+  if (count < 1) die("no locations to program");
+  if (verbose_mode)
+    printf("Programming %d locations (%d messages)...\n",count,msgcount);
+
+
+  /* server checks, programs and verifies each message on its own, so
+     when there are several messages check all of them first */
+  if (msgcount > 1) {
+    for(i=0; i<msgcount; i++) {
+      msgs[i].data[0]|=NX_PROG_BATCH_CHECK;
+      msgs[i].msgid[1]=getpid();
+    }
+    send_batch(msgs,msgcount,locs,timeout,0);
+
+    for(i=0; i<count; i++)
+      if (locs[i].result != NX_PROG_BATCH_OK) invalid++;
+    for(i=0; i<count; i++) {
+      if (invalid > 0 && locs[i].result == NX_PROG_BATCH_OK)
+	locs[i].result=NX_PROG_BATCH_SKIPPED;
+      else if (invalid == 0)
+	locs[i].result=-1;
+    }
+    for(i=0; i<msgcount; i++) {
+      msgs[i].data[0]&=~NX_PROG_BATCH_CHECK;
+      msgs[i].msgid[0]+=msgcount;
+      msgs[i].msgid[1]=(nowait ? 0 : getpid());
+    }
+  }
+
+  if (invalid == 0) {
+    send_batch(msgs,msgcount,locs,timeout,nowait);
+    if (nowait)
+      return 0;
+  }
+
+
+  /* display results */
+  ok=0;
+  for(i=0; i<count; i++) {
+    r=locs[i].result;
+    if (r == 0) ok++;
+    printf("dev=%03d loc=%03d (line %d): %s\n",locs[i].device,locs[i].location,locs[i].line,
+	   (r < 0 ? "no reply from server" :
+	    (r < NX_PROG_BATCH_SKIPPED+1 ? results[r] : "failed")));
+  }
+  printf("%d/%d locations programmed successfully\n",ok,count);
+
+  free(locs);
+  free(msgs);
+
+  return (ok == count ? 0 : 1);
+}
+
+
 void print_usage()
 {
   fprintf(stderr,"Usage: %s [OPTIONS] <command>\n\n",program_name);
@@ -214,6 +483,7 @@ void print_usage()
 	  "  getprogram <dev> <loc>              Display program data from device\n"
 	  "  setprogram <dev> <loc> <type> -- <data1> ... <dataN>\n"
 	  "                                      Program a device location\n"
+	  "  setprogram-batch <file>             Program locations listed in file (or - for stdin)\n"
 	  "\n Commands (PIN required):\n"
 	  "  armaway                            Arm in Away mode\n"
 	  "  armstay                            Arm in Stay mode\n"
@@ -225,6 +495,7 @@ void print_usage()
 	  "  --config=<configfile>              use specified config file\n"
 	  "  -c <configfile>\n"
 	  "  --partition=<n>, -p <n>            partition for the command (default 1)\n"
+	  "  --refresh, -r                      read program data from the panel (not from cache)\n"
 	  "  --help, -h                         display this help and exit\n"
 	  "  --nowait, -n                       do not wait for response from server\n"
 	  "  --timeout=<n>, -t <n>              timeout for waiting response from server (default 10)\n"
@@ -243,7 +514,7 @@ int main(int argc, char **argv)
   int opt_index = 0;
   uchar partition = 0;
   char *config_file = CONFIG_FILE;
-  int opt,i;
+  int opt,i,ret;
   int nxcmd = 0;
   int msgtype = 0;
   int zone = -1;
@@ -258,11 +529,14 @@ int main(int argc, char **argv)
   int nowait = 0;
   int timeout = 10;
   int force_mode = 0;
+  int refresh = 0;
   char text1[MESSAGE_LINE_LEN+1];
   char text2[MESSAGE_LINE_LEN+1];
   char progdata[32];
   int datalen = -1;
   nx_ipc_msg_t  ipcmsg;
+  nx_ipc_msg_reply_t reply;
+  nx_ipc_reply_msg_t replymsg;
   const char* cmd = NULL;
   char *pin = NULL;
   size_t pinsize = 0;
@@ -277,13 +551,14 @@ int main(int argc, char **argv)
     {"nowait",0,0,'n'},
     {"timeout",1,0,'t'},
     {"force",0,0,'f'},
+    {"refresh",0,0,'r'},
     {NULL,0,0,0}
   };
   program_name="nxcmd";
 
 
 
-  while ((opt=getopt_long(argc,argv,"t:nvVhc:p:",long_options,&opt_index)) != -1) {
+  while ((opt=getopt_long(argc,argv,"t:nrvVhc:p:",long_options,&opt_index)) != -1) {
     switch (opt) {
 
     case 'c':
@@ -298,6 +573,10 @@ int main(int argc, char **argv)
       nowait=1;
       break;
 
+    case 'r':
+      refresh=1;
+      break;
+
     case 'p':
       if (sscanf(optarg,"%d",&i)==1) {
 	if (i > 0 && i<=NX_PARTITIONS_MAX) {
@@ -380,21 +659,22 @@ int main(int argc, char **argv)
 
   /* initialize shared memory segment */
 
-  shmid = shmget(config->shmkey,sizeof(nx_shm_t),0);
-  if (shmid < 0) {
-    if (errno==EINVAL)
-      die("version mismatch with daemon version (shared memory segment wrong size)");
-    if (errno==ENOENT)
-      die("cannot find share memory segment (server not running?)");
-    die("shmget() failed: %s (%d)\n",strerror(errno),errno);
-  }
-  shm = shmat(shmid,NULL,SHM_RDONLY);
-  if (shm == (void*)-1)
-    die("shmat() failed: %d (%s)\n",errno,strerror(errno));
+  ret=shm_attach(config->shmkey,&shmid,&shm);
+  if (ret == -1 && errno == ENOENT)
+    die("cannot find share memory segment (server not running?)");
+  if (ret == -3)
+    die("version mismatch with daemon (unsupported shared memory format)");
+  if (ret < 0)
+    die("cannot attach to shared memory segment: %s (%d)\n",strerror(errno),errno);
+
 
-  if (strcmp(shm->shmversion, SHMVERSION))
-    die("version mismatch with daemon (shared memory) version: %s vs %s",
-	SHMVERSION, shm->shmversion);
+  /* get reply queue id, and discard any replies left in the queue
+     for a previous process with same pid */
+  replyid = msgget(config->replykey,0);
+  if (replyid < 0)
+    die("cannot access reply message queue: %s (errno=%d)",strerror(errno),errno);
+  while (msgrcv(replyid,&replymsg,sizeof(replymsg)-sizeof(long),getpid(),IPC_NOWAIT) > 0)
+    ;
 
 
   if (verbose_mode) {
@@ -435,6 +715,30 @@ int main(int argc, char **argv)
     if (device < 0 || device > NX_BUS_ADDRESS_MAX ||
 	location < 0 || location > NX_LOGICAL_LOCATION_MAX)
       die("getprogram option requires device and location arguments");
+
+    if (!refresh) {
+      /* use cached program data, if available */
+      const nx_prog_cache_t *progcache = shm_section(shm,NX_SHM_PROGCACHE);
+      nx_prog_cache_t *cache = malloc(sizeof(nx_prog_cache_t));
+      const nx_prog_cache_entry_t *e;
+      char datastr[512];
+
+      if (!cache) die("out of memory");
+      if (progcache &&
+	  shm_read(shm,cache,progcache,sizeof(nx_prog_cache_t)) == 0 &&
+	  (e=prog_cache_lookup(cache,device,location))) {
+	format_program_data(&e->data,datastr,sizeof(datastr));
+	printf("Program data (dev=%03d,loc=%03d,len=%02d,type=%s): %s\n",
+	       device,location,e->data.len,nx_prog_datatype_str(e->data.type),datastr);
+	exit(0);
+      }
+      free(cache);
+    }
+  }
+  else if (!strcasecmp(cmd,"setprogram-batch")) {
+    if (args < 2)
+      die("setprogram-batch requires file argument");
+    exit(program_batch(argv[optind+1],timeout,nowait));
   }
   else if (!strcasecmp(cmd,"setprogram")) {
     msgtype=NX_IPC_MSG_SET_PROG;
@@ -555,6 +859,7 @@ int main(int argc, char **argv)
       ipcmsg.data[0]=device;
       ipcmsg.data[1]=(location >> 8) & 0x0f;
       ipcmsg.data[2]=location & 0xff;
+      ipcmsg.data[3]=(refresh ? NX_IPC_PROG_REFRESH : 0);
       break;
     case NX_IPC_MSG_SET_PROG:
       ipcmsg.data[0]=device;
@@ -593,7 +898,7 @@ int main(int argc, char **argv)
 
 
   ipcmsg.msgid[0]=time(NULL);
-  ipcmsg.msgid[1]=getpid();
+  ipcmsg.msgid[1]=(nowait ? 0 : getpid());
 
 #if DEBUG
   printf("msgtype: %d data: ",ipcmsg.msgtype);
@@ -611,6 +916,11 @@ int main(int argc, char **argv)
   } else {
     if (verbose_mode)
       printf("Message sent successfully\n");
+    if (config->cmd_socket) {
+      i=ring_doorbell(config->cmd_socket,&ipcmsg);
+      if (verbose_mode && i != 0)
+	printf("Failed to notify server process via command socket (%d)\n",i);
+    }
   }
 
   if (nowait)
@@ -620,18 +930,11 @@ int main(int argc, char **argv)
     printf("Waiting for reply...\n");
 
   tm=time(NULL) + timeout;
-  while (time(NULL) <= tm) {
-    for(i=0;i<IPC_MSG_REPLY_TABLE_SIZE;i++) {
-      nx_ipc_msg_reply_t *r = &shm->replies[i];
-
-      if (r->msgid[0] == ipcmsg.msgid[0] &&
-	  r->msgid[1] == ipcmsg.msgid[1]) {
-	//printf("reply[%d]: %d,%d result=%d: %s\n",i,r->msgid[0],r->msgid[1],r->result,r->data);
-	printf("%s\n",r->data);
-	exit(r->result);
-      }
+  while (wait_reply(&reply,tm)) {
+    if (reply.msgid[0] == ipcmsg.msgid[0]) {
+      printf("%s\n",reply.data);
+      exit(reply.result);
     }
-    usleep(100000);
   }
 
   die("timeout waiting response from server");
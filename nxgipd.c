@@ -32,10 +32,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
 #if HAVE_GETOPT_H && HAVE_GETOPT_LONG
 #include <getopt.h>
 #else
@@ -45,6 +47,24 @@
 
 #define DEBUG 0
 
+/* main loop poll() timeout (ms) */
+#define MAIN_LOOP_TIMEOUT          1000
+#define MAIN_LOOP_TIMEOUT_NOSOCKET 100
+
+/* max number of panel messages processed before servicing clients */
+#define MAX_MESSAGES_PER_LOOP      32
+
+#define DOORBELL_TABLE_SIZE        16
+
+/* main loop poll() timeout when replies are waiting to be delivered (ms) */
+#define REPLY_RETRY_INTERVAL       100
+
+/* number of zones refreshed per main loop iteration (after fast start) */
+#define ZONES_REFRESHED_PER_LOOP   2
+
+/* number of missed log entries fetched per main loop iteration */
+#define LOG_ENTRIES_PER_LOOP       8
+
 #include "nx-584.h"
 #include "nxgipd.h"
 
@@ -56,10 +76,16 @@ int verbose_mode = 0;
 nx_shm_t *shm = NULL;
 int shmid = -1;
 int msgid = -1;
+int replyid = -1;
+int cmdsock = -1;
+nx_ipc_reply_msg_t *reply_backlog = NULL;
+int reply_backlog_head = 0;
 nx_interface_status_t *istatus;
 nx_system_status_t *astat;
 nx_configuration_t configuration;
 nx_configuration_t *config = &configuration;
+nx_conn_t connection;
+nx_conn_t *conn = &connection;
 int trigger_processes = 0;
 
 
@@ -69,6 +95,7 @@ void signal_handler(int sig)
 {
   pid_t pid;
   int status, r;
+  struct rusage ru;
 
 
   /* handle daemon "crash" ... */
@@ -78,6 +105,10 @@ void signal_handler(int sig)
       release_shared_memory(shmid,shm);
     if (msgid >= 0)
       release_message_queue(msgid);
+    if (replyid >= 0)
+      release_message_queue(replyid);
+    if (cmdsock >= 0)
+      release_command_socket(cmdsock,config->cmd_socket);
 
     _exit(2); // avoid running any at_exit functions
   }
@@ -106,16 +137,16 @@ void signal_handler(int sig)
 
   /* reaper... read child process exit status */
 
-  while ((pid=waitpid(-1,&status,WNOHANG)) > 0) {
+  while ((pid=wait4(-1,&status,WNOHANG,&ru)) > 0) {
     if (WIFEXITED(status)) {
       int estatus = WEXITSTATUS(status);
       logmsg( (estatus==0?3:1),"child process exited: pid=%u, status=%d", pid, estatus);
-      trigger_processes--;
+      if (!trigger_reaped(pid,status,&ru)) trigger_processes--;
     }
     else if (WIFSIGNALED(status)) {
       logmsg(1,"child process killed by signal: pid=%u, signal=%d (%s)",
 	     pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-      trigger_processes--;
+      if (!trigger_reaped(pid,status,&ru)) trigger_processes--;
     }
     else if (WIFSTOPPED(status)) {
       logmsg(1,"child process stopped: pid=%u, signal=%d (%s)",
@@ -132,10 +163,103 @@ void signal_handler(int sig)
 }
 
 
+/* send replies waiting in the backlog to clients (in order) */
+void deliver_replies()
+{
+  nx_loop_stats_t *stats = &shm->loopstats;
+  static time_t last_purge = 0;
+  nx_ipc_reply_msg_t *m;
+  int ret;
+
+  while (stats->reply_backlog > 0) {
+    m=&reply_backlog[reply_backlog_head];
+    if (kill(m->msgtype,0) < 0 && errno == ESRCH) {
+      logmsg(3,"client not running anymore, reply discarded (pid=%ld)",m->msgtype);
+    } else {
+      ret=send_message_reply(replyid,m->msgtype,&m->reply);
+      if (ret == 0) {
+	/* reply queue full, check if there are replies nobody will read */
+	if (last_purge != time(NULL)) {
+	  last_purge=time(NULL);
+	  if (purge_reply_queue(replyid) > 0) continue;
+	}
+	break;
+      }
+      shm_write_begin(shm);
+      if (ret > 0) {
+	stats->replies++;
+	/* wake up client waiting for the reply */
+	shm_changed(shm);
+      } else {
+	stats->replies_dropped++;
+      }
+      shm_write_end(shm);
+    }
+    shm_write_begin(shm);
+    reply_backlog_head=(reply_backlog_head+1) % config->reply_backlog;
+    stats->reply_backlog--;
+    shm_write_end(shm);
+  }
+}
+
+
+/* queue reply to the client that sent the message */
+void queue_reply(const nx_ipc_msg_t *msg, const nx_ipc_msg_reply_t *reply)
+{
+  nx_loop_stats_t *stats = &shm->loopstats;
+  nx_ipc_reply_msg_t *m;
+
+  if (msg->msgid[1] < 1) return; /* client does not want reply */
+
+  shm_write_begin(shm);
+  if (stats->reply_backlog >= config->reply_backlog) {
+    logmsg(0,"reply backlog full, dropping reply (pid=%ld)",
+	   reply_backlog[reply_backlog_head].msgtype);
+    reply_backlog_head=(reply_backlog_head+1) % config->reply_backlog;
+    stats->reply_backlog--;
+    stats->replies_dropped++;
+  }
+  m=&reply_backlog[(reply_backlog_head+stats->reply_backlog) % config->reply_backlog];
+  m->msgtype=msg->msgid[1];
+  m->reply=*reply;
+  stats->reply_backlog++;
+  shm_write_end(shm);
+
+  deliver_replies();
+}
+
+
+/* handle messages panel sends while we're waiting reply for a command */
+void unsolicited_message(nxmsg_t *msg)
+{
+  if (verbose_mode) printf("got unsolicited message %02x!\n",msg->msgnum & NX_MSG_MASK);
+  process_message(msg,0,verbose_mode,astat,istatus);
+  update_log_cursor(astat,msg);
+}
+
+
+void log_io_stats()
+{
+  const nx_io_stats_t *st = &conn->stats;
+
+  if (st->read_calls < 1) return;
+
+  logmsg(1,"serial I/O: %lu reads, %lu bytes, %lu messages (%.2f reads/message), %lu invalid, %lu bytes discarded",
+	 st->read_calls, st->bytes_in, st->frames,
+	 (st->frames > 0 ? (double)st->read_calls / st->frames : 0.0),
+	 st->invalid_frames, st->discarded_bytes);
+  logmsg(1,"serial I/O: %lu writes, %lu bytes", st->write_calls, st->bytes_out);
+}
+
+
 void exit_cleanup()
 {
   logmsg(3,"exit_cleanup()");
 
+  log_io_stats();
+
+  mqtt_shutdown();
+
   /* only attempt to save zone statuses if daemon is fully initialized... */
   if (config->status_file && astat &&
       shm != NULL && shm->daemon_started > 0) {
@@ -146,10 +270,21 @@ void exit_cleanup()
     }
   }
 
+  if (config->state_file && shm != NULL && shm->daemon_started > 0) {
+    int r = save_state_image(config->state_file, shm);
+    if (r != 0) {
+      logmsg(0,"failed to save state: %s (%d)",config->state_file,r);
+    }
+  }
+
   if (shm != NULL)
     release_shared_memory(shmid,shm);
   if (msgid >= 0)
     release_message_queue(msgid);
+  if (replyid >= 0)
+    release_message_queue(replyid);
+  if (cmdsock >= 0)
+    release_command_socket(cmdsock,config->cmd_socket);
 }
 
 
@@ -164,6 +299,9 @@ int main(int argc, char **argv)
   int scan_mode = 0;
   int scan_node = 0;
   int scan_loc = -1;
+  int probe_full = 0;
+  char *snapshot_file = NULL;
+  char *diff_file = NULL;
   int log_mode = 0;
   int daemon_mode = 0;
   int clock_sync_needed = 0;
@@ -173,18 +311,26 @@ int main(int argc, char **argv)
   struct option long_options[] = {
     {"config",1,0,'c'},
     {"daemon",0,0,'d'},
+    {"diff",1,0,'D'},
     {"help",0,0,'h'},
     {"log",0,0,'l'},
     {"log-only",0,0,'L'},
     {"pid",1,0,'p'},
     {"probe",0,0,'P'},
+    {"probe-all",0,0,'A'},
     {"scan",1,0,'s'},
+    {"snapshot",1,0,'N'},
     {"status",0,0,'S'},
     {"verbose",0,0,'v'},
     {"version",0,0,'V'},
     {NULL,0,0,0}
   };
   nx_ipc_msg_t  ipcmsg;
+  nx_ipc_doorbell_t doorbells[DOORBELL_TABLE_SIZE];
+  int doorbell_index = 0;
+  nx_loop_stats_t *loopstats;
+  time_t last_savestate;
+  int i;
 
   config->syslog_mode=0;
   config->debug_mode=0;
@@ -231,10 +377,23 @@ int main(int argc, char **argv)
       scan_mode=2;
       break;
 
+    case 'N':
+      snapshot_file=strdup(optarg);
+      break;
+
+    case 'D':
+      diff_file=strdup(optarg);
+      break;
+
     case 'P':
       scan_mode=3;
       break;
 
+    case 'A':
+      scan_mode=3;
+      probe_full=1;
+      break;
+
     case 'l':
       log_mode=1;
       break;
@@ -252,12 +411,16 @@ int main(int argc, char **argv)
 	      "  --pid=<pidfile>, -p <pidfile>\n"
 	      "                          save process pid in file\n"
 	      "  --daemon, -d            run as background daemon process\n"
+	      "  --diff=<file1>,<file2>  compare two module config snapshots and exit\n"
 	      "  --help, -h              display this help and exit\n"
 	      "  --log, -l               dump panel log when starting\n"
 	      "  --log-only              dump panel log and exit\n"
 	      "  --probe                 probe bus for modules and exit\n"
+	      "  --probe-all             probe all bus addresses (ignore saved topology)\n"
 	      "  --scan=<device>         dump full config of a module and exit\n"
 	      "  --scan=<device>,<loc>   dump single config location of a module and exit\n"
+	      "  --snapshot=<file>       save module config (--scan) in snapshot file\n"
+	      "                          (resumes interrupted scan if file exists)\n"
 	      "  --status                display NX gateway status/settings\n"
 	      "  --verbose, -v           enable verbose output to stdout\n"
 	      "  --version, -V           print program version\n"
@@ -266,7 +429,14 @@ int main(int argc, char **argv)
     }
   }
 
+  if (diff_file) {
+    char *file2 = strchr(diff_file,',');
 
+    if (!file2) die("two snapshot files must be specified: %s",diff_file);
+    *file2++=0;
+    ret=diff_config_snapshots(diff_file,file2);
+    exit(ret < 0 ? 2 : (ret > 0 ? 1 : 0));
+  }
 
   printf("Loading configuration...\n");
   if (load_config(config_file,config,1))
@@ -299,7 +469,6 @@ int main(int argc, char **argv)
   sigaction(SIGINT,&sigact,NULL);
   sigaction(SIGQUIT,&sigact,NULL);
   sigaction(SIGABRT,&sigact,NULL);
-  sigaction(SIGPIPE,&sigact,NULL);
   sigaction(SIGCHLD,&sigact,NULL);
   sigaction(SIGSEGV,&sigact,NULL);
   sigaction(SIGBUS,&sigact,NULL);
@@ -310,6 +479,15 @@ int main(int argc, char **argv)
   sigact.sa_handler=SIG_IGN;
   sigaction(SIGHUP,&sigact,NULL);
   sigaction(SIGUSR2,&sigact,NULL);
+  /* write errors (trigger program pipe) are handled where they happen */
+  sigaction(SIGPIPE,&sigact,NULL);
+
+
+  if (config->trigger_enable) {
+    trigger_cloexec_fds();
+    if (config->trigger_mode == TRIGGER_MODE_PERSISTENT)
+      trigger_worker_start();
+  }
 
 
   atexit(exit_cleanup);
@@ -320,6 +498,9 @@ int main(int argc, char **argv)
     die("Failed to initialize IPC shared memory segment");
   istatus=&shm->intstatus;
   astat=&shm->alarmstatus;
+  loopstats=&shm->loopstats;
+  astat->log_cursor=-1;
+  astat->log_sync_target=-1;
   if (verbose_mode)
     printf("IPC shm: key=0x%08x id=%d\n",config->shmkey,shmid);
 
@@ -328,22 +509,42 @@ int main(int argc, char **argv)
     die("Failed to initialize IPC message queue");
   if (verbose_mode)
     printf("IPC msg: key=0x%08x id=%d\n",config->msgkey,msgid);
+  if ((replyid=init_message_queue(config->replykey,config->msgmode)) < 0)
+    die("Failed to initialize IPC reply queue");
+  if (!(reply_backlog=malloc(config->reply_backlog*sizeof(nx_ipc_reply_msg_t))))
+    die("out of memory");
+  if (verbose_mode)
+    printf("IPC reply msg: key=0x%08x id=%d\n",config->replykey,replyid);
+
+  /* initialize command socket (used by clients to wake us up) */
+  if (config->cmd_socket) {
+    if ((cmdsock=init_command_socket(config->cmd_socket,config->msgmode)) < 0)
+      die("Failed to initialize command socket: %s",config->cmd_socket);
+    if (verbose_mode)
+      printf("Command socket: %s\n",config->cmd_socket);
+  }
 
   printf("Opening serial port: %s\n",config->serial_device);
   if ((fd = openserialdevice(config->serial_device, config->serial_speed, config->serial_mode)) < 0)
     die("Failed to open serial port");
+  nx_conn_init(conn,fd,config->serial_protocol);
+  conn->timeout=config->serial_timeout;
+  conn->frame_timeout=config->serial_frame_timeout;
+  conn->retry=config->serial_retry;
+  conn->window=config->serial_window;
+  conn->unsolicited=unsolicited_message;
 
 
   printf("Establishing communications...\n");
 
   /* clear any pending messages */
   do {
-    ret=nx_receive_message(fd,config->serial_protocol,&msgin,1);
+    ret=nx_receive_message(conn,&msgin,1000);
   } while (ret==1);
 
 
   /* try to detect panel model */
-  ret=detect_panel(fd,config->serial_protocol,astat,istatus,(scan_mode==2?1:0));
+  ret=detect_panel(conn,astat,istatus,(scan_mode==2?1:0));
   if (ret < 0)
     die("failed to estabilish communications with alarm panel: %d", ret);
   if (scan_mode==2)
@@ -359,11 +560,11 @@ int main(int argc, char **argv)
       die("Program Data Request command not enabled.");
 
     if (scan_mode==1) {
-      read_config(fd,config->serial_protocol,scan_node,scan_loc);
-      exit(0);
+      ret=read_config(conn,scan_node,scan_loc,snapshot_file);
+      exit(ret < 0 ? 1 : 0);
     }
     else if (scan_mode==3) {
-      probe_bus(fd,config->serial_protocol);
+      probe_bus(conn,probe_full);
       exit(0);
     }
   }
@@ -408,156 +609,344 @@ int main(int argc, char **argv)
 
   if (log_mode > 0) {
     printf("Dumping panel log...");
-    dump_log(fd,config->serial_protocol,astat,istatus);
+    dump_log(conn,astat,istatus);
     if (log_mode == 2) exit(0);
   }
 
 
   logmsg(0,"Getting system status...");
+  ret=-1;
+  if (config->state_file) {
+    nx_shm_t *image;
+    time_t saved;
+
+    /* attempt warm start using saved state */
+    if (!(image=malloc(sizeof(nx_shm_t))))
+      die("out of memory");
+    ret=load_state_image(config->state_file,image,&saved);
+    if (ret == 0) {
+      logmsg(0,"Restoring state saved %s ago",timedeltastr(time(NULL)-saved));
+      ret=restore_system_status(conn,&image->alarmstatus,astat,istatus);
+      if (ret == 0 && shm_section(image,NX_SHM_PROGCACHE)) {
+	shm_write_begin(shm);
+	/* programming changes while daemon was not running are detected
+	   from the log entries (see process_message()) */
+	memcpy(&shm->progcache,&image->progcache,sizeof(shm->progcache));
+	shm_write_end(shm);
+      } else if (ret == 0) {
+	logmsg(1,"program data cache in saved state is not compatible, not restored");
+      } else {
+	logmsg(0,"saved state does not match panel (%d), ignoring it",ret);
+      }
+    } else if (ret != -2) {
+      logmsg(0,"invalid or incompatible state file ignored: %s (%d)",
+	     config->state_file,ret);
+    }
+    free(image);
+  }
+
   retry=0;
-  while (1) {
-    ret=get_system_status(fd,config->serial_protocol,astat,istatus);
+  while (ret < 0) {
+    ret=get_system_status(conn,astat,istatus);
     printf("\n");
     if (ret < 0) {
       printf("failed to get system status: %d\n",ret);
       if (retry++ >= 3) die("communication problem, giving up");
       sleep(1);
-    } else {
-      break;
     }
   }
 
 
+  /* check for log entries generated while we were not running */
+  start_log_sync(astat,astat->comm_stack_ptr);
+
+  if (config->mqtt_host) mqtt_init();
+
   logmsg(0,"Waiting for messages");
+  shm_write_begin(shm);
+  zone_bitmaps_rebuild(&shm->zonemap,astat);
   shm->daemon_started=time(NULL);
   shm->last_updated=time(NULL);
+  shm_changed(shm);
+  shm_write_end(shm);
+  last_savestate=time(NULL);
+
+  memset(doorbells,0,sizeof(doorbells));
 
   /* main process loop */
   while (1) {
+    struct pollfd pfd[4];
+    int nfds = 1;
+    int mqttfd = -1;
+    int hold;
+    short mqttev = 0;
+    int count = 0;
+    int pending;
+    long long loop_start;
+    time_t t;
+
+    /* hold back panel messages while persistent trigger program is
+       catching up with events already buffered */
+    hold=triggers_backpressure();
+
+    pfd[0].fd=conn->fd;
+    pfd[0].events=(hold ? 0 : POLLIN);
+    pfd[0].revents=0;
+    if (cmdsock >= 0) {
+      pfd[1].fd=cmdsock;
+      pfd[1].events=POLLIN;
+      pfd[1].revents=0;
+      nfds=2;
+    }
+    if ((pfd[nfds].fd=mqtt_fd(&pfd[nfds].events)) >= 0) {
+      pfd[nfds].revents=0;
+      mqttfd=nfds++;
+    }
+    if ((pfd[nfds].fd=trigger_fd(&pfd[nfds].events)) >= 0) {
+      pfd[nfds].revents=0;
+      nfds++;
+    }
 
-    /* wait for message to come in (or timeout)... */
-    ret=nx_receive_message(fd,config->serial_protocol,&msgin,1);
-    if (ret < -1) {
-      logmsg(0,"error reading message");
-    } else if (ret == -1) {
-      logmsg(0,"invalid message received");
-    } else if (ret == 1) {
-      if (verbose_mode) printf("got message %02x!\n",msgin.msgnum & NX_MSG_MASK);
-      //logmsg(3,"got message %02x",msgin.msgnum & NX_MSG_MASK);
-      process_message(&msgin,0,verbose_mode,astat,istatus);
-      if ((msgin.msgnum & NX_MSG_MASK) == NX_KEYPAD_MSG_RCVD) {
-	//firmware bug panel ignores ACK for this message...
+    /* messages left in the receive buffer (read along with a reply, or
+       beyond MAX_MESSAGES_PER_LOOP) are processed without waiting */
+    pending=(hold ? 0 : nx_conn_pending(conn));
+
+    /* wait for message from panel or client to come in (or timeout)... */
+    ret=poll(pfd,nfds,((pending || (!hold && (astat->zone_refresh < astat->last_zone ||
+						astat->log_sync_target >= 0))) ? 0 :
+		       (loopstats->reply_backlog > 0 || triggers_pending() ?
+			REPLY_RETRY_INTERVAL :
+			(cmdsock >= 0 ? MAIN_LOOP_TIMEOUT : MAIN_LOOP_TIMEOUT_NOSOCKET))));
+    if (ret < 0 && errno != EINTR) {
+      logmsg(0,"poll() failed: %s (%d)",strerror(errno),errno);
+      sleep(1);
+    }
+    if (ret > 0 && mqttfd >= 0) mqttev=pfd[mqttfd].revents;
+    loop_start=nx_time_ms();
+    loopstats->iterations++;
+
+
+    /* process messages from panel, but only limited number at a time
+       so that clients won't have to wait... */
+    if (pending || (!hold && ret > 0 && pfd[0].revents)) {
+      while (count++ < MAX_MESSAGES_PER_LOOP) {
+	ret=nx_poll_message(conn,&msgin);
+	if (ret == 0) break;
+	if (ret < -1) {
+	  logmsg(0,"error reading message");
+	  break;
+	} else if (ret == -1) {
+	  logmsg(0,"invalid message received");
+	} else {
+	  if (verbose_mode) printf("got message %02x!\n",msgin.msgnum & NX_MSG_MASK);
+	  process_message(&msgin,0,verbose_mode,astat,istatus);
+	  update_log_cursor(astat,&msgin);
+	  loopstats->messages++;
+	}
       }
-    } else {
-      /* no message received (timeout), check if there is anything else to do... */
-
-      time_t t = time(NULL);
+    }
 
 
-      /* attempt clock sync only when time is close to next full minute... */
-      if (clock_sync_needed) {
-	struct tm tt;
+    /* read notifications from clients */
+    if (cmdsock >= 0 && pfd[1].revents) {
+      nx_ipc_doorbell_t db;
 
-	if (localtime_r(&t,&tt)) {
-	  if (tt.tm_sec > 56) {
-	    process_set_clock(fd,config->serial_protocol,astat,istatus);
-	    clock_sync_needed=0;
-	  }
-	} else {
-	  logmsg(1,"localtime_r() failed");
+      while (read_command_socket(cmdsock,&db) > 0) {
+	loopstats->doorbells++;
+	if (db.msgid[0] || db.msgid[1]) {
+	  doorbells[doorbell_index++]=db;
+	  if (doorbell_index >= DOORBELL_TABLE_SIZE)
+	    doorbell_index=0;
 	}
       }
+    }
 
 
-      /* periodially check that panel is responding... */
-      if (astat->last_statuscheck + (astat->statuscheck_interval*60) < t) {
-	msgout.msgnum=NX_SYS_STATUS_REQ;
-	msgout.len=1;
-	ret=nx_send_message(fd,config->serial_protocol,&msgout,5,3,NX_SYS_STATUS_MSG,&msgin);
-	if (ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG) {
-	  process_message(&msgin,0,verbose_mode,astat,istatus);
-	  logmsg(1,"panel ok");
-	  shm->comm_fail=0;
-	} else {
-	  logmsg(0,"failure to communicate with panel!");
-	  shm->comm_fail=1;
+    /* check for messages in message queue */
+    while ((ret=read_message_queue(msgid,&ipcmsg)) > 0) {
+      nx_ipc_msg_reply_t replybuf;
+      nx_ipc_msg_reply_t *reply = &replybuf;
+      long long cmd_start = nx_time_ms();
+      uint delta;
+
+      memset(reply,0,sizeof(nx_ipc_msg_reply_t));
+
+      logmsg(3,"got IPC message: msgtype=%d msgid=%d,%d (%02x,%02x,%02x,...) = %d",
+	     ipcmsg.msgtype,ipcmsg.msgid[0],ipcmsg.msgid[1],ipcmsg.data[0],ipcmsg.data[1],ipcmsg.data[2],ret);
+
+      /* check how long message was waiting in the queue (if client told us) */
+      for (i=0; i<DOORBELL_TABLE_SIZE; i++) {
+	if (doorbells[i].msgid[0] == ipcmsg.msgid[0] &&
+	    doorbells[i].msgid[1] == ipcmsg.msgid[1] &&
+	    doorbells[i].sent > 0) {
+	  delta=(cmd_start > doorbells[i].sent ? cmd_start - doorbells[i].sent : 0);
+	  shm_write_begin(shm);
+	  loopstats->cmd_latency_last=delta;
+	  if (delta > loopstats->cmd_latency_max) loopstats->cmd_latency_max=delta;
+	  loopstats->cmd_latency_sum+=delta;
+	  loopstats->cmd_latency_count++;
+	  shm_write_end(shm);
+	  doorbells[i].sent=0;
+	  break;
 	}
-	astat->last_statuscheck=t;
       }
 
-
-      /* update panel clock periodically (if enabled) */
-      if ( !clock_sync_needed &&
-	   (astat->timesync_interval > 0) &&
-	   (astat->last_timesync + (astat->timesync_interval*3600) < t) ) {
+      switch (ipcmsg.msgtype) {
+      case NX_IPC_MSG_CMD:
+	process_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_MSG_BYPASS:
+	process_zone_bypass_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_MSG_GET_PROG:
+	process_get_program_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_MSG_SET_PROG:
+	process_set_program_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_MSG_SET_PROG_BATCH:
+	process_set_program_batch_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_MSG_MESSAGE:
+	process_keypadmsg_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_X10_CMD:
+	process_x10_command(conn,&ipcmsg,istatus,reply);
+	break;
+      case NX_IPC_SET_CLOCK:
 	clock_sync_needed=1;
-	logmsg(2,"clock sync needed");
+	logmsg(1,"synchronize clock request message received");
+	set_message_reply(reply,&ipcmsg,0,"clock synchronization scheduled");
+	break;
+      default:
+	logmsg(0,"unknown IPC message received: %d",ipcmsg.msgtype);
+	set_message_reply(reply,&ipcmsg,-1,"unknown IPC message received: %d",ipcmsg.msgtype);
       }
 
+      memset(ipcmsg.data,0,sizeof(ipcmsg.data)); // clear message data so PIN won't be left in memory
 
+      queue_reply(&ipcmsg,reply);
 
-      /* periodically save status (if enabled) */
-      if ( (astat->savestatus_interval > 0) &&
-	   (astat->last_savestatus + (astat->savestatus_interval*60) < t) &&
-	   config->status_file ) {
-	logmsg(2,"saving alarm status to: %s",config->status_file);
-	ret=save_status_xml(config->status_file,astat);
-	if (ret != 0)
-	  logmsg(0,"failed to save alarm status: %s (%d)",
-		 config->status_file,ret);
-	astat->last_savestatus=t;
-      }
+      delta=nx_time_ms() - cmd_start;
+      shm_write_begin(shm);
+      loopstats->commands++;
+      loopstats->cmd_time_last=delta;
+      if (delta > loopstats->cmd_time_max) loopstats->cmd_time_max=delta;
+      shm_write_end(shm);
+    }
 
 
-      /* check for messages in message queue */
-      if ((ret=read_message_queue(msgid,&ipcmsg)) > 0) {
-	nx_ipc_msg_reply_t *reply = &shm->replies[shm->reply_index++];
+    /* check if there is anything else to do... */
 
-	if (shm->reply_index >= IPC_MSG_REPLY_TABLE_SIZE)
-	  shm->reply_index=0;
+    /* retry sending replies that did not fit in the reply queue */
+    if (loopstats->reply_backlog > 0)
+      deliver_replies();
 
-	logmsg(3,"got IPC message: msgtype=%d msgid=%d,%d (%02x,%02x,%02x,...) = %d",
-	       ipcmsg.msgtype,ipcmsg.msgid[0],ipcmsg.msgid[1],ipcmsg.data[0],ipcmsg.data[1],ipcmsg.data[2],ret);
+    /* start triggers waiting for free process, or write buffered events
+       to the persistent trigger program (restart it if needed) */
+    if (triggers_pending())
+      process_pending_triggers();
 
-	switch (ipcmsg.msgtype) {
-	case NX_IPC_MSG_CMD:
-	  process_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_MSG_BYPASS:
-	  process_zone_bypass_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_MSG_GET_PROG:
-	  process_get_program_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_MSG_SET_PROG:
-	  process_set_program_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_MSG_MESSAGE:
-	  process_keypadmsg_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_X10_CMD:
-	  process_x10_command(fd,config->serial_protocol,&ipcmsg,istatus,reply);
-	  break;
-	case NX_IPC_SET_CLOCK:
-	  clock_sync_needed=1;
-	  logmsg(1,"synchronize clock request message received");
-	  set_message_reply(reply,&ipcmsg,0,"clock synchronization scheduled");
-	  break;
-	default:
-	  logmsg(0,"unknown IPC message received: %d",ipcmsg.msgtype);
-	  set_message_reply(reply,&ipcmsg,-1,"unknown IPC message received: %d",ipcmsg.msgtype);
+    /* fetch log entries we have missed */
+    if (!hold && astat->log_sync_target >= 0)
+      sync_log(conn,astat,istatus,LOG_ENTRIES_PER_LOOP);
+
+    /* refresh zone info in the background (after fast start) */
+    else if (!hold && astat->zone_refresh < astat->last_zone)
+      refresh_zones(conn,astat,istatus,ZONES_REFRESHED_PER_LOOP);
+
+
+    t = time(NULL);
+
+    /* report zones that were chattering (debounce window expired) */
+    process_zone_debounce(astat,t);
+
+    /* publish status changes and events to MQTT broker */
+    mqtt_process(mqttev,astat);
+
+
+    /* attempt clock sync only when time is close to next full minute... */
+    if (clock_sync_needed) {
+      struct tm tt;
+
+      if (localtime_r(&t,&tt)) {
+	if (tt.tm_sec > 56) {
+	  process_set_clock(conn,astat,istatus);
+	  clock_sync_needed=0;
 	}
+      } else {
+	logmsg(1,"localtime_r() failed");
+      }
+    }
+
 
-	memset(ipcmsg.data,0,sizeof(ipcmsg.data)); // clear message data so PIN won't be left in memory
+    /* periodially check that panel is responding... */
+    if (astat->last_statuscheck + (astat->statuscheck_interval*60) < t) {
+      msgout.msgnum=NX_SYS_STATUS_REQ;
+      msgout.len=1;
+      ret=nx_send_message(conn,&msgout,NX_SYS_STATUS_MSG,&msgin);
+      shm_write_begin(shm);
+      if (ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG) {
+	process_message(&msgin,0,verbose_mode,astat,istatus);
+	logmsg(1,"panel ok");
+	if (shm->comm_fail) shm_changed(shm);
+	shm->comm_fail=0;
+	start_log_sync(astat,astat->comm_stack_ptr);
+      } else {
+	logmsg(0,"failure to communicate with panel!");
+	if (!shm->comm_fail) shm_changed(shm);
+	shm->comm_fail=1;
       }
+      astat->last_statuscheck=t;
+      shm_write_end(shm);
+    }
+
+
+    /* update panel clock periodically (if enabled) */
+    if ( !clock_sync_needed &&
+	 (astat->timesync_interval > 0) &&
+	 (astat->last_timesync + (astat->timesync_interval*3600) < t) ) {
+      clock_sync_needed=1;
+      logmsg(2,"clock sync needed");
+    }
+
 
+
+    /* periodically save status (if enabled) */
+    if ( (astat->savestatus_interval > 0) &&
+	 (astat->last_savestatus + (astat->savestatus_interval*60) < t) &&
+	 config->status_file ) {
+      logmsg(2,"saving alarm status to: %s",config->status_file);
+      ret=save_status_xml(config->status_file,astat);
+      if (ret != 0)
+	logmsg(0,"failed to save alarm status: %s (%d)",
+	       config->status_file,ret);
+      shm_write_begin(shm);
+      astat->last_savestatus=t;
+      shm_write_end(shm);
     }
 
+
+    /* periodically save state image (if enabled) */
+    if ( config->state_file && (config->state_save_interval > 0) &&
+	 (last_savestate + (config->state_save_interval*60) < t) ) {
+      logmsg(2,"saving state to: %s",config->state_file);
+      ret=save_state_image(config->state_file,shm);
+      if (ret != 0)
+	logmsg(0,"failed to save state: %s (%d)",config->state_file,ret);
+      last_savestate=t;
+    }
+
+
     fflush(stdout);
+    shm_write_begin(shm);
     shm->last_updated=time(NULL);
+    if (nx_time_ms() - loop_start > loopstats->loop_time_max)
+      loopstats->loop_time_max=nx_time_ms() - loop_start;
+    shm_write_end(shm);
   }
 
 
-  close(fd);
+  close(conn->fd);
   exit(0);
 }
@@ -9,6 +9,9 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
 #include "nx-584.h"
 #if !HAVE_STRLCAT || !HAVE_STRLCPY
 #include "strl-funcs.h"
@@ -17,8 +20,10 @@
 
 #define PRGNAME "nxgipd"
 
-/* shared memory version, update if shared memory locations change... */
-#define SHMVERSION "42.7"
+/* shared memory layout version, update only if the header layout changes
+   (clients and saved state images locate sections using the section table,
+   new sections and fields appended to sections do not need a new version) */
+#define SHMVERSION "43.0"
 
 #ifndef CONFIG_FILE
 #define CONFIG_FILE "/etc/nxgipd.conf"
@@ -89,6 +94,59 @@ typedef struct nx_zone_status {
   time_t update_interval;
 } nx_zone_status_t;
 
+/* zone status flags (bits as in zone status message) */
+#define NX_ZONE_FAULT            0x0001
+#define NX_ZONE_TAMPER           0x0002
+#define NX_ZONE_TROUBLE          0x0004
+#define NX_ZONE_BYPASS           0x0008
+#define NX_ZONE_INHIBITED        0x0010
+#define NX_ZONE_LOW_BATTERY      0x0020
+#define NX_ZONE_LOSS_SUPERVISION 0x0040
+#define NX_ZONE_ALARM_MEM        0x0100
+#define NX_ZONE_BYPASS_MEM       0x0200
+#define NX_ZONE_FLAG_BITS        10
+
+/* zone type flags (type_flags[0]) */
+#define NX_ZONE_TYPE_FIRE        0x01
+#define NX_ZONE_TYPE_24HOUR      0x02
+#define NX_ZONE_TYPE_BITS        8
+
+/* bit-packed zone state (one bit per zone) */
+#define NX_ZONE_BITMAP_WORDS ((NX_ZONES_MAX+63)/64)
+
+typedef struct nx_zone_bitmaps {
+  uint64_t valid[NX_ZONE_BITMAP_WORDS];
+  uint64_t flags[NX_ZONE_FLAG_BITS][NX_ZONE_BITMAP_WORDS];  /* by NX_ZONE_* bit */
+  uint64_t partition[NX_PARTITIONS_MAX][NX_ZONE_BITMAP_WORDS];
+} nx_zone_bitmaps_t;
+
+/* status flag names */
+typedef struct nx_flag_name {
+  const char *name;
+  uint flag;
+} nx_flag_name_t;
+
+/* partition status flags */
+#define NX_PART_ARMED            0x00001
+#define NX_PART_READY            0x00002
+#define NX_PART_STAY_MODE        0x00004
+#define NX_PART_CHIME_MODE       0x00008
+#define NX_PART_ENTRY_DELAY      0x00010
+#define NX_PART_EXIT_DELAY       0x00020
+#define NX_PART_PREV_ALARM       0x00040
+#define NX_PART_FIRE             0x00080
+#define NX_PART_FIRE_TROUBLE     0x00100
+#define NX_PART_INSTANT          0x00200
+#define NX_PART_TAMPER           0x00400
+#define NX_PART_ALARM_MEM        0x00800
+#define NX_PART_SIREN            0x01000
+#define NX_PART_BUZZER           0x02000
+#define NX_PART_LOW_BATTERY      0x04000
+#define NX_PART_LOST_SUPERVISION 0x08000
+#define NX_PART_ZONES_BYPASSED   0x10000
+#define NX_PART_ALARM_SENT       0x20000
+#define NX_PART_FLAG_BITS        18
+
 typedef struct nx_system_status {
   uchar panel_id;
   char  panel_model[16];
@@ -155,8 +213,11 @@ typedef struct nx_system_status {
   int last_partition;
   nx_zone_status_t zones[NX_ZONES_MAX];
   int last_zone;
+  int zone_refresh;  /* next zone to refresh in background (fast start) */
   nx_log_event_t log[NX_MAX_LOG_ENTRIES];
   int last_log;
+  int log_cursor;       /* last log entry received in sequence (-1 = unknown) */
+  int log_sync_target;  /* log entry to fetch log up to (-1 = no sync pending) */
 
   char armed;
 
@@ -178,10 +239,15 @@ typedef struct nx_configuration {
   char *serial_speed;
   char *serial_mode;
   uchar serial_protocol;
+  int   serial_timeout;
+  int   serial_frame_timeout;
+  int   serial_retry;
+  int   serial_window;
   int   zones;
   uchar partitions;
   int   timesync;
   int   statuscheck;
+  int   fast_start;
 
   int   syslog_mode;
   int   debug_mode;
@@ -195,6 +261,26 @@ typedef struct nx_configuration {
   uchar trigger_partition;
   uchar trigger_zone;
   int   max_triggers;
+  int   trigger_mode;
+  int   trigger_format;
+  int   trigger_buffer;
+  int   trigger_queue;
+  int   trigger_coalesce;
+  struct nx_trigger_rules *trigger_rules;  /* NULL = no rules */
+
+  char *mqtt_host;      /* MQTT broker, NULL = MQTT disabled */
+  int   mqtt_port;
+  char *mqtt_client_id;
+  char *mqtt_user;
+  char *mqtt_password;
+  char *mqtt_prefix;    /* topic prefix */
+  int   mqtt_qos;
+  int   mqtt_keepalive;
+  int   mqtt_queue;
+
+  int   debounce_window;                     /* zone debounce window (seconds) */
+  short debounce_zone[NX_ZONES_MAX];         /* per zone window, -1 = not set */
+  short debounce_type[NX_ZONE_TYPE_BITS];    /* per zone type window, -1 = not set */
 
   uint  shmkey;
   int   shmmode;
@@ -202,10 +288,50 @@ typedef struct nx_configuration {
   int   shm_gid;
   uint  msgkey;
   int   msgmode;
+  uint  replykey;
+  int   reply_backlog;
   int   msg_uid;
   int   msg_gid;
+  char *cmd_socket;
+  char *state_file;
+  int   state_save_interval;
+  char *topology_file;
 } nx_configuration_t;
 
+/* trigger modes */
+#define TRIGGER_MODE_EXEC        0  /* run trigger program for each event */
+#define TRIGGER_MODE_PERSISTENT  1  /* send events to stdin of trigger program */
+
+/* event formats for persistent trigger program */
+#define TRIGGER_FORMAT_ENV       0  /* NAME=value lines, empty line after event */
+#define TRIGGER_FORMAT_JSON      1  /* one JSON object per line */
+
+#define MQTT_PORT                1883
+#define MQTT_CLIENT_ID           "nxgipd"
+#define MQTT_PREFIX              "nxgipd"
+#define MQTT_KEEPALIVE           60    /* seconds */
+#define MQTT_QUEUE_SIZE          1024  /* messages waiting to be sent */
+
+#define TRIGGER_BUFFER_SIZE      65536
+#define TRIGGER_QUEUE_SIZE       64   /* events waiting for free trigger process */
+
+
+#define NX_BUS_NODES        256
+
+#define NX_NODE_UNKNOWN     0
+#define NX_NODE_PRESENT     1
+#define NX_NODE_ABSENT      2
+#define NX_NODE_REJECTED    3
+#define NX_NODE_NOREPLY     4
+
+typedef struct nx_bus_node {
+  uchar state;
+  uchar reply;     /* reply message (if no device found) */
+  uchar len;       /* first location length */
+  uchar type;      /* first location data type */
+  int   rtt;       /* response time (ms) */
+} nx_bus_node_t;
+
 
 
 
@@ -224,6 +350,13 @@ typedef struct nx_ipc_msg_reply {
   char   data[256];
 } nx_ipc_msg_reply_t;
 
+/* reply sent to client via reply queue (msgtype = pid of the client,
+   which clients put into msgid[1] of the request) */
+typedef struct nx_ipc_reply_msg {
+  long               msgtype;
+  nx_ipc_msg_reply_t reply;
+} nx_ipc_reply_msg_t;
+
 /* msgtype values for nx_ipc_msg_t */
 #define NX_IPC_MSG_CMD       1
 #define NX_IPC_MSG_GET_PROG  2
@@ -232,28 +365,303 @@ typedef struct nx_ipc_msg_reply {
 #define NX_IPC_X10_CMD       5
 #define NX_IPC_MSG_SET_PROG  6
 #define NX_IPC_SET_CLOCK     7
-
-#define IPC_MSG_REPLY_TABLE_SIZE 64
+#define NX_IPC_MSG_SET_PROG_BATCH 8
+
+/* flags for NX_IPC_MSG_GET_PROG (data[3]) */
+#define NX_IPC_PROG_REFRESH  0x01
+
+/* NX_IPC_MSG_SET_PROG_BATCH: data[0] = number of locations, followed by
+   (device, location (2 bytes), type, length, values) for each location */
+#define NX_PROG_BATCH_MAX    40
+#define NX_PROG_BATCH_CHECK  0x80  /* data[0] flag: only check locations (no programming) */
+
+/* per-location results in NX_IPC_MSG_SET_PROG_BATCH reply */
+#define NX_PROG_BATCH_OK           0
+#define NX_PROG_BATCH_READ_FAIL    1  /* cannot read current data */
+#define NX_PROG_BATCH_TYPE         2  /* data type mismatch */
+#define NX_PROG_BATCH_LENGTH       3  /* data length mismatch */
+#define NX_PROG_BATCH_WRITE_FAIL   4  /* program data command failed */
+#define NX_PROG_BATCH_VERIFY_FAIL  5  /* location data differs after programming */
+#define NX_PROG_BATCH_VERIFY_READ  6  /* cannot read data after programming */
+#define NX_PROG_BATCH_SKIPPED      7  /* not programmed (other locations invalid) */
+
+/* number of replies daemon holds if reply queue is full (default) */
+#define IPC_REPLY_BACKLOG 64
+
+/* notification sent to daemon (command socket) after a message is queued */
+typedef struct nx_ipc_doorbell {
+  uint      msgid[2];
+  long long sent;  /* time message was queued (monotonic clock, ms) */
+} nx_ipc_doorbell_t;
+
+/* main loop statistics */
+typedef struct nx_loop_stats {
+  unsigned long iterations;
+  unsigned long messages;        /* panel messages processed */
+  unsigned long commands;        /* IPC messages processed */
+  unsigned long doorbells;       /* command socket notifications received */
+  uint          cmd_latency_last; /* time command waited in queue (ms) */
+  uint          cmd_latency_max;
+  unsigned long cmd_latency_sum;
+  unsigned long cmd_latency_count;
+  uint          cmd_time_last;   /* time spent processing command (ms) */
+  uint          cmd_time_max;
+  uint          loop_time_max;   /* longest main loop iteration (ms) */
+  unsigned long replies;         /* replies delivered to clients */
+  uint          reply_backlog;   /* replies waiting for space in reply queue */
+  uint          replies_dropped; /* replies lost (backlog full) */
+  volatile uint waiters;         /* clients waiting in shm_wait_change() */
+} nx_loop_stats_t;
+
+/* trigger process statistics (per event type), histogram bucket n counts
+   values from 2^n to 2^(n+1)-1 (first bucket also counts 0, last bucket
+   everything larger) */
+#define NX_TRIGGER_TYPES         3   /* zone, partition, log (NX_EVENT_*) */
+#define NX_TRIGGER_HIST_BUCKETS  16
+
+typedef struct nx_trigger_type_stats {
+  unsigned long count;         /* trigger processes started */
+  unsigned long ok;            /* exited with status 0 */
+  unsigned long failed;        /* exited with non-zero status */
+  unsigned long killed;        /* killed by signal */
+  unsigned long spawn_errors;  /* process could not be started */
+  unsigned long long spawn_us_sum;  /* time spent starting process (us) */
+  uint          spawn_us_max;
+  unsigned long long run_ms_sum;    /* process run time (ms) */
+  uint          run_ms_max;
+  unsigned long long cpu_ms_sum;    /* user + system CPU time used (ms) */
+  unsigned long timed;         /* processes with run time recorded */
+  uint          spawn_hist[NX_TRIGGER_HIST_BUCKETS];  /* spawn time (us) */
+  uint          run_hist[NX_TRIGGER_HIST_BUCKETS];    /* run time (ms) */
+} nx_trigger_type_stats_t;
+
+/* trigger program statistics */
+typedef struct nx_trigger_stats {
+  unsigned long started;    /* trigger processes started (or events sent) */
+  uint          queued;     /* events waiting in trigger queue */
+  uint          queue_max;  /* high-water mark of trigger queue */
+  uint          queue_size;
+  unsigned long coalesced;  /* queued events replaced by newer event for same zone */
+  unsigned long dropped;    /* events lost (queue or buffer full) */
+  uint          buffered;   /* bytes waiting to be written to persistent program */
+  uint          restarts;   /* persistent program restarts */
+  nx_trigger_type_stats_t types[NX_TRIGGER_TYPES];  /* indexed by NX_EVENT_* - 1 */
+} nx_trigger_stats_t;
+
+
+/* MQTT publisher statistics */
+typedef struct nx_mqtt_stats {
+  int           connected;
+  time_t        connected_since;
+  uint          connects;    /* connections established */
+  unsigned long published;   /* messages sent (and acknowledged with QoS > 0) */
+  uint          queued;      /* messages waiting to be sent or acknowledged */
+  uint          queue_max;
+  unsigned long dropped;     /* messages lost (queue full) */
+} nx_mqtt_stats_t;
+
+/* trigger rules compiled into lookup tables (bit n set = rule n matches),
+   event matches rules in all tables, first matching rule is used */
+#define TRIGGER_RULES_MAX     32
+#define TRIGGER_RULE_NOMATCH  -1  /* rules exist for event type, no rule matched */
+#define TRIGGER_RULE_DEFAULT  -2  /* no rules for event type (use trigger levels) */
+
+typedef struct nx_rule_table {
+  uint32_t num[NX_ZONES_MAX];  /* by zone / partition number, or log event type */
+  uint32_t part[256];          /* by partition mask */
+  uint32_t set[3][256];        /* by flags set (each byte of flags) */
+  uint32_t clear[3][256];      /* by flags cleared */
+  uint32_t any;                /* rules that match any (or no) flag change */
+} nx_rule_table_t;
+
+typedef struct nx_trigger_rules {
+  int      count;
+  char     *name[TRIGGER_RULES_MAX];
+  char     *program[TRIGGER_RULES_MAX];  /* NULL = default alarm program */
+  uint32_t ignore;                       /* rules that suppress the event */
+  uint32_t used[NX_TRIGGER_TYPES];       /* rules for each event type */
+  nx_rule_table_t table[NX_TRIGGER_TYPES];
+} nx_trigger_rules_t;
+
+
+#define PROG_DATA_MAX         32
+
+#define PROG_LOC_NOTREAD      0
+#define PROG_LOC_DATA         1
+#define PROG_LOC_UNUSED       2   /* location rejected by panel */
+#define PROG_LOC_FAILED       3   /* no reply (or error) */
+#define PROG_LOC_SKIPPED      4   /* not read (inside unused range) */
+
+/* module configuration (programming) location */
+typedef struct nx_prog_location {
+  uchar state;
+  uchar reply;      /* reply message (if failed) */
+  uchar type;
+  uchar nibble;
+  uchar len;        /* data length (bytes or nibbles) */
+  uchar segments;   /* segments received */
+  uchar reserved[2];
+  uchar data[PROG_DATA_MAX];
+} nx_prog_location_t;
+
+
+#define PROG_CACHE_SIZE       1024   /* entries (power of 2) */
+#define PROG_CACHE_PROBE      8      /* max entries searched per lookup */
+#define PROG_CACHE_MAX_AGE    (24*3600)
+
+#define PROG_CACHE_KEY(device,location) \
+  (((((uint)(device) << 12) | (location)) * 2654435761U) >> 16)
+
+/* program data cache entry */
+typedef struct nx_prog_cache_entry {
+  uchar  valid;
+  uchar  device;
+  ushort location;
+  time_t updated;
+  nx_prog_location_t data;
+} nx_prog_cache_entry_t;
+
+typedef struct nx_prog_cache {
+  int    entries;
+  uint   hits;
+  uint   misses;
+  uint   invalidations;
+  nx_prog_cache_entry_t e[PROG_CACHE_SIZE];
+} nx_prog_cache_t;
+
+
+/* how long readers wait for consistent snapshot of shared memory (ms) */
+#define SHM_READ_TIMEOUT 1000
+/* how often clients check for changes if futexes are not available (ms) */
+#define SHM_POLL_INTERVAL 50
+
+/* event journal (ring buffer) in shared memory */
+#define NX_JOURNAL_SIZE     256   /* must be power of 2 */
+
+#define NX_EVENT_ZONE       1
+#define NX_EVENT_PARTITION  2
+#define NX_EVENT_LOG        3
+
+typedef struct nx_journal_event {
+  volatile unsigned long seq;  /* 0 while event is being written */
+  time_t time;
+  uchar  kind;
+  uchar  part;       /* partition (log events) */
+  ushort num;        /* zone/partition number (1..), or log event zone/user/device */
+  uint   old_flags;  /* zone/partition flags before event */
+  uint   new_flags;  /* zone/partition flags after event, or log event type */
+  char   text[100];
+} nx_journal_event_t;
+
+typedef struct nx_journal {
+  volatile unsigned long head;  /* sequence number of latest event */
+  nx_journal_event_t e[NX_JOURNAL_SIZE];
+} nx_journal_t;
+
+
+/* shared memory segment header: clients find sections using the section
+   table, so new sections (or fields appended to end of a section or its
+   records) do not break older clients. */
+#define NX_SHM_MAGIC          "NXGIPD-SHM"
+#define NX_SHM_HEADER_VERSION 1
+#define NX_SHM_SECTIONS_MAX   16
+
+/* section ids & versions (update version if existing fields change) */
+#define NX_SHM_INTERFACE      1
+#define NX_SHM_SYSTEM         2
+#define NX_SHM_LOOPSTATS      3
+#define NX_SHM_PROGCACHE      4
+#define NX_SHM_JOURNAL        5
+#define NX_SHM_ZONEMAP        6
+#define NX_SHM_TRIGGERS       7
+#define NX_SHM_MQTT           8
+
+#define NX_SHM_INTERFACE_VERSION  1
+#define NX_SHM_SYSTEM_VERSION     1
+#define NX_SHM_LOOPSTATS_VERSION  1
+#define NX_SHM_PROGCACHE_VERSION  1
+#define NX_SHM_JOURNAL_VERSION    1
+#define NX_SHM_ZONEMAP_VERSION    1
+#define NX_SHM_TRIGGERS_VERSION   1
+#define NX_SHM_MQTT_VERSION       1
+
+typedef struct nx_shm_section {
+  uint id;
+  uint version;
+  uint offset;   /* from start of segment */
+  uint size;
+  uint first;    /* offset of first record in section */
+  uint stride;   /* record size (0 if section has no records) */
+  uint count;    /* number of records */
+} nx_shm_section_t;
 
 typedef struct nx_shm {
+  /* header (layout is fixed, see NX_SHM_HEADER_VERSION) */
+  char                   magic[12];
+  uint                   header_version;
+  uint                   size;  /* size of shared memory segment */
   char                   shmversion[8];
+  volatile uint          seq;   /* odd while daemon is updating (seqlock) */
+  volatile uint          changes;   /* incremented after each update */
   pid_t                  pid;
   time_t                 last_updated;
   int                    comm_fail;
-  nx_interface_status_t  intstatus;
-  nx_system_status_t     alarmstatus;
   time_t                 daemon_started;
   char                   daemon_version[32];
-  int                    reply_index;
-  nx_ipc_msg_reply_t     replies[IPC_MSG_REPLY_TABLE_SIZE];
+  uint                   sections;
+  nx_shm_section_t       section[NX_SHM_SECTIONS_MAX];
+
+  /* sections */
+  nx_interface_status_t  intstatus;
+  nx_system_status_t     alarmstatus;
+  nx_loop_stats_t        loopstats;
+  nx_prog_cache_t        progcache;
+  nx_journal_t           journal;
+  nx_zone_bitmaps_t      zonemap;
+  nx_trigger_stats_t     triggerstats;
+  nx_mqtt_stats_t        mqttstats;
 } nx_shm_t;
 
+#define NX_SHM_HEADER_SIZE offsetof(nx_shm_t,intstatus)
+
+
+#define STATE_IMAGE_MAGIC "NXGIPD-STATE"
+
+#define STATE_IMAGE_MAX_SIZE (64*1024*1024)
+
+/* state image file header (followed by nx_shm_t of the program that saved
+   it, sections are restored using its section table) */
+typedef struct nx_state_image_header {
+  char   magic[16];
+  char   shmversion[8];
+  uint   size;       /* sizeof(nx_shm_t) (when saved) */
+  uint   checksum;   /* checksum of nx_shm_t data */
+  time_t saved;
+} nx_state_image_header_t;
+
+
+#define PROG_SNAPSHOT_MAGIC   "NXGIPD-PROG"
+#define PROG_SNAPSHOT_VERSION 1
+
+/* module configuration snapshot file header
+   (followed by NX_LOGICAL_LOCATION_MAX+1 nx_prog_location_t records) */
+typedef struct nx_prog_snapshot_header {
+  char   magic[12];
+  uint   version;
+  uint   node;
+  uint   locations;
+  uint   next;       /* next location to read (checkpoint) */
+  uint   pass;       /* number of completed scans */
+  time_t updated;
+} nx_prog_snapshot_header_t;
+
 
 
 
 extern nx_configuration_t *config;
 extern char *program_name;
 extern int trigger_processes;
+extern nx_shm_t *shm;
 
 /* misc.c */
 void die(char *format, ...);
@@ -262,11 +670,34 @@ void logmsg(int priority, char *format, ...);
 void set_message_reply(nx_ipc_msg_reply_t *reply, const nx_ipc_msg_t *msg, int result, const char *format, ...);
 int openserialdevice(const char *device, const char *speed, const char *mode);
 const char *timedeltastr(time_t delta);
+int format_program_data(const nx_prog_location_t *data, char *buf, size_t size);
+const nx_prog_cache_entry_t* prog_cache_lookup(const nx_prog_cache_t *cache, int device, int location);
+void shm_write_begin(nx_shm_t *shm);
+void shm_write_end(nx_shm_t *shm);
+void shm_changed(nx_shm_t *shm);
+int shm_read(const nx_shm_t *shm, void *dest, const void *src, size_t size);
+int shm_snapshot(const nx_shm_t *shm, nx_shm_t *copy);
+void shm_copy_image(const nx_shm_t *image, nx_shm_t *copy);
+void shm_init_header(nx_shm_t *shm);
+int shm_attach(int shmkey, int *shmidptr, nx_shm_t **shmptr);
+const void* shm_section(const nx_shm_t *shm, uint id);
+int shm_wait_change(const nx_shm_t *shm, uint changes, int timeout);
+uint nx_zone_flags(const nx_zone_status_t *zone);
+uint nx_partition_flags(const nx_partition_status_t *part);
+extern const nx_flag_name_t nx_zone_flag_names[];
+extern const nx_flag_name_t nx_partition_flag_names[];
+int journal_read(const nx_journal_t *journal, unsigned long *cursor, nx_journal_event_t *event);
+void zone_bitmaps_update(nx_zone_bitmaps_t *map, int zonenum, const nx_zone_status_t *zone);
+void zone_bitmaps_rebuild(nx_zone_bitmaps_t *map, const nx_system_status_t *astat);
+int zone_bitmaps_query(const nx_zone_bitmaps_t *map, uint flags, int partition, uint64_t *result);
 
 /* configuration.c */
 int load_config(const char *configxml, nx_configuration_t *config, int logtest);
 int save_status_xml(const char *filename, nx_system_status_t *astat);
 int load_status_xml(const char *filename, nx_system_status_t *astat);
+int load_zone_names(const char *filename, nx_system_status_t *astat);
+int save_topology_xml(const char *filename, const nx_bus_node_t *nodes);
+int load_topology_xml(const char *filename, nx_bus_node_t *nodes);
 
 /* ipc.c */
 int init_shared_memory(int shmkey, int shmmode, size_t size, int *shmidptr, nx_shm_t **shmptr);
@@ -274,41 +705,80 @@ int init_message_queue(int msgkey, int msgmode);
 void release_shared_memory(int shmid, void *shmseg);
 void release_message_queue(int msgid);
 int read_message_queue(int msgid, nx_ipc_msg_t *msg);
+int send_message_reply(int msgid, long pid, const nx_ipc_msg_reply_t *reply);
+int purge_reply_queue(int msgid);
+int init_command_socket(const char *path, int mode);
+void release_command_socket(int sock, const char *path);
+int read_command_socket(int sock, nx_ipc_doorbell_t *db);
+int save_state_image(const char *filename, const nx_shm_t *shm);
+int load_state_image(const char *filename, nx_shm_t *image, time_t *saved);
 
 
 /* probe.c */
-int read_config(int fd, int protocol, uchar node, int location);
-int probe_bus(int fd, int protocol);
-int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus, int verbose);
+int read_config(nx_conn_t *conn, uchar node, int location, const char *snapshot_file);
+int diff_config_snapshots(const char *file1, const char *file2);
+int probe_bus(nx_conn_t *conn, int full_scan);
+int detect_panel(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int verbose);
 
 
 /* process.c */
 void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_status_t *astat, nx_interface_status_t *istatus);
+void process_zone_debounce(nx_system_status_t *astat, time_t now);
+void journal_add(nx_journal_t *journal, int kind, int num, int part,
+		 uint old_flags, uint new_flags, const char *text, time_t t);
 
-void process_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 		     nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
-void process_keypadmsg_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_keypadmsg_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 			       nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
-void process_get_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+int read_program_data(nx_conn_t *conn, int device, int location, nx_prog_location_t *data);
+int read_program_data_batch(nx_conn_t *conn, const uchar *devices, const int *locations,
+			    int count, nx_prog_location_t *data);
+void prog_cache_invalidate(nx_prog_cache_t *cache, int device, int location);
+void process_get_program_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 				 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
-void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_set_program_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 				 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
-void process_zone_bypass_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_set_program_batch_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
+				       nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
+void process_zone_bypass_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 				 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
-void process_x10_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_x10_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 			 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply);
 
-int process_set_clock(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus);
-int dump_log(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus);
-int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus);
+int process_set_clock(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus);
+int dump_log(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus);
+int get_system_status(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus);
+int restore_system_status(nx_conn_t *conn, const nx_system_status_t *saved,
+			  nx_system_status_t *astat, nx_interface_status_t *istatus);
+void update_log_cursor(nx_system_status_t *astat, const nxmsg_t *msg);
+void start_log_sync(nx_system_status_t *astat, int target);
+int sync_log(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int count);
+int refresh_zones(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int count);
 
 
 /* trigger.c */
 void  run_zone_trigger(int zonenum,const char* zonename, int fault, int bypass, int trouble,
-		       int tamper, int armed, const char* zonestatus);
+		       int tamper, int armed, const char* zonestatus, int rule);
 void run_partition_trigger(int partnum, const char* partitionstatus,int armed, int ready,
-			   int stay, int chime, int entryd, int exitd, int palarm);
-void run_log_trigger(nx_log_event_t *e);
+			   int stay, int chime, int entryd, int exitd, int palarm, int rule);
+void run_log_trigger(nx_log_event_t *e, int rule);
+int trigger_rule_match(int type, int num, uint partmask, uint old_flags, uint new_flags);
+int trigger_worker_start();
+void trigger_cloexec_fds();
+int trigger_reaped(pid_t pid, int status, const struct rusage *ru);
+int triggers_pending();
+int trigger_fd(short *events);
+int triggers_backpressure();
+void process_pending_triggers();
+
+/* mqtt.c */
+void mqtt_init();
+int  mqtt_fd(short *events);
+void mqtt_process(short revents, nx_system_status_t *astat);
+void mqtt_event(int kind, int num, int part, uint old_flags, uint new_flags,
+		const char *text, time_t t);
+void mqtt_shutdown();
 
 
 
@@ -65,6 +65,80 @@ nx_configuration_t *config = &configuration;
 
 int reverse_sort_order = 0;
 
+static const struct {
+  const char *name;
+  uint flag;
+} zone_flag_names[] = {
+  { "fault", NX_ZONE_FAULT },
+  { "tamper", NX_ZONE_TAMPER },
+  { "trouble", NX_ZONE_TROUBLE },
+  { "bypass", NX_ZONE_BYPASS },
+  { "inhibited", NX_ZONE_INHIBITED },
+  { "lowbattery", NX_ZONE_LOW_BATTERY },
+  { "supervision", NX_ZONE_LOSS_SUPERVISION },
+  { "alarmmem", NX_ZONE_ALARM_MEM },
+  { "bypassmem", NX_ZONE_BYPASS_MEM },
+  { "all", 0 },
+  { NULL, 0 }
+};
+
+
+/* parse zone list query: <flag>[,<flag>...][:<partition>] */
+static int parse_zone_query(const char *arg, uint *flags, int *partition)
+{
+  char buf[256], *s, *p, *saveptr;
+  int i;
+
+  strlcpy(buf,arg,sizeof(buf));
+  *flags=0;
+  *partition=0;
+
+  if ((p=strchr(buf,':'))) {
+    *p++=0;
+    if (sscanf(p,"%d",partition) != 1 || *partition < 1 || *partition > NX_PARTITIONS_MAX)
+      return -2;
+  }
+
+  s=strtok_r(buf,",",&saveptr);
+  while (s) {
+    for (i=0; zone_flag_names[i].name; i++) {
+      if (!strcasecmp(s,zone_flag_names[i].name)) break;
+    }
+    if (!zone_flag_names[i].name) return -1;
+    *flags|=zone_flag_names[i].flag;
+    s=strtok_r(NULL,",",&saveptr);
+  }
+
+  return 0;
+}
+
+
+static void print_event(const nx_journal_event_t *e, int csv_mode)
+{
+  static const char *kinds[] = { "", "zone", "partition", "log" };
+  const char *kind = (e->kind <= NX_EVENT_LOG ? kinds[e->kind] : "unknown");
+
+  if (csv_mode) {
+    printf("%lu,%ld,%s,%u,%u,0x%05x,0x%05x,\"%s\"\n",e->seq,(long)e->time,kind,
+	   e->num,e->part+1,e->old_flags,e->new_flags,e->text);
+    return;
+  }
+
+  switch (e->kind) {
+  case NX_EVENT_ZONE:
+    printf("%s  Zone %02d %s: %s\n",nx_timestampstr(e->time),e->num,
+	   (e->num > 0 && e->num <= NX_ZONES_MAX ? astat->zones[e->num-1].name : ""),
+	   e->text);
+    break;
+  case NX_EVENT_PARTITION:
+    printf("%s  Partition %d: %s\n",nx_timestampstr(e->time),e->num,e->text);
+    break;
+  default:
+    printf("%s  %s\n",nx_timestampstr(e->time),e->text);
+  }
+}
+
+
 static int sort_time_func(const void *p1, const void *p2)
 {
   const nx_zone_status_t *z1 = * (const nx_zone_status_t**)p1;
@@ -83,11 +157,16 @@ int main(int argc, char **argv)
   int opt_index = 0;
   int opt;
   int log_mode = 0;
+  int events_mode = -1;
+  int follow_mode = 0;
+  int triggers_mode = 0;
   int zones_mode = 0;
+  char *zone_query = NULL;
   char *config_file = CONFIG_FILE;
   int i;
   int azones = 0, apart = 0;
   int lastzone = 0;
+  int ret;
   time_t lastzonetime = 0;
   time_t lastparttime = 0;
   time_t now;
@@ -99,18 +178,23 @@ int main(int argc, char **argv)
   int display_all = 0;
   int sort_time = 0;
   nx_zone_status_t* zonemap[NX_ZONES_MAX];
+  nx_shm_t *shmcopy, *shmlive;
 
   struct option long_options[] = {
     {"all",0,0,'a'},
     {"config",1,0,'c'},
     {"csv",0,0,'C'},
+    {"events",2,0,'e'},
+    {"follow",0,0,'f'},
     {"help",0,0,'h'},
     {"interface",0,0,'i'},
+    {"list",1,0,'L'},
     {"log",2,0,'l'},
     {"partition",1,0,'p'},
     {"reverse",0,0,'r'},
     {"system",0,0,'s'},
     {"time",0,0,'t'},
+    {"triggers",0,0,'T'},
     {"verbose",0,0,'v'},
     {"version",0,0,'V'},
     {"zones",0,0,'z'},
@@ -122,7 +206,7 @@ int main(int argc, char **argv)
 
   umask(022);
 
-  while ((opt=getopt_long(argc,argv,"aip:rstvVhCc:l::zZ",long_options,&opt_index)) != -1) {
+  while ((opt=getopt_long(argc,argv,"aip:rstTvVhCc:e::fL:l::zZ",long_options,&opt_index)) != -1) {
     switch (opt) {
 
     case 'a':
@@ -137,6 +221,17 @@ int main(int argc, char **argv)
       csv_mode=1;
       break;
 
+    case 'e':
+      if (optarg && sscanf(optarg,"%d",&events_mode)==1) {
+	if (events_mode < 0) events_mode=0;
+      } else
+	events_mode=NX_JOURNAL_SIZE;
+      break;
+
+    case 'f':
+      follow_mode=1;
+      break;
+
     case 'i':
       interface_status=1;
       break;
@@ -153,6 +248,10 @@ int main(int argc, char **argv)
       sort_time=1;
       break;
 
+    case 'T':
+      triggers_mode=1;
+      break;
+
     case 'v':
       verbose_mode=1;
       break;
@@ -169,6 +268,10 @@ int main(int argc, char **argv)
 	log_mode=NX_MAX_LOG_ENTRIES;;
       break;
 
+    case 'L':
+      zone_query=strdup(optarg);
+      break;
+
     case 'p':
       if (optarg && sscanf(optarg,"%d",&partition_info)==1) {
 	if (partition_info < 1 || partition_info > NX_PARTITIONS_MAX)
@@ -199,13 +302,20 @@ int main(int argc, char **argv)
 	      "  --config=<configfile>   use specified config file\n"
 	      "  -c <configfile>\n"
 	      "  --csv, -C               output in CSV format\n"
+	      "  --events, -e            display recent zone/partition/log events\n"
+	      "  --events=<n>, -e <n>    display last n events\n"
+	      "  --follow, -f            display new events as they happen\n"
 	      "  --help, -h              display this help and exit\n"
 	      "  --interface, -i         display interface status\n"
+	      "  --list=<flags>[:<p>]    list zones with any of the given flags set\n"
+	      "  -L <flags>[:<p>]        (fault,tamper,trouble,bypass,inhibited,lowbattery,\n"
+	      "                          supervision,alarmmem,bypassmem,all)\n"
 	      "  --log, -l               display full panel log\n"
 	      "  --log=<n>, -l <n>       display last n entries of panel log\n"
 	      "  --partition=<b>, -p <b> display full partition status\n"
 	      "  --system, -s            display full system status\n"
 	      "  --time, -t              sort zones by last trigger/trouble date\n"
+	      "  --triggers, -T          display trigger program statistics\n"
 	      "  --verbose, -v           enable verbose output to stdout\n"
 	      "  --version, -V           print program version\n"
 	      "  --zones, -z             display short zone status info\n"
@@ -225,23 +335,25 @@ int main(int argc, char **argv)
 
   /* initialize shared memory segment */
 
-  shmid = shmget(config->shmkey,sizeof(nx_shm_t),0);
-  if (shmid < 0) {
-    if (errno==EINVAL)
-      die("version mismatch with daemon version (shared memory segment wrong size)");
-    if (errno==ENOENT)
-      die("cannot find share memory segment (server not running?)");
-    die("shmget() failed: %s (%d)\n",strerror(errno),errno);
-  }
-  shm = shmat(shmid,NULL,SHM_RDONLY);
-  if (shm == (void*)-1)
-    die("shmat() failed: %d (%s)\n",errno,strerror(errno));
+  ret=shm_attach(config->shmkey,&shmid,&shm);
+  if (ret == -1 && errno == ENOENT)
+    die("cannot find share memory segment (server not running?)");
+  if (ret == -3)
+    die("version mismatch with daemon (unsupported shared memory format)");
+  if (ret < 0)
+    die("cannot attach to shared memory segment: %s (%d)\n",strerror(errno),errno);
+
+  /* work on a consistent copy of the shared memory segment */
+  if (!(shmcopy=malloc(sizeof(nx_shm_t))))
+    die("out of memory");
+  if (shm_snapshot(shm,shmcopy) < 0)
+    warn("server busy, status may be inconsistent");
+  shmlive=shm;
+  shm=shmcopy;
   istatus=&shm->intstatus;
   astat=&shm->alarmstatus;
-
-  if (strcmp(shm->shmversion, SHMVERSION))
-    die("version mismatch with daemon (shared memory) version: %s vs %s",
-	SHMVERSION, shm->shmversion);
+  if (!shm_section(shm,NX_SHM_SYSTEM))
+    die("version mismatch with daemon (incompatible system status section)");
 
 
 
@@ -251,6 +363,7 @@ int main(int argc, char **argv)
     printf("    Server PID: %d\n",shm->pid);
     printf("Server Version: %s\n",shm->daemon_version);
     printf("    shmversion: %s\n",shm->shmversion);
+    printf("      Sections: %u/%u\n",shm->sections,shmlive->sections);
     printf("  Last Updated: %s\n",nx_timestampstr(shm->last_updated));
     printf("\n");
   }
@@ -521,6 +634,135 @@ int main(int argc, char **argv)
   }
 
 
+  /* print events from the journal ... */
+
+  if (events_mode >= 0 || follow_mode) {
+    const nx_journal_t *journal = shm_section(shmlive,NX_SHM_JOURNAL);
+    int live = (journal != NULL);
+    nx_journal_event_t ev;
+    unsigned long cursor, prev;
+    uint changes;
+    int r;
+
+    if (!shm_section(shm,NX_SHM_JOURNAL))
+      die("event journal not available (daemon version mismatch)");
+
+    if (events_mode < 0) events_mode=0;
+    if (events_mode > NX_JOURNAL_SIZE-1) events_mode=NX_JOURNAL_SIZE-1;
+    cursor=shm->journal.head;
+    cursor=(cursor > events_mode ? cursor - events_mode : 0);
+
+    if (csv_mode)
+      printf("seq,time,kind,num,partition,old_flags,new_flags,text\n");
+
+    while ((r=journal_read(&shm->journal,&cursor,&ev)) != 0) {
+      if (r > 0) print_event(&ev,csv_mode);
+    }
+
+    while (follow_mode) {
+      changes=shmlive->changes;
+      prev=cursor;
+      if (!live) {
+	/* journal layout differs from ours, read from a (converted) copy */
+	shm_snapshot(shmlive,shm);
+	journal=&shm->journal;
+      }
+      while ((r=journal_read(journal,&cursor,&ev)) != 0) {
+	if (r < 0)
+	  warn("%lu events lost (reader too slow)",cursor - prev);
+	else
+	  print_event(&ev,csv_mode);
+	prev=cursor;
+      }
+      fflush(stdout);
+      if (!shm_wait_change(shmlive,changes,5000)) {
+	if (kill(shmlive->pid,0) < 0 && errno != EPERM)
+	  die("server process not running anymore (pid=%d)",shmlive->pid);
+      }
+    }
+    return 0;
+  }
+
+
+  /* list zones matching given flags ... */
+
+  if (zone_query) {
+    uint64_t result[NX_ZONE_BITMAP_WORDS];
+    uint flags;
+    int partition, count, n;
+
+    if (parse_zone_query(zone_query,&flags,&partition) < 0)
+      die("invalid zone list query: %s",zone_query);
+    if (!shm_section(shm,NX_SHM_ZONEMAP))
+      die("zone bitmaps not available (daemon version mismatch)");
+    count=zone_bitmaps_query(&shm->zonemap,flags,partition,result);
+    n=0;
+    for (i=0; i<NX_ZONES_MAX; i++) {
+      if (result[i/64] & ((uint64_t)1 << (i%64)))
+	printf("%s%d",(n++ > 0 ? (csv_mode ? "," : " ") : ""),i+1);
+    }
+    if (n > 0) printf("\n");
+    return (count > 0 ? 0 : 1);
+  }
+
+
+  /* display trigger process statistics ... */
+
+  if (triggers_mode) {
+    static const char *types[NX_TRIGGER_TYPES] = { "zone", "partition", "log" };
+    const nx_trigger_type_stats_t *ts;
+    const uint *hist;
+    int b, m;
+
+    if (!shm_section(shm,NX_SHM_TRIGGERS))
+      die("trigger statistics not available (daemon version mismatch)");
+
+    if (csv_mode)
+      printf("trigger,type,count,ok,failed,killed,spawn_errors,spawn_avg_us,spawn_max_us,run_avg_ms,run_max_ms,cpu_avg_ms\n");
+    else
+      printf("Type        Started       OK   Failed   Killed   Errors   Spawn avg/max (us)   Run avg/max (ms)  CPU avg (ms)\n");
+
+    for (i=0; i<NX_TRIGGER_TYPES; i++) {
+      ts=&shm->triggerstats.types[i];
+      printf((csv_mode ? "trigger,%s,%lu,%lu,%lu,%lu,%lu,%llu,%u,%llu,%u,%llu\n" :
+	      "%-10s %8lu %8lu %8lu %8lu %8lu   %9llu/%-9u %8llu/%-8u %12llu\n"),
+	     types[i],ts->count,ts->ok,ts->failed,ts->killed,ts->spawn_errors,
+	     (ts->count > 0 ? ts->spawn_us_sum / ts->count : 0),ts->spawn_us_max,
+	     (ts->timed > 0 ? ts->run_ms_sum / ts->timed : 0),ts->run_ms_max,
+	     (ts->timed > 0 ? ts->cpu_ms_sum / ts->timed : 0));
+    }
+
+    /* histograms (only non-empty buckets are shown) */
+    if (csv_mode)
+      printf("histogram,type,metric,lt,count\n");
+    for (i=0; i<NX_TRIGGER_TYPES; i++) {
+      ts=&shm->triggerstats.types[i];
+      for (m=0; m<2; m++) {
+	hist=(m == 0 ? ts->spawn_hist : ts->run_hist);
+	if (!csv_mode && (m == 0 ? ts->count : ts->timed) > 0)
+	  printf("\n%s trigger %s:\n",types[i],(m == 0 ? "spawn time (us)" : "run time (ms)"));
+	for (b=0; b<NX_TRIGGER_HIST_BUCKETS; b++) {
+	  if (hist[b] == 0) continue;
+	  if (csv_mode) {
+	    if (b < NX_TRIGGER_HIST_BUCKETS-1)
+	      printf("histogram,%s,%s,%u,%u\n",types[i],(m == 0 ? "spawn_us" : "run_ms"),
+		     1U << (b+1),hist[b]);
+	    else
+	      printf("histogram,%s,%s,inf,%u\n",types[i],(m == 0 ? "spawn_us" : "run_ms"),
+		     hist[b]);
+	  } else {
+	    if (b < NX_TRIGGER_HIST_BUCKETS-1)
+	      printf("   < %-8u %u\n",1U << (b+1),hist[b]);
+	    else
+	      printf("  >= %-8u %u\n",1U << b,hist[b]);
+	  }
+	}
+      }
+    }
+    return 0;
+  }
+
+
   /* print panel event log ... */
 
   if (log_mode) {
@@ -735,6 +977,38 @@ int main(int argc, char **argv)
 	   timedeltastr(now - shm->daemon_started));
     printf(" Last status check: %s\n",nx_timestampstr(astat->last_statuscheck));
     printf("   Last clock sync: %s\n",nx_timestampstr(astat->last_timesync));
+    printf("      Log position: %d/%d%s\n",astat->log_cursor,astat->last_log,
+	   (astat->log_sync_target >= 0 ? " (synchronizing)" : ""));
+    if (astat->zone_refresh < astat->last_zone)
+      printf("      Zone refresh: %d/%d zones\n",astat->zone_refresh,astat->last_zone);
+    printf("   Main loop stats: iterations=%lu messages=%lu commands=%lu doorbells=%lu max loop time=%ums\n",
+	   shm->loopstats.iterations,shm->loopstats.messages,
+	   shm->loopstats.commands,shm->loopstats.doorbells,
+	   shm->loopstats.loop_time_max);
+    printf("  Prog. data cache: entries=%d hits=%u misses=%u invalidations=%u\n",
+	   shm->progcache.entries,shm->progcache.hits,shm->progcache.misses,
+	   shm->progcache.invalidations);
+    printf("   Command latency: last=%ums max=%ums avg=%lums (processing: last=%ums max=%ums)\n",
+	   shm->loopstats.cmd_latency_last,shm->loopstats.cmd_latency_max,
+	   (shm->loopstats.cmd_latency_count > 0 ?
+	    shm->loopstats.cmd_latency_sum / shm->loopstats.cmd_latency_count : 0),
+	   shm->loopstats.cmd_time_last,shm->loopstats.cmd_time_max);
+    printf("           Replies: sent=%lu backlog=%u dropped=%u\n",
+	   shm->loopstats.replies,shm->loopstats.reply_backlog,
+	   shm->loopstats.replies_dropped);
+    if (shm_section(shm,NX_SHM_TRIGGERS))
+      printf("          Triggers: started=%lu queued=%u/%u max=%u coalesced=%lu dropped=%lu buffered=%u restarts=%u\n",
+	     shm->triggerstats.started,shm->triggerstats.queued,
+	     shm->triggerstats.queue_size,shm->triggerstats.queue_max,
+	     shm->triggerstats.coalesced,shm->triggerstats.dropped,
+	     shm->triggerstats.buffered,shm->triggerstats.restarts);
+    if (shm_section(shm,NX_SHM_MQTT) &&
+	(shm->mqttstats.connects > 0 || shm->mqttstats.queued > 0))
+      printf("              MQTT: %s connects=%u published=%lu queued=%u max=%u dropped=%lu\n",
+	     (shm->mqttstats.connected ? "connected" : "disconnected"),
+	     shm->mqttstats.connects,shm->mqttstats.published,
+	     shm->mqttstats.queued,shm->mqttstats.queue_max,
+	     shm->mqttstats.dropped);
   }
 
 
@@ -21,8 +21,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include "nx-584.h"
 #include "nxgipd.h"
@@ -30,179 +32,687 @@
 
 
 
-int read_config(int fd, int protocol, uchar node, int location)
+/* locations read per batch (and snapshot checkpoint interval) */
+#define SCAN_BLOCK         16
+/* after this many consecutive unused locations, only first location
+   of each block is checked until a used location is found */
+#define SCAN_UNUSED_RUN    64
+
+#define SNAPSHOT_LOCATIONS (NX_LOGICAL_LOCATION_MAX+1)
+#define SNAPSHOT_OFFSET(loc) (sizeof(nx_prog_snapshot_header_t) + (loc)*sizeof(nx_prog_location_t))
+
+
+static void print_location(const char *prefix, int loc, const nx_prog_location_t *l)
 {
-  nxmsg_t msgout,msgin,msgin2;
-  int ret,i,nibble,size,len,type;
-  uint loc;
-  int maxloc = NX_LOGICAL_LOCATION_MAX;
-  int locstart = 0;
+  int i,va;
+  int size = (l->nibble ? l->len/2 : l->len);
+
+  switch (l->state) {
+  case PROG_LOC_DATA:
+    break;
+  case PROG_LOC_UNUSED:
+    printf("%sLocation=%03d: Invalid location (not used)\n",prefix,loc);
+    return;
+  case PROG_LOC_FAILED:
+    if (l->reply)
+      printf("%sLocation=%03d: failed to get data (reply %02x)\n",prefix,loc,l->reply);
+    else
+      printf("%sLocation=%03d: no reply\n",prefix,loc);
+    return;
+  default:
+    printf("%sLocation=%03d: not read\n",prefix,loc);
+    return;
+  }
+
+  if (size > 8 && l->segments < 2)
+    printf("%sLocation=%03d: failed to get full location data (offset=1)\n",prefix,loc);
+
+  printf("%sLocation=%03d (len=%02d type=%3s): ",prefix,loc,l->len,nx_prog_datatype_str(l->type));
+  for(i=0;i<l->len;i++) {
+    if (l->nibble) {
+      va=l->data[i/2];
+      if (i%2==0) {va=0x0f & va; } else { va=(va >> 4) & 0x0f; }
+    } else {
+      va=l->data[i];
+    }
+
+    switch (l->type) {
+    case 0:
+      printf("[%c%c%c%c%c%c%c%c] ",
+	     (va&0x01?'1':'-'),
+	     (va&0x02?'2':'-'),
+	     (va&0x04?'3':'-'),
+	     (va&0x08?'4':'-'),
+	     (va&0x10?'5':'-'),
+	     (va&0x20?'6':'-'),
+	     (va&0x40?'7':'-'),
+	     (va&0x80?'8':'-')
+	     );
+      break;
+    case 1:
+      if (l->nibble) printf("%01d ",va);
+      else printf("%02d ",va);
+      break;
+    case 2:
+      if (l->nibble) printf("%01x ",va);
+      else printf("%02x ",va);
+      break;
+    case 3:
+      printf("%c", va);
+      break;
+    default:
+      printf("s%d=%02X ",i+1,va);
+    }
+  }
+  printf("\n");
+}
+
+
+/* read_locations - read list of locations from a module (as a batch) */
+static int read_locations(nx_conn_t *conn, uchar node, const int *list, int count,
+			  nx_prog_location_t *locs)
+{
+  uchar devices[SCAN_BLOCK];
+
+  if (count > SCAN_BLOCK) return -1;
+  memset(devices,node,sizeof(devices));
+
+  return read_program_data_batch(conn,devices,list,count,locs);
+}
+
+
+static int load_snapshot(int fd, nx_prog_snapshot_header_t *hdr, nx_prog_location_t *locs)
+{
+  size_t size = SNAPSHOT_LOCATIONS*sizeof(nx_prog_location_t);
+
+  if (pread(fd,hdr,sizeof(*hdr),0) != sizeof(*hdr)) return -1;
+  if (strncmp(hdr->magic,PROG_SNAPSHOT_MAGIC,sizeof(hdr->magic))) return -2;
+  if (hdr->version != PROG_SNAPSHOT_VERSION || hdr->locations != SNAPSHOT_LOCATIONS)
+    return -3;
+  if (pread(fd,locs,size,SNAPSHOT_OFFSET(0)) != size) return -4;
+
+  return 0;
+}
+
+
+static int read_snapshot_file(const char *filename, nx_prog_snapshot_header_t *hdr,
+			      nx_prog_location_t *locs)
+{
+  int fd,ret;
+
+  if ((fd=open(filename,O_RDONLY)) < 0) return -1;
+  ret=load_snapshot(fd,hdr,locs);
+  close(fd);
+
+  return ret;
+}
+
+
+/* open_snapshot - open existing snapshot of a module (or create new one) */
+static int open_snapshot(const char *filename, uchar node, nx_prog_snapshot_header_t *hdr,
+			 nx_prog_location_t *locs)
+{
+  size_t size = SNAPSHOT_LOCATIONS*sizeof(nx_prog_location_t);
+  int fd,ret;
+
+  fd=open(filename,O_RDWR|O_CREAT,0644);
+  if (fd < 0) return -1;
+
+  ret=load_snapshot(fd,hdr,locs);
+  if (ret == 0 && hdr->node == node)
+    return fd;
+  if (ret == 0 || ret < -1) {
+    warn("not a snapshot of module %d: %s", node, filename);
+    close(fd);
+    return -2;
+  }
+
+  /* create new (empty) snapshot */
+  memset(hdr,0,sizeof(*hdr));
+  strncpy(hdr->magic,PROG_SNAPSHOT_MAGIC,sizeof(hdr->magic));
+  hdr->version=PROG_SNAPSHOT_VERSION;
+  hdr->node=node;
+  hdr->locations=SNAPSHOT_LOCATIONS;
+  hdr->updated=time(NULL);
+  memset(locs,0,size);
+  if (pwrite(fd,hdr,sizeof(*hdr),0) != sizeof(*hdr) ||
+      pwrite(fd,locs,size,SNAPSHOT_OFFSET(0)) != size) {
+    close(fd);
+    return -3;
+  }
+
+  return fd;
+}
 
 
-  /* ignore any pending messages */
+int read_config(nx_conn_t *conn, uchar node, int location, const char *snapshot_file)
+{
+  nx_prog_snapshot_header_t hdr;
+  nx_prog_location_t *locs, blk[SCAN_BLOCK], tmp[SCAN_BLOCK];
+  nxmsg_t msgin;
+  int list[SCAN_BLOCK];
+  int loc,start,count,i,n,ret;
+  int fd = -1;
+  int known = 0;
+  int sparse = 0;
+  int unused_run = 0;
+  int changed = 0;
+  int stats[5] = { 0, 0, 0, 0, 0 };
+  long long t_start;
+
+
+  /* process any pending messages */
   do {
-    ret=nx_receive_message(fd,protocol,&msgin,0);
+    ret=nx_receive_message(conn,&msgin,0);
+    if (ret==1 && conn->unsolicited) conn->unsolicited(&msgin);
   } while (ret==1);
 
 
   printf("Scanning module %d\n",node);
 
-  if (location >=0) {
-    locstart=location;
-    maxloc=location;
+  if (location >= 0) {
+    list[0]=location;
+    if (read_locations(conn,node,list,1,blk) < 0) return -1;
+    print_location("",location,&blk[0]);
+    fflush(stdout);
+    return 0;
+  }
+
+  if (!(locs=calloc(SNAPSHOT_LOCATIONS,sizeof(nx_prog_location_t)))) {
+    warn("out of memory");
+    return -2;
+  }
+
+  start=0;
+  if (snapshot_file) {
+    fd=open_snapshot(snapshot_file,node,&hdr,locs);
+    if (fd < 0) {
+      warn("failed to open snapshot file: %s (%d)",snapshot_file,fd);
+      free(locs);
+      return -3;
+    }
+    if (hdr.next >= SNAPSHOT_LOCATIONS) hdr.next=0;
+    start=hdr.next - (hdr.next % SCAN_BLOCK);
+    /* after a full scan, locations found unused are not read again */
+    known=(hdr.pass > 0);
+    if (start > 0)
+      printf("Resuming scan at location %d (%s)\n",start,snapshot_file);
+    else if (known)
+      printf("Rescanning module using previous snapshot (%s)\n",snapshot_file);
   }
 
-  for(loc=locstart;loc<=maxloc;loc++) {
-    int retries = 3;
-    
-    memset(&msgin,0,sizeof(msgin));
-    memset(&msgin2,0,sizeof(msgin2));
-
-    msgout.msgnum=NX_PROG_DATA_REQ;
-    msgout.len=4;
-    msgout.msg[0]=node;
-    msgout.msg[1]=(loc >> 8) & 0x0f;
-    msgout.msg[2]=(loc & 0xff);
-
-    //printf("Reading location %04x (%d) [%02x %02x %02x %02x]\n",loc,loc,msgout.msgnum,msgout.msg[0],msgout.msg[1],msgout.msg[2]);
-    do {
-      if (retries < 3) {
-	//printf("retry %d\n",retries);
-	do {
-	  ret=nx_receive_message(fd,protocol,&msgin,0);
-	  //if (ret==1) printf("ignoring pending message: %d\n",msgin.msgnum);
-	} while (ret==1);
+  t_start=nx_time_ms();
+
+  for(loc=start;loc<SNAPSHOT_LOCATIONS;loc+=SCAN_BLOCK) {
+    count=(loc+SCAN_BLOCK <= SNAPSHOT_LOCATIONS ? SCAN_BLOCK : SNAPSHOT_LOCATIONS-loc);
+
+    for(i=0;i<count;i++) {
+      memset(&blk[i],0,sizeof(nx_prog_location_t));
+      blk[i].state=PROG_LOC_SKIPPED;
+    }
+
+    if (known) {
+      /* skip locations known to be unused */
+      n=0;
+      for(i=0;i<count;i++) {
+	if (locs[loc+i].state == PROG_LOC_UNUSED || locs[loc+i].state == PROG_LOC_SKIPPED)
+	  blk[i]=locs[loc+i];
+	else
+	  list[n++]=loc+i;
       }
-      ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PROG_DATA_REPLY,&msgin);
-    } while (retries-- > 0 && (ret==1 && msgin.msgnum == NX_NEGATIVE_ACK));
-    if (ret==1) {
-      if (msgin.msgnum == NX_PROG_DATA_REPLY) {
-	//nx_print_msg(stdout,&msgin);
-	
-	nibble=((msgin.msg[1] & 0x10) == 0x10 ? 1 : 0);
-	len=(msgin.msg[3] & 0x1f) + 1;
-	type=(msgin.msg[3] >> 5 & 0x07);
-	if (nibble) size=len/2;
-	else size=len;
-		      
-	//printf("nibble=%d,len=%d,type=%d,size=%d\n",nibble,len,type,size);
-	if (size > 8) {
-	  msgout.msg[1] |= 0x40;
-	  //printf("Reading location %04x offset=1 (%d) [%02x %02x %02x %02x]\n",loc,loc,msgout.msgnum,msgout.msg[0],msgout.msg[1],msgout.msg[2]);
-	  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PROG_DATA_REPLY,&msgin2);
-	  if (ret==1 && msgin2.msgnum == NX_PROG_DATA_REPLY) {
-	    //nx_print_msg(stdout,&msgin2);
-	  } else {
-	    printf("Location=%03d: failed to get full location data (offset=1)\n",loc);
+      ret=read_locations(conn,node,list,n,tmp);
+      if (ret < 0) break;
+      for(i=0;i<n;i++) blk[list[i]-loc]=tmp[i];
+    }
+    else {
+      if (sparse) {
+	/* check first location of the block only */
+	list[0]=loc;
+	ret=read_locations(conn,node,list,1,blk);
+	if (ret < 0) break;
+	if (blk[0].state == PROG_LOC_UNUSED) {
+	  for(i=1;i<count;i++) blk[i].state=PROG_LOC_SKIPPED;
+	} else {
+	  sparse=0;
+	  unused_run=0;
+	  /* used range may have started in the previous (skipped) block */
+	  if (loc-SCAN_BLOCK >= start && locs[loc-1].state == PROG_LOC_SKIPPED) {
+	    loc-=2*SCAN_BLOCK;
+	    continue;
 	  }
 	}
+      }
+      if (!sparse) {
+	for(i=0;i<count;i++) list[i]=loc+i;
+	ret=read_locations(conn,node,list,count,blk);
+	if (ret < 0) break;
+	for(i=0;i<count;i++) {
+	  if (blk[i].state == PROG_LOC_UNUSED) unused_run++;
+	  else unused_run=0;
+	}
+	if (unused_run >= SCAN_UNUSED_RUN) sparse=1;
+      }
+    }
 
-	printf("Location=%03d (len=%02d type=%3s): ",loc,len,nx_prog_datatype_str(type));
-	for(i=0;i<len;i++) {
-	  int va;
-	  if (nibble) {
-	    if (i<16) va=msgin.msg[4+i/2];
-	    else va=msgin2.msg[4+(i-16)/2];
-	    if (i%2==0) {va=0x0f & va; } else { va=(va >> 4) & 0x0f; }
-	  } else {
-	    if (i<8) va=msgin.msg[4+i];
-	    else va=msgin2.msg[4+(i-8)];
-	  }
+    for(i=0;i<count;i++) {
+      nx_prog_location_t *l = &locs[loc+i];
 
-	  switch (type) {
-	  case 0:
-	    printf("[%c%c%c%c%c%c%c%c] ",
-		     (va&0x01?'1':'-'),
-		     (va&0x02?'2':'-'),
-		     (va&0x04?'3':'-'),
-		     (va&0x08?'4':'-'),
-		     (va&0x10?'5':'-'),
-		     (va&0x20?'6':'-'),
-		     (va&0x40?'7':'-'),
-		     (va&0x80?'8':'-')
-		     );
-	    break;
-	  case 1:
-	    if (nibble) printf("%01d ",va);
-	    else printf("%02d ",va);
-	    break;
-	  case 2:
-	    if (nibble) printf("%01x ",va);
-	    else printf("%02x ",va);
-	    break;
-	  case 3:
-	    printf("%c", va);
+      if (known && l->state == PROG_LOC_DATA &&
+	  (blk[i].state != PROG_LOC_DATA || l->len != blk[i].len ||
+	   memcmp(l->data,blk[i].data,PROG_DATA_MAX))) {
+	print_location("- ",loc+i,l);
+	changed++;
+      }
+      *l=blk[i];
+      if (l->state != PROG_LOC_SKIPPED) print_location("",loc+i,l);
+    }
+    fflush(stdout);
+
+    if (fd >= 0) {
+      /* checkpoint */
+      hdr.next=loc+count;
+      hdr.updated=time(NULL);
+      if (pwrite(fd,&locs[loc],count*sizeof(nx_prog_location_t),SNAPSHOT_OFFSET(loc)) < 0 ||
+	  pwrite(fd,&hdr,sizeof(hdr),0) < 0) {
+	warn("failed to write snapshot file: %s",snapshot_file);
+	break;
+      }
+    }
+  }
+
+  for(i=0;i<SNAPSHOT_LOCATIONS;i++)
+    if (locs[i].state <= PROG_LOC_SKIPPED) stats[locs[i].state]++;
+  printf("Scan %s: %d locations read, %d unused, %d failed, %d skipped (%lldms)\n",
+	 (loc < SNAPSHOT_LOCATIONS ? "aborted" : "complete"),
+	 stats[PROG_LOC_DATA],stats[PROG_LOC_UNUSED],stats[PROG_LOC_FAILED],
+	 stats[PROG_LOC_SKIPPED],nx_time_ms()-t_start);
+  if (known)
+    printf("Locations changed since previous scan: %d\n",changed);
+
+  if (fd >= 0) {
+    if (loc >= SNAPSHOT_LOCATIONS) {
+      hdr.pass++;
+      if (pwrite(fd,&hdr,sizeof(hdr),0) < 0)
+	warn("failed to write snapshot file: %s",snapshot_file);
+    }
+    fsync(fd);
+    close(fd);
+  }
+  free(locs);
+
+  return (loc < SNAPSHOT_LOCATIONS ? -4 : 0);
+}
+
+
+/* diff_config_snapshots - display locations that differ between two snapshots */
+int diff_config_snapshots(const char *file1, const char *file2)
+{
+  nx_prog_snapshot_header_t hdr1, hdr2;
+  nx_prog_location_t *locs1, *locs2, *a, *b;
+  int i,ret;
+  int diffs = 0;
+  int unknown = 0;
+
+  locs1=calloc(SNAPSHOT_LOCATIONS,sizeof(nx_prog_location_t));
+  locs2=calloc(SNAPSHOT_LOCATIONS,sizeof(nx_prog_location_t));
+  if (!locs1 || !locs2) {
+    warn("out of memory");
+    free(locs1);
+    free(locs2);
+    return -1;
+  }
+
+  ret=0;
+  if (read_snapshot_file(file1,&hdr1,locs1) < 0) {
+    warn("cannot read snapshot: %s",file1);
+    ret=-2;
+  }
+  else if (read_snapshot_file(file2,&hdr2,locs2) < 0) {
+    warn("cannot read snapshot: %s",file2);
+    ret=-3;
+  }
+  if (ret < 0) {
+    free(locs1);
+    free(locs2);
+    return ret;
+  }
+
+  if (hdr1.node != hdr2.node)
+    printf("Warning: snapshots are of different modules (%u, %u)\n",hdr1.node,hdr2.node);
+
+  for(i=0;i<SNAPSHOT_LOCATIONS;i++) {
+    a=&locs1[i];
+    b=&locs2[i];
+
+    /* only compare locations that have been read in both snapshots */
+    if (a->state != PROG_LOC_DATA && a->state != PROG_LOC_UNUSED) {
+      if (b->state == PROG_LOC_DATA) unknown++;
+      continue;
+    }
+    if (b->state != PROG_LOC_DATA && b->state != PROG_LOC_UNUSED) {
+      if (a->state == PROG_LOC_DATA) unknown++;
+      continue;
+    }
+
+    if (a->state == b->state &&
+	(a->state == PROG_LOC_UNUSED ||
+	 (a->type == b->type && a->nibble == b->nibble && a->len == b->len &&
+	  !memcmp(a->data,b->data,PROG_DATA_MAX))))
+      continue;
+
+    print_location("- ",i,a);
+    print_location("+ ",i,b);
+    diffs++;
+  }
+
+  printf("%d locations differ",diffs);
+  if (unknown > 0) printf(" (%d locations not compared)",unknown);
+  printf("\n");
+
+  free(locs1);
+  free(locs2);
+  return diffs;
+}
+
+
+/* probe timeouts (ms) used once response time of the bus has been learned */
+#define PROBE_MIN_TIMEOUT     250
+#define PROBE_RTT_FACTOR      4
+#define PROBE_RTT_MARGIN      100
+#define PROBE_RTT_SAMPLES     3
+#define PROBE_MAX_RETRY       3
+#define PROBE_PENDING_MAX     16
+
+static const uchar probe_known_modules[] = {
+  NX_MODULE_CONTROL_PANEL,
+  NX_MODULE_NX584E,
+  NX_MODULE_NX540,
+  NX_MODULE_NX2192E,
+  NX_MODULE_NX534,
+  NX_MODULE_NX582,
+  NX_MODULE_NX592E,
+  NX_MODULE_NX590E,
+  NX_MODULE_NX320
+};
+
+
+static int probe_timeout(nx_conn_t *conn, int rtt, int samples)
+{
+  int t;
+
+  if (samples < PROBE_RTT_SAMPLES) return conn->timeout;
+
+  t=rtt*PROBE_RTT_FACTOR + PROBE_RTT_MARGIN;
+  if (t < PROBE_MIN_TIMEOUT) t=PROBE_MIN_TIMEOUT;
+  if (t > conn->timeout) t=conn->timeout;
+  return t;
+}
+
+
+static void probe_add(int *order, int *count, uchar *queued, int node)
+{
+  if (node < 0 || node >= NX_BUS_NODES || queued[node]) return;
+  queued[node]=1;
+  order[(*count)++]=node;
+}
+
+
+static void probe_classify(nx_bus_node_t *n, uchar msgnum)
+{
+  n->reply=msgnum;
+  if (msgnum == NX_MSG_REJECTED) n->state=NX_NODE_REJECTED;
+  else n->state=NX_NODE_ABSENT;
+}
+
+
+/* probe_nodes - send Program Data Request (location 0) to each node in order
+ *
+ * Each node gets a single request (resent only on NAK) and timeout is
+ * shortened once response time of the responding nodes is known. 
+ * Replies that arrive after a node timed out are matched in order: program
+ * data replies carry the node number, while generic replies (command failed,
+ * rejected) are assigned to the oldest request still pending.
+ */
+static int probe_nodes(nx_conn_t *conn, const int *order, int count, nx_bus_node_t *nodes,
+		       int *rtt, int *samples, int adaptive)
+{
+  nxmsg_t msgout,msgin;
+  int pending[PROBE_PENDING_MAX];
+  long long pending_sent[PROBE_PENDING_MAX];
+  int pending_count = 0;
+  long long sent, now, deadline;
+  int i,j,node,tries,ret,done,t;
+  int found = 0;
+  uchar mnum;
+
+  for(i=0;i<=count;i++) {
+    node=(i < count ? order[i] : -1);
+    tries=0;
+
+  resend:
+    if (node >= 0) {
+      msgout.msgnum=NX_PROG_DATA_REQ;
+      msgout.len=4;
+      msgout.msg[0]=node;
+      msgout.msg[1]=0;
+      msgout.msg[2]=0;
+      if (nx_write_packet(conn,&msgout) < 0) return -1;
+      tries++;
+      t=(adaptive ? probe_timeout(conn,*rtt,*samples) : conn->timeout);
+    } else {
+      /* all requests sent, wait for any late replies */
+      if (pending_count < 1) break;
+      t=conn->timeout;
+    }
+    sent=nx_time_ms();
+    deadline=sent+t;
+    done=0;
+
+    while (!done && (now=nx_time_ms()) < deadline) {
+      ret=nx_receive_message(conn,&msgin,deadline-now);
+      if (ret < -1) return -2;
+      if (ret != 1) continue;
+      now=nx_time_ms();
+
+      /* drop pending requests panel should have answered by now */
+      while (pending_count > 0 && now - pending_sent[0] > conn->timeout) {
+	pending_count--;
+	memmove(pending,pending+1,pending_count*sizeof(int));
+	memmove(pending_sent,pending_sent+1,pending_count*sizeof(long long));
+      }
+
+      mnum=msgin.msgnum & NX_MSG_MASK;
+      if (msgin.msgnum == NX_PROG_DATA_REPLY) {
+	int n = msgin.msg[0];
+
+	if (nodes[n].state == NX_NODE_UNKNOWN || nodes[n].state == NX_NODE_NOREPLY) {
+	  nodes[n].state=NX_NODE_PRESENT;
+	  nodes[n].len=(msgin.msg[3] & 0x1f) + 1;
+	  nodes[n].type=(msgin.msg[3] >> 5 & 0x07);
+	  found++;
+	}
+	if (n == node) {
+	  nodes[n].rtt=now-sent;
+	  *rtt=(*samples > 0 ? (*rtt * 7 + nodes[n].rtt) / 8 : nodes[n].rtt);
+	  (*samples)++;
+	  done=1;
+	} else {
+	  for(j=0;j<pending_count;j++) {
+	    if (pending[j] != n) continue;
+	    pending_count--;
+	    memmove(pending+j,pending+j+1,(pending_count-j)*sizeof(int));
+	    memmove(pending_sent+j,pending_sent+j+1,(pending_count-j)*sizeof(long long));
 	    break;
-	  default:
-	    printf("s%d=%02X ",i+1,va);
 	  }
+	  logmsg(2,"probe_bus(): late reply from node %d",n);
+	  if (node < 0 && pending_count < 1) done=1;
 	}
-	printf("\n");
-	
-      } else {
-	if ((msgin.msgnum & NX_MSG_MASK) == NX_MSG_REJECTED) {
-	  printf("Location=%03d: Invalid location (not used)\n",loc);
-	} else {
-	  printf("Location=%03d: failed to get data (reply %02x)\n",loc, msgin.msgnum & NX_MSG_MASK);
+      }
+      else if (msgin.msgnum == mnum &&
+	       (mnum == NX_CMD_FAILED || mnum == NX_MSG_REJECTED || mnum == NX_NEGATIVE_ACK)) {
+	if (mnum == NX_NEGATIVE_ACK) {
+	  /* panel did not accept the (latest) request, send it again */
+	  if (node >= 0 && tries < PROBE_MAX_RETRY) goto resend;
+	  continue;
+	}
+	if (pending_count > 0) {
+	  probe_classify(&nodes[pending[0]],mnum);
+	  pending_count--;
+	  memmove(pending,pending+1,pending_count*sizeof(int));
+	  memmove(pending_sent,pending_sent+1,pending_count*sizeof(long long));
+	  if (node < 0 && pending_count < 1) done=1;
+	} else if (node >= 0) {
+	  probe_classify(&nodes[node],mnum);
+	  done=1;
 	}
       }
-    } else {
-      printf("Location=%03d: no reply\n",loc);
+      else {
+	if (conn->unsolicited) conn->unsolicited(&msgin);
+      }
     }
-    fflush(stdout);
-  }
 
+    if (node >= 0 && !done) {
+      logmsg(3,"probe_bus(): no reply from node %d (timeout %dms)",node,t);
+      nodes[node].state=NX_NODE_NOREPLY;
+      if (pending_count >= PROBE_PENDING_MAX) {
+	pending_count--;
+	memmove(pending,pending+1,pending_count*sizeof(int));
+	memmove(pending_sent,pending_sent+1,pending_count*sizeof(long long));
+      }
+      pending[pending_count]=node;
+      pending_sent[pending_count++]=sent;
+    }
+  }
 
-  return 0;
+  return found;
 }
 
 
-
-int probe_bus(int fd, int protocol)
+int probe_bus(nx_conn_t *conn, int full_scan)
 {
-  nxmsg_t msgout,msgin,msgin2;
-  int ret,len,type;
-  uint node;
+  nx_bus_node_t nodes[NX_BUS_NODES], cache[NX_BUS_NODES];
+  nxmsg_t msgin;
+  int order[NX_BUS_NODES];
+  uchar queued[NX_BUS_NODES];
+  int count = 0;
+  int cached = -1;
+  int rtt = 0;
+  int samples = 0;
+  int i,n,p,ret,changes;
+  long long start;
+
 
   printf("Scanning bus for nodes...\n");
+  start=nx_time_ms();
 
-  for(node=0;node<256;node++) {
-    uint loc = 0;
+  memset(nodes,0,sizeof(nodes));
+  memset(queued,0,sizeof(queued));
 
-    memset(&msgin,0,sizeof(msgin));
-    memset(&msgin2,0,sizeof(msgin2));
+  if (config->topology_file) {
+    cached=load_topology_xml(config->topology_file,cache);
+    if (cached >= 0)
+      printf("Loaded bus topology: %d nodes (%s)\n",cached,config->topology_file);
+  }
 
-    msgout.msgnum=NX_PROG_DATA_REQ;
-    msgout.len=4;
-    msgout.msg[0]=node;
-    msgout.msg[1]=(loc >> 8) & 0x0f;
-    msgout.msg[2]=(loc & 0xff);
+  /* probe most likely addresses first: previously found nodes, known
+     module addresses, and keypads */
+  if (cached >= 0) {
+    for(i=0;i<NX_BUS_NODES;i++)
+      if (cache[i].state == NX_NODE_PRESENT) probe_add(order,&count,queued,i);
+  }
+  for(i=0;i<sizeof(probe_known_modules);i++)
+    probe_add(order,&count,queued,probe_known_modules[i]);
+  for(n=1;n<=8;n++)
+    for(p=1;p<=8;p++)
+      probe_add(order,&count,queued,NX_MODULE_KEYPAD(n,p));
+
+  if (cached < 0 || full_scan) {
+    for(i=0;i<NX_BUS_NODES;i++)
+      probe_add(order,&count,queued,i);
+  }
 
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PROG_DATA_REPLY,&msgin);
-    if (ret==1) {
-      if (msgin.msgnum == NX_PROG_DATA_REPLY) {
-	//nx_print_msg(stdout,&msgin);
-	len=(msgin.msg[3] & 0x1f) + 1;
-	type=(msgin.msg[3] >> 5 & 0x07);
-		      
-	printf("Node=%03d: A DEVICE FOUND! (first location length=%d,type=%s)\n",
-	       node,len,nx_prog_datatype_str(type));
-      } else {
-	printf("Node=%03d: failed to get data (reply %02x)\n",
-	       node, msgin.msgnum & NX_MSG_MASK);
+  /* process any pending messages */
+  do {
+    ret=nx_receive_message(conn,&msgin,0);
+    if (ret==1 && conn->unsolicited) conn->unsolicited(&msgin);
+  } while (ret==1);
+
+  ret=probe_nodes(conn,order,count,nodes,&rtt,&samples,1);
+  if (ret < 0) {
+    warn("bus probe failed: %d",ret);
+    return -1;
+  }
+
+  /* previously found nodes that did not reply (within short timeout)
+     are probed once more using normal timeout */
+  if (cached >= 0) {
+    n=0;
+    for(i=0;i<NX_BUS_NODES;i++) {
+      if (cache[i].state == NX_NODE_PRESENT && nodes[i].state == NX_NODE_NOREPLY) {
+	nodes[i].state=NX_NODE_UNKNOWN;
+	order[n++]=i;
       }
-    } else {
-      printf("Node=%03d: no reply\n",node);
     }
-    fflush(stdout);
+    if (n > 0 && probe_nodes(conn,order,n,nodes,&rtt,&samples,0) < 0) {
+      warn("bus probe failed");
+      return -2;
+    }
+  }
+
+
+  n=0;
+  p=0;
+  changes=0;
+  for(i=0;i<NX_BUS_NODES;i++) {
+    nx_bus_node_t *node = &nodes[i];
+
+    if (!queued[i]) {
+      /* not probed, use cached information */
+      *node=cache[i];
+      continue;
+    }
+    p++;
+
+    switch (node->state) {
+    case NX_NODE_PRESENT:
+      n++;
+      printf("Node=%03d: A DEVICE FOUND! (first location length=%d,type=%s)\n",
+	     i,node->len,nx_prog_datatype_str(node->type));
+      break;
+    case NX_NODE_ABSENT:
+    case NX_NODE_REJECTED:
+      printf("Node=%03d: failed to get data (reply %02x)\n",i,node->reply);
+      break;
+    default:
+      printf("Node=%03d: no reply\n",i);
+    }
+
+    if (cached >= 0 && (node->state == NX_NODE_PRESENT) != (cache[i].state == NX_NODE_PRESENT)) {
+      printf("Node=%03d: %s\n",i,(node->state == NX_NODE_PRESENT ?
+				 "new device (not in saved topology)" : "device missing"));
+      changes++;
+    }
   }
 
+  printf("Bus scan complete: %d devices found, %d nodes probed in %lldms",
+	 n,p,nx_time_ms()-start);
+  if (samples > 0) printf(" (response time %dms)",rtt);
+  printf("\n");
+  if (p < NX_BUS_NODES)
+    printf("%d nodes not probed (absent in saved topology, use --probe-all to scan all)\n",
+	   NX_BUS_NODES-p);
+  if (cached >= 0)
+    printf("Changes since last scan: %d\n",changes);
+  fflush(stdout);
+
+  if (config->topology_file && save_topology_xml(config->topology_file,nodes) == 0)
+    printf("Saved bus topology: %s\n",config->topology_file);
 
   return 0;
 }
 
 
-int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus, int verbose)
+int detect_panel(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int verbose)
 {
   nxmsg_t msgout,msgin;
   int ret,retry,i;
@@ -221,7 +731,7 @@ int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_s
   msgout.len=1;
   retry=0;
   do {
-    ret=nx_send_message(fd,config->serial_protocol,&msgout,5,3,NX_INT_CONFIG_MSG,&msgin);
+    ret=nx_send_message(conn,&msgout,NX_INT_CONFIG_MSG,&msgin);
     if (ret < 0) warn("Failed to send message to panel");
     if (ret == 0) warn("No response from panel");
   } while (ret != 1 && retry++ < 3);
@@ -243,7 +753,7 @@ int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_s
   /* get alarm system status */
   msgout.msgnum=NX_SYS_STATUS_REQ;
   msgout.len=1;
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_SYS_STATUS_MSG,&msgin);
+  ret=nx_send_message(conn,&msgout,NX_SYS_STATUS_MSG,&msgin);
   if (!(ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG)) return -3;
   panel_id=msgin.msg[0];
   printf("Panel ID: %u\n",panel_id);
@@ -257,7 +767,7 @@ int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_s
 
   msgout.msgnum=NX_PART_SNAPSHOT_REQ;
   msgout.len=1;
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PART_SNAPSHOT_MSG,&msgin);
+  ret=nx_send_message(conn,&msgout,NX_PART_SNAPSHOT_MSG,&msgin);
   if (!(ret == 1 && (msgin.msgnum == NX_PART_SNAPSHOT_MSG))) {
     warn("Failed to get Partition status");
     return -5;
@@ -283,7 +793,7 @@ int detect_panel(int fd, int protocol, nx_system_status_t *astat, nx_interface_s
     msgout.msgnum=NX_ZONE_STATUS_REQ;
     msgout.len=2;
     msgout.msg[0]=zonelist[i]-1;
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_ZONE_STATUS_MSG,&msgin);
+    ret=nx_send_message(conn,&msgout,NX_ZONE_STATUS_MSG,&msgin);
     if (ret != 1 || msgin.msgnum != NX_ZONE_STATUS_MSG) {
       if (verbose)
 	printf("no reply for zone %d (%d)\n",zonelist[i],msgin.msgnum);
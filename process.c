@@ -28,6 +28,12 @@
 #include "nx-584.h"
 #include "nxgipd.h"
 
+/* max zones refreshed at a time by refresh_zones() */
+#define ZONE_REFRESH_MAX 8
+
+/* max log entries fetched at a time by sync_log() */
+#define LOG_SYNC_MAX     16
+
 
 
 
@@ -60,15 +66,171 @@
 
 
 
+/* zone debounce state: first status change opens a window, changes
+   inside the window are merged into one summary event */
+typedef struct zone_debounce {
+  time_t start;    /* 0 = no window open */
+  time_t end;
+  time_t last;     /* time of last merged change */
+  int    toggles;  /* status changes merged */
+  int    trip;     /* merged changes include fault/tamper/trouble changes */
+  uint   flags;    /* zone flags when window was opened */
+  uint   state;    /* zone flags after last merged change */
+} zone_debounce_t;
+
+static zone_debounce_t zone_debounce[NX_ZONES_MAX];
+static int zone_debounce_open = 0;
+
+
+/* debounce window (seconds) for a zone, 0 = disabled */
+static int zone_debounce_window(int zonenum, const nx_zone_status_t *zone)
+{
+  int i, w = -1;
+
+  /* alarms from fire and 24-hour zones are always reported immediately */
+  if (zone->type_flags[0] & (NX_ZONE_TYPE_FIRE | NX_ZONE_TYPE_24HOUR)) return 0;
+
+  if (config->debounce_zone[zonenum] >= 0) return config->debounce_zone[zonenum];
+  for (i=0; i<NX_ZONE_TYPE_BITS; i++) {
+    if ((zone->type_flags[0] & (1 << i)) && config->debounce_type[i] > w)
+      w=config->debounce_type[i];
+  }
+  return (w >= 0 ? w : config->debounce_window);
+}
+
+
+/* report summary of status changes merged during debounce window */
+static void zone_debounce_report(nx_system_status_t *astat, int zonenum)
+{
+  zone_debounce_t *d = &zone_debounce[zonenum];
+  nx_zone_status_t *zone = &astat->zones[zonenum];
+  uint s = d->state;
+  char tmp[255];
+  int rule;
+
+  if (d->toggles > 0) {
+    snprintf(tmp,sizeof(tmp),"toggled %d times in %d s, final state %s%s%s%s",
+	     d->toggles+1,(int)(d->last - d->start),
+	     (s & NX_ZONE_FAULT ? "Fault" : "Ok"),
+	     (s & NX_ZONE_TAMPER ? ", Tamper" : ""),
+	     (s & NX_ZONE_TROUBLE ? ", Trouble" : ""),
+	     (s & NX_ZONE_BYPASS ? ", Bypassed" : ""));
+    logmsg(0,"%s zone status: %02d %s: %s",
+	   (s & NX_ZONE_BYPASS ? "bypassed" : (astat->armed ? "armed" : "normal")),
+	   zonenum+1,zone->name,tmp);
+    journal_add(&shm->journal,NX_EVENT_ZONE,zonenum+1,0,
+		d->flags,s,tmp,d->end);
+
+    rule=trigger_rule_match(NX_EVENT_ZONE,zonenum,zone->partition_mask,
+			    d->flags,s);
+    if (config->trigger_enable &&
+	( rule >= 0 ||
+	  (rule == TRIGGER_RULE_DEFAULT &&
+	   ( (d->trip && config->trigger_zone > 0) ||
+	     (config->trigger_zone > 1) ) ) ) )
+      run_zone_trigger(zonenum+1,zone->name,(s & NX_ZONE_FAULT ? 1 : 0),
+		       (s & NX_ZONE_BYPASS ? 1 : 0),(s & NX_ZONE_TROUBLE ? 1 : 0),
+		       (s & NX_ZONE_TAMPER ? 1 : 0),astat->armed,tmp,rule);
+  }
+
+  d->start=0;
+  zone_debounce_open--;
+}
+
+
+/* check if zone status change should be reported now, returns 0 if
+   change was merged into open debounce window (zone is chattering) */
+static int zone_debounce_event(nx_system_status_t *astat, int zonenum, int change, time_t t)
+{
+  zone_debounce_t *d = &zone_debounce[zonenum];
+  nx_zone_status_t *zone = &astat->zones[zonenum];
+  int window;
+
+  /* window has expired: flush it, this change opens a new window */
+  if (d->start && t >= d->end) zone_debounce_report(astat,zonenum);
+
+  if (d->start) {
+    d->toggles++;
+    d->last=t;
+    d->state=nx_zone_flags(zone);
+    if (change) d->trip=1;
+    return 0;
+  }
+
+  if ((window=zone_debounce_window(zonenum,zone)) <= 0) return 1;
+
+  d->start=t;
+  d->end=t+window;
+  d->last=t;
+  d->toggles=0;
+  d->trip=0;
+  d->flags=nx_zone_flags(zone);
+  d->state=d->flags;
+  zone_debounce_open++;
+  return 1;
+}
+
+
+/* report zones whose debounce window has expired (called from main loop) */
+void process_zone_debounce(nx_system_status_t *astat, time_t now)
+{
+  int i;
+
+  if (zone_debounce_open < 1) return;
+
+  for (i=0; i<NX_ZONES_MAX && zone_debounce_open > 0; i++) {
+    if (zone_debounce[i].start && now >= zone_debounce[i].end) {
+      shm_write_begin(shm);
+      zone_debounce_report(astat,i);
+      shm_write_end(shm);
+    }
+  }
+}
+
+
+/* append event to the journal in shared memory */
+void journal_add(nx_journal_t *journal, int kind, int num, int part,
+		 uint old_flags, uint new_flags, const char *text, time_t t)
+{
+  nx_journal_event_t *e;
+  unsigned long seq;
+
+  if (!journal) return;
+
+  seq=journal->head + 1;
+  e=&journal->e[seq & (NX_JOURNAL_SIZE-1)];
+
+  e->seq=0;
+  __sync_synchronize();
+  e->time=t;
+  e->kind=kind;
+  e->part=part;
+  e->num=num;
+  e->old_flags=old_flags;
+  e->new_flags=new_flags;
+  strlcpy(e->text,(text ? text : ""),sizeof(e->text));
+  __sync_synchronize();
+  e->seq=seq;
+  __sync_synchronize();
+  journal->head=seq;
+  shm_changed(shm);
+
+  mqtt_event(kind,num,part,old_flags,new_flags,text,t);
+}
+
+
+
 void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_status_t *astat, nx_interface_status_t *istatus)
 {
   unsigned char msgnum;
-  int i;
+  int i, rule;
 
   if (!msg) return;
 
   if (verbose_mode) nx_print_msg(stdout,msg);
 
+  shm_write_begin(shm);
+
   msgnum = msg->msgnum & NX_MSG_MASK;
 
   switch (msgnum) {
@@ -78,14 +240,17 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
     istatus->version[4]=0;
     memcpy(istatus->sup_trans_msgs,&msg->msg[4],2);
     memcpy(istatus->sup_cmd_msgs,&msg->msg[6],4);
+    shm_changed(shm);
     break;
 
   case NX_ZONE_NAME_MSG:
     {
       int zone = msg->msg[0];
-      if (astat->zones[zone].valid) {
+      if (astat->zones[zone].valid &&
+	  memcmp(astat->zones[zone].name,&msg->msg[1],16)) {
 	memcpy(astat->zones[zone].name,&msg->msg[1],16);
 	astat->zones[zone].name[16]=0;
+	shm_changed(shm);
       }
     }
     break;
@@ -108,6 +273,7 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 	int bypass_mem = (msg->msg[6] & 0x02 ? 1:0);
 	char tmp[255];
 	nx_zone_status_t *zone = &astat->zones[zonenum];
+	uint old_flags = nx_zone_flags(zone);
 	int change=0;
 	int change2=0;
 
@@ -130,23 +296,29 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 
 	if (change || change2) {
 	  zone->last_updated=msg->r_time;
-	  if (!init_mode) {
+	  if (change && !init_mode)
+	    zone->last_tripped=msg->r_time;
+	  if (!init_mode && zone_debounce_event(astat,zonenum,change,msg->r_time)) {
 	    logmsg(0,"%s zone status: %02d %s: %s",
 		   (zone->bypass ? "bypassed" : (astat->armed ? "armed" : "normal")),
 		   zonenum+1,
 		   zone->name,
 		   tmp);
+	    journal_add(&shm->journal,NX_EVENT_ZONE,zonenum+1,0,
+			old_flags,nx_zone_flags(zone),tmp,msg->r_time);
 
-	    if (change)
-	      zone->last_tripped=msg->r_time;
-
+	    rule=trigger_rule_match(NX_EVENT_ZONE,zonenum,zone->partition_mask,
+				    old_flags,nx_zone_flags(zone));
 	    if (config->trigger_enable &&
-		( (change && config->trigger_zone > 0) ||
-		  (config->trigger_zone > 1) ) )
-	      run_zone_trigger(zonenum+1,zone->name,fault,bypass,trouble,tamper,astat->armed,tmp);
+		( rule >= 0 ||
+		  (rule == TRIGGER_RULE_DEFAULT &&
+		   ( (change && config->trigger_zone > 0) ||
+		     (config->trigger_zone > 1) ) ) ) )
+	      run_zone_trigger(zonenum+1,zone->name,fault,bypass,trouble,tamper,astat->armed,tmp,rule);
 	  }
 	}
       	if (zone->last_updated <=0) zone->last_updated=msg->r_time;
+	if (shm) zone_bitmaps_update(&shm->zonemap,zonenum,zone);
       }
     }
     break;
@@ -154,16 +326,17 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 
   case NX_ZONE_SNAPSHOT_MSG:
     {
-      int offset = msg->msg[0];
+      int offset = msg->msg[0] * 16;
       int zonenum;
 
-      for (zonenum=offset; zonenum<offset+16; zonenum++) {
+      for (zonenum=offset; zonenum<offset+16 && zonenum<astat->last_zone; zonenum++) {
 	if (astat->zones[zonenum].valid) {
 	  char tmp[255];
 	  int change = 0;
 	  int change2 = 0;
 	  int fault, bypass, trouble, alarm_mem;
 	  nx_zone_status_t *zone = &astat->zones[zonenum];
+	  uint old_flags = nx_zone_flags(zone);
 	  uchar s = msg->msg[1+((zonenum-offset)/2)];
 
 	  if (zonenum % 2 == 1) s = s >> 4;
@@ -180,22 +353,28 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 
 	  if (change || change2) {
 	    zone->last_updated=msg->r_time;
-	    if (!init_mode) {
+	    if (change && !init_mode)
+	      zone->last_tripped=msg->r_time;
+	    if (!init_mode && zone_debounce_event(astat,zonenum,change,msg->r_time)) {
 	      logmsg(0,"%s zone status (snapshot): %02d %s: %s",
 		     (zone->bypass ? "bypassed" : (astat->armed ? "armed" : "normal")),
 		     zonenum+1,
 		     zone->name,
 		     tmp);
+	      journal_add(&shm->journal,NX_EVENT_ZONE,zonenum+1,0,
+			  old_flags,nx_zone_flags(zone),tmp,msg->r_time);
 
-	      if (change)
-		zone->last_tripped=msg->r_time;
-
+	      rule=trigger_rule_match(NX_EVENT_ZONE,zonenum,zone->partition_mask,
+				      old_flags,nx_zone_flags(zone));
 	      if (config->trigger_enable &&
-		  ( (change && config->trigger_zone > 0) ||
-		    (config->trigger_zone > 1) ) )
-		run_zone_trigger(zonenum+1,zone->name,fault,bypass,trouble,zone->tamper,astat->armed,tmp);
+		  ( rule >= 0 ||
+		    (rule == TRIGGER_RULE_DEFAULT &&
+		     ( (change && config->trigger_zone > 0) ||
+		       (config->trigger_zone > 1) ) ) ) )
+		run_zone_trigger(zonenum+1,zone->name,fault,bypass,trouble,zone->tamper,astat->armed,tmp,rule);
 	    }
 	  }
+	  if (shm) zone_bitmaps_update(&shm->zonemap,zonenum,zone);
 	}
       }
     }
@@ -210,6 +389,7 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
       if (astat->partitions[partnum].valid) {
 	char tmp[1024];
 	nx_partition_status_t *part = &astat->partitions[partnum];
+	uint old_flags = nx_partition_flags(part);
 	int change = 0;
 	int change2 = 0;
 	int p,armed_count;
@@ -302,14 +482,20 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 	  part->last_updated=msg->r_time;
 	  if (!init_mode) {
 	    logmsg(0,"Partition %d status change: %s",partnum+1,tmp);
+	    journal_add(&shm->journal,NX_EVENT_PARTITION,partnum+1,partnum,
+			old_flags,nx_partition_flags(part),tmp,msg->r_time);
 
+	    rule=trigger_rule_match(NX_EVENT_PARTITION,partnum,1 << partnum,
+				    old_flags,nx_partition_flags(part));
 	    if (config->trigger_enable &&
-		( (change && config->trigger_zone > 0) ||
-		  (change2 && config->trigger_zone > 1) )
+		( rule >= 0 ||
+		  (rule == TRIGGER_RULE_DEFAULT &&
+		   ( (change && config->trigger_zone > 0) ||
+		     (change2 && config->trigger_zone > 1) ) ) )
 		) {
 	      run_partition_trigger(partnum+1,tmp,part->armed,part->ready,
 				    part->stay_mode,part->chime_mode,part->entry_delay,
-				    part->exit_delay,part->prev_alarm);
+				    part->exit_delay,part->prev_alarm,rule);
 	    }
 	  }
 	}
@@ -335,6 +521,7 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 	unsigned char v = (s & 0x01 ? 1:0);
 	unsigned char t;
 	nx_partition_status_t *part = &astat->partitions[i];
+	uint old_flags = nx_partition_flags(part);
 	int change = 0;
 	int change2 = 0;
 
@@ -380,14 +567,20 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 	    part->last_updated=msg->r_time;
 	    if (!init_mode) {
 	      logmsg(0,"Partition %d status change: %s",i+1,tmp);
+	      journal_add(&shm->journal,NX_EVENT_PARTITION,i+1,i,
+			  old_flags,nx_partition_flags(part),tmp,msg->r_time);
 
+	      rule=trigger_rule_match(NX_EVENT_PARTITION,i,1 << i,
+				      old_flags,nx_partition_flags(part));
 	      if (config->trigger_enable &&
-		  ( (change && config->trigger_zone > 0) ||
-		    (change2 && config->trigger_zone > 1) )
+		  ( rule >= 0 ||
+		    (rule == TRIGGER_RULE_DEFAULT &&
+		     ( (change && config->trigger_zone > 0) ||
+		       (change2 && config->trigger_zone > 1) ) ) )
 		  ) {
 		run_partition_trigger(i+1,tmp,part->armed,part->ready,
 				      part->stay_mode,part->chime_mode,part->entry_delay,
-				      part->exit_delay,part->prev_alarm);
+				      part->exit_delay,part->prev_alarm,rule);
 	      }
 	    }
 	  }
@@ -506,7 +699,10 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
       LOG_STATUS_CHANGE(astat->listenin_request,(msg->msg[8]&0x40 ? 1:0),change,"Listen in requested",NULL);
       LOG_STATUS_CHANGE(astat->listenin_trigger,(msg->msg[8]&0x80 ? 1:0),change,"Listen in trigger",NULL);
 
-      if (change) astat->last_updated=msg->r_time;
+      if (change) {
+	astat->last_updated=msg->r_time;
+	shm_changed(shm);
+      }
     }
     break;
 
@@ -568,14 +764,25 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
       e->day=msg->msg[6];
       e->hour=msg->msg[7];
       e->min=msg->msg[8];
+      e->last_updated=msg->r_time;
 
       logmsg((NX_IS_NONREPORTING_EVENT(e->type)?1:0),"%s",nx_log_event_str(e));
+      if (init_mode == 0)
+	journal_add(&shm->journal,NX_EVENT_LOG,e->num,e->part,0,e->type,
+		    nx_log_event_str(e),msg->r_time);
+
+      /* panel programming may have been changed (from keypad or via download) */
+      if (init_mode == 0 && (e->type == 46 || e->type == 48))
+	prog_cache_invalidate(&shm->progcache,-1,-1);
 
+      rule=trigger_rule_match(NX_EVENT_LOG,e->type,(e->part < 8 ? 1 << e->part : 0),0,0);
       if (config->trigger_enable &&
-	  ( ((config->trigger_log > 0) && NX_IS_REPORTING_EVENT(e->type)) ||
-	    ((config->trigger_log > 1) && (e->type==40 || e->type==41)) ||
-	    (config->trigger_log > 2) ) ) {
-	run_log_trigger(e);
+	  ( rule >= 0 ||
+	    (rule == TRIGGER_RULE_DEFAULT &&
+	     ( ((config->trigger_log > 0) && NX_IS_REPORTING_EVENT(e->type)) ||
+	       ((config->trigger_log > 1) && (e->type==40 || e->type==41)) ||
+	       (config->trigger_log > 2) ) ) ) ) {
+	run_log_trigger(e,rule);
       }
     }
     break;
@@ -619,11 +826,12 @@ void process_message(nxmsg_t *msg, int init_mode, int verbose_mode, nx_system_st
 
   }
 
+  shm_write_end(shm);
 }
 
 
 
-void process_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 		     nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply)
 {
   nxmsg_t msgout,msgin;
@@ -724,7 +932,7 @@ void process_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
   logmsg(2,"Sending keypad function command: %s (partitions=0x%02x)",funcname,data[2]);
 
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+  ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
   memset(msgout.msg,0,5); // clear buffer so PIN won't be left in memory
   if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
     SET_MSG_REPLY(reply,msg,0,1,
@@ -742,10 +950,11 @@ void process_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
 
 
-void process_keypadmsg_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_keypadmsg_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 			       nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply)
 {
   nxmsg_t msgout,msgin;
+  nx_batch_item_t batch[4];
   int ret,loc;
   int count=0;
   const uchar *data;
@@ -769,22 +978,23 @@ void process_keypadmsg_command(int fd, int protocol, const nx_ipc_msg_t *msg,
   }
 
 
-  msgout.msgnum=NX_KEYPAD_MSG_SEND;
-  msgout.len=12;
-  msgout.msg[0]=data[0];
-  msgout.msg[1]=0;
-
-
   logmsg(1,"Sending keypad text (keypad=%d)...",data[0]);
 
   /* we need to send the text in four 8 character blocks */
+  memset(batch,0,sizeof(batch));
   for (loc=0;loc<4;loc++) {
-    msgout.msg[2]=loc*8;
-    memcpy(&msgout.msg[3],data+2+(loc*8),8);
-
+    batch[loc].req.msgnum=NX_KEYPAD_MSG_SEND;
+    batch[loc].req.len=12;
+    batch[loc].req.msg[0]=data[0];
+    batch[loc].req.msg[1]=0;
+    batch[loc].req.msg[2]=loc*8;
+    memcpy(&batch[loc].req.msg[3],data+2+(loc*8),8);
+    batch[loc].replycmd=NX_POSITIVE_ACK;
+  }
+  nx_send_batch(conn,batch,4,NX_BATCH_STOP_ON_ERROR);
 
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
-    if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
+  for (loc=0;loc<4;loc++) {
+    if (batch[loc].result == 1 && batch[loc].reply.msgnum == NX_POSITIVE_ACK) {
       logmsg(3,"Keypad text message success (keypad=%d loc=%d)",data[0],loc*8);
       count++;
     } else {
@@ -809,7 +1019,7 @@ void process_keypadmsg_command(int fd, int protocol, const nx_ipc_msg_t *msg,
       msgout.msg[0]=data[0];
       msgout.msg[1]=data[1];
 
-      ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+      ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
       if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
 	SET_MSG_REPLY(reply,msg,0,1,"Keypad terminal mode enabled for %d seconds (keypad=%d)",data[1],data[0]);
       } else {
@@ -822,21 +1032,80 @@ void process_keypadmsg_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 }
 
 
-int read_program_data(int fd, int protocol, int device, int location, int mode,
-		      char **datastr, uchar *datatype, uchar *datanibble)
+/* store program data in cache (replaces oldest entry if no free slot found) */
+static void prog_cache_store(nx_prog_cache_t *cache, int device, int location,
+			     const nx_prog_location_t *data)
+{
+  nx_prog_cache_entry_t *e, *slot = NULL;
+  uint key, i;
+
+  if (!cache || !data) return;
+
+  key=PROG_CACHE_KEY(device,location);
+  for(i=0; i < PROG_CACHE_PROBE; i++) {
+    e=&cache->e[(key+i) & (PROG_CACHE_SIZE-1)];
+    if (e->valid && e->device == device && e->location == location) {
+      slot=e;
+      break;
+    }
+    if (!e->valid) {
+      if (!slot || slot->valid) slot=e;
+    }
+    else if (!slot || (slot->valid && e->updated < slot->updated)) {
+      slot=e;
+    }
+  }
+
+  shm_write_begin(shm);
+  if (!slot->valid) cache->entries++;
+  slot->valid=0;
+  slot->device=device;
+  slot->location=location;
+  slot->data=*data;
+  slot->updated=time(NULL);
+  slot->valid=1;
+  shm_write_end(shm);
+}
+
+
+/* invalidate cached program data: single location, all locations of
+   a device (location < 0), or everything (device < 0) */
+void prog_cache_invalidate(nx_prog_cache_t *cache, int device, int location)
+{
+  nx_prog_cache_entry_t *e;
+  int i;
+
+  if (!cache) return;
+
+  shm_write_begin(shm);
+  for(i=0; i < PROG_CACHE_SIZE; i++) {
+    e=&cache->e[i];
+    if (!e->valid) continue;
+    if (device >= 0 && e->device != device) continue;
+    if (location >= 0 && e->location != location) continue;
+    e->valid=0;
+    cache->entries--;
+    cache->invalidations++;
+  }
+  shm_write_end(shm);
+
+  logmsg(3,"program data cache invalidated (device=%d,location=%d)",device,location);
+}
+
+
+int read_program_data(nx_conn_t *conn, int device, int location, nx_prog_location_t *data)
 {
   nxmsg_t msgout,msgin,msgin2;
-  char tmp[16];
-  char buf[1024];
-  int ret,i,nibble,size,len,type;
+  int ret,size;
 
-  if (!datastr || !datatype) return -10;
+  if (!data) return -10;
   if (device < 0 || device > NX_BUS_ADDRESS_MAX) return -11;
   if (location < 0 || location > NX_LOGICAL_LOCATION_MAX) return -12;
 
 
   memset(&msgin,0,sizeof(msgin));
   memset(&msgin2,0,sizeof(msgin2));
+  memset(data,0,sizeof(nx_prog_location_t));
 
   msgout.msgnum=NX_PROG_DATA_REQ;
   msgout.len=4;
@@ -845,109 +1114,150 @@ int read_program_data(int fd, int protocol, int device, int location, int mode,
   msgout.msg[2]=(location & 0xff);
 
 
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PROG_DATA_REPLY,&msgin);
-  if (ret==1 && msgin.msgnum == NX_PROG_DATA_REPLY) {
-    nibble=((msgin.msg[1] & 0x10) == 0x10 ? 1 : 0);
-    len=(msgin.msg[3] & 0x1f) + 1;
-    type=(msgin.msg[3] >> 5 & 0x07);
-    if (nibble)
-      size=len/2;
-    else
-      size=len;
-
-    if (size > 8) {
-      /* there is more data to be read, so request second segment */
-      msgout.msg[1] |= 0x40;
-      ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PROG_DATA_REPLY,&msgin2);
-      if (!(ret==1 && msgin2.msgnum == NX_PROG_DATA_REPLY)) {
-	/* failed to get second data segment */
-	return -2;
-      }
-    }
-  } else {
+  ret=nx_send_message(conn,&msgout,NX_PROG_DATA_REPLY,&msgin);
+  if (!(ret==1 && msgin.msgnum == NX_PROG_DATA_REPLY)) {
     /* failed to get first data segment */
     return -1;
   }
 
+  data->state=PROG_LOC_DATA;
+  data->nibble=((msgin.msg[1] & 0x10) == 0x10 ? 1 : 0);
+  data->len=(msgin.msg[3] & 0x1f) + 1;
+  data->type=(msgin.msg[3] >> 5 & 0x07);
+  data->segments=1;
+  memcpy(data->data,&msgin.msg[4],8);
+  size=(data->nibble ? data->len/2 : data->len);
+
+  if (size > 8) {
+    /* there is more data to be read, so request second segment */
+    msgout.msg[1] |= 0x40;
+    ret=nx_send_message(conn,&msgout,NX_PROG_DATA_REPLY,&msgin2);
+    if (!(ret==1 && msgin2.msgnum == NX_PROG_DATA_REPLY)) {
+      /* failed to get second data segment */
+      return -2;
+    }
+    memcpy(&data->data[8],&msgin2.msg[4],PROG_DATA_MAX-8);
+    data->segments=2;
+  }
+
+  return data->len;
+}
 
 
-  /* reformat the program data */
-  if (type == 3) {
-    buf[0]='"';
-    buf[1]=0;
-  } else {
-    buf[0]=0;
+/* read program data of multiple locations (as a batch), locations that
+   could not be read are marked as unused (rejected) or failed */
+int read_program_data_batch(nx_conn_t *conn, const uchar *devices, const int *locations,
+			    int count, nx_prog_location_t *data)
+{
+  nx_batch_item_t *items, *items2;
+  nx_prog_location_t *l;
+  nxmsg_t *msg;
+  int *idx;
+  int i,n,size,ret;
+
+  if (!devices || !locations || !data) return -10;
+  if (count < 1) return 0;
+
+  items=calloc(count,sizeof(nx_batch_item_t));
+  items2=calloc(count,sizeof(nx_batch_item_t));
+  idx=calloc(count,sizeof(int));
+  if (!items || !items2 || !idx) {
+    free(items);
+    free(items2);
+    free(idx);
+    return -11;
   }
 
-  for(i=0;i<len;i++) {
-    int va;
-    if (nibble) {
-      if (i<16) va=msgin.msg[4+i/2];
-      else va=msgin2.msg[4+(i-16)/2];
-      if (i%2==0) {va=0x0f & va; } else { va=(va >> 4) & 0x0f; }
-    } else {
-      if (i<8) va=msgin.msg[4+i];
-      else va=msgin2.msg[4+(i-8)];
-    }
+  for(i=0;i<count;i++) {
+    items[i].req.msgnum=NX_PROG_DATA_REQ;
+    items[i].req.len=4;
+    items[i].req.msg[0]=devices[i];
+    items[i].req.msg[1]=(locations[i] >> 8) & 0x0f;
+    items[i].req.msg[2]=(locations[i] & 0xff);
+    items[i].replycmd=NX_PROG_DATA_REPLY;
+  }
+  ret=nx_send_batch(conn,items,count,0);
 
-    if (mode > 0) {
-      switch (type) {
-      case 0:
-	// binary
-	snprintf(tmp,sizeof(tmp),"[%c%c%c%c%c%c%c%c] ",
-		 (va&0x01?'1':'-'),
-		 (va&0x02?'2':'-'),
-		 (va&0x04?'3':'-'),
-		 (va&0x08?'4':'-'),
-		 (va&0x10?'5':'-'),
-		 (va&0x20?'6':'-'),
-		 (va&0x40?'7':'-'),
-		 (va&0x80?'8':'-')
-		 );
-	break;
-      case 1:
-	// decimal
-	if (nibble) snprintf(tmp,sizeof(tmp),"%01d ",va);
-	else snprintf(tmp,sizeof(tmp),"%02d ",va);
-	break;
-      case 2:
-	// hexadecimal
-	if (nibble) snprintf(tmp,sizeof(tmp),"%01x ",va);
-	else snprintf(tmp,sizeof(tmp),"%02x ",va);
-	break;
-      case 3:
-	// ASCII
-	snprintf(tmp,sizeof(tmp),"%c", va);
-	break;
-      default:
-	snprintf(tmp,sizeof(tmp),"%02X ",va);
+  n=0;
+  for(i=0;ret >= 0 && i<count;i++) {
+    l=&data[i];
+    msg=&items[i].reply;
+    memset(l,0,sizeof(nx_prog_location_t));
+
+    if (items[i].result != 1) {
+      l->state=PROG_LOC_FAILED;
+    }
+    else if (msg->msgnum == NX_PROG_DATA_REPLY) {
+      l->state=PROG_LOC_DATA;
+      l->nibble=((msg->msg[1] & 0x10) == 0x10 ? 1 : 0);
+      l->len=(msg->msg[3] & 0x1f) + 1;
+      l->type=(msg->msg[3] >> 5 & 0x07);
+      l->segments=1;
+      memcpy(l->data,&msg->msg[4],8);
+      size=(l->nibble ? l->len/2 : l->len);
+      if (size > 8) {
+	/* rest of the data is in the second segment */
+	items2[n].req=items[i].req;
+	items2[n].req.msg[1] |= 0x40;
+	items2[n].replycmd=NX_PROG_DATA_REPLY;
+	idx[n++]=i;
       }
-    } else {
-      snprintf(tmp,sizeof(tmp),"%02x",va);
     }
+    else {
+      l->reply=msg->msgnum & NX_MSG_MASK;
+      l->state=(l->reply == NX_MSG_REJECTED ? PROG_LOC_UNUSED : PROG_LOC_FAILED);
+    }
+  }
 
-    strlcat(buf,tmp,sizeof(buf));
+  if (ret >= 0 && n > 0) {
+    ret=nx_send_batch(conn,items2,n,0);
+    for(i=0;ret >= 0 && i<n;i++) {
+      if (items2[i].result == 1 && items2[i].reply.msgnum == NX_PROG_DATA_REPLY) {
+	memcpy(&data[idx[i]].data[8],&items2[i].reply.msg[4],PROG_DATA_MAX-8);
+	data[idx[i]].segments=2;
+      }
+    }
   }
 
-  if (type == 3)
-    strlcat(buf,"\"",sizeof(buf));
+  free(items);
+  free(items2);
+  free(idx);
 
-  *datatype = type;
-  *datanibble = nibble;
-  *datastr = strdup(buf);
-  if (!datastr) return -3;
+  return (ret < 0 ? -1 : count);
+}
 
-  return len;
+
+/* get program data from cache, or from the panel (and update cache) */
+static int get_program_data(nx_conn_t *conn, int device, int location, int refresh,
+			    nx_prog_location_t *data)
+{
+  const nx_prog_cache_entry_t *e;
+  int ret;
+
+  if (!refresh && (e=prog_cache_lookup(&shm->progcache,device,location))) {
+    *data=e->data;
+    shm_write_begin(shm);
+    shm->progcache.hits++;
+    shm_write_end(shm);
+    return data->len;
+  }
+  shm_write_begin(shm);
+  shm->progcache.misses++;
+  shm_write_end(shm);
+
+  ret=read_program_data(conn,device,location,data);
+  if (ret > 0)
+    prog_cache_store(&shm->progcache,device,location,data);
+  return ret;
 }
 
 
-void process_get_program_command(int fd, int protocol, const nx_ipc_msg_t *msg, nx_interface_status_t *istatus,
+void process_get_program_command(nx_conn_t *conn, const nx_ipc_msg_t *msg, nx_interface_status_t *istatus,
 				 nx_ipc_msg_reply_t *reply)
 {
-  int ret,loc;
-  char *datastr = NULL;
-  uchar datatype = 0;
-  uchar datanibble = 0;
+  int ret,loc,refresh;
+  nx_prog_location_t prog;
+  char datastr[512];
   const uchar* data;
 
   if (!msg || !istatus || !reply) return;
@@ -955,6 +1265,7 @@ void process_get_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
   data=msg->data;
 
   loc = (data[1]&0xf)<<8 | data[2];
+  refresh = (data[3] & NX_IPC_PROG_REFRESH);
 
   if ((istatus->sup_cmd_msgs[2] & 0x01) == 0) {
     SET_MSG_REPLY(reply,msg,-1,0,
@@ -963,15 +1274,15 @@ void process_get_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
     return;
   }
 
-  logmsg(1,"Sending Program Data Request (device=%d,location=%d)...",data[0],loc);
+  logmsg(1,"Sending Program Data Request (device=%d,location=%d%s)...",data[0],loc,
+	 (refresh ? ",refresh" : ""));
 
-  ret = read_program_data(fd,protocol,data[0],loc,1,
-			  &datastr,&datatype,&datanibble);
+  ret = get_program_data(conn,data[0],loc,refresh,&prog);
   if (ret > 0) {
+    format_program_data(&prog,datastr,sizeof(datastr));
     SET_MSG_REPLY(reply,msg,0,1,
 		  "Program data (dev=%03d,loc=%03d,len=%02d,type=%s): %s",
-		  data[0],loc,ret,nx_prog_datatype_str(datatype),datastr);
-    free(datastr);
+		  data[0],loc,ret,nx_prog_datatype_str(prog.type),datastr);
   } else {
     SET_MSG_REPLY(reply,msg,1,0,
 		      "Program Data Request failed (device=%d,location=%d).",data[0],loc);
@@ -980,12 +1291,46 @@ void process_get_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 }
 
 
-void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg, nx_interface_status_t *istatus,
+/* build Program Data Command message(s) for a location, returns number
+   of data bytes (second message is needed if more than 8) */
+static int build_program_commands(int device, int location, int type, int nibble, int len,
+				  const uchar *values, nxmsg_t *msg1, nxmsg_t *msg2)
+{
+  int i;
+  int outcount = 0;
+
+  memset(msg1,0,sizeof(nxmsg_t));
+  msg1->msgnum=NX_PROG_DATA_CMD;
+  msg1->len=13;
+  msg1->msg[0]=device;
+  msg1->msg[1]=(nibble?0x10:0x00)|0x20|((location >> 8) & 0x0f);
+  msg1->msg[2]=(location & 0xff);
+  msg1->msg[3]=((type & 0x07)<<5)|((len-1) & 0x01f);
+
+  memcpy(msg2,msg1,sizeof(nxmsg_t));
+  msg2->msg[1] |= 0x40;
+
+  for(i=0; i < len; (nibble ? i+=2 : i++)) {
+    uchar *p = (outcount < 8 ? &msg1->msg[4+outcount] : &msg2->msg[4+(outcount-8)]);
+    if (nibble) {
+      *p= ((values[i+1] & 0x0f) << 4) | (values[i] & 0x0f);
+    } else {
+      *p=values[i];
+    }
+    outcount++;
+  }
+
+  return outcount;
+}
+
+
+void process_set_program_command(nx_conn_t *conn, const nx_ipc_msg_t *msg, nx_interface_status_t *istatus,
 				 nx_ipc_msg_reply_t *reply)
 {
   nxmsg_t msgout,msgout2,msgin;
-  int ret,loc,i;
-  char *datastr = NULL;
+  int ret,loc;
+  nx_prog_location_t prog;
+  char datastr[512];
   uchar datatype = 0;
   uchar datanibble = 0;
   int datalen = 0;
@@ -1021,14 +1366,15 @@ void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
     datalen=0;
   } else {
 
-    ret = read_program_data(fd,protocol,data[0],loc,1,
-			  &datastr,&datatype,&datanibble);
+    ret = get_program_data(conn,data[0],loc,0,&prog);
     if (ret > 0) {
       datalen=ret;
+      datatype=prog.type;
+      datanibble=prog.nibble;
 
+      format_program_data(&prog,datastr,sizeof(datastr));
       logmsg(2,"Current Program data (dev=%03d,loc=%03d,len=%02d,type=%s): %s",
 	     data[0],loc,ret,nx_prog_datatype_str(datatype),datastr);
-      free(datastr);
     } else {
       SET_MSG_REPLY(reply,msg,1,0,
 		    "Program Data Request failed (device=%d,location=%d)",data[0],loc);
@@ -1064,31 +1410,18 @@ void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
   /* prepare program commands */
 
-  memset(&msgout,0,sizeof(msgout));
-  msgout.msgnum=NX_PROG_DATA_CMD;
-  msgout.len=13;
-  msgout.msg[0]=data[0];
-  msgout.msg[1]=(datanibble?0x10:0x00)|0x20|(data[1] & 0x0f);
-  msgout.msg[2]=data[2];
-  msgout.msg[3]=((datatype & 0x07)<<5)|((datalen-1) & 0x01f);
-
-  memcpy(&msgout2,&msgout,sizeof(msgout2));
-  msgout2.msg[1] |= 0x40;
-
-  for(i=0; i < datalen; (datanibble ? i+=2 : i++)) {
-    uchar *p = (outcount < 8 ? &msgout.msg[4+outcount] : &msgout2.msg[4+(outcount-8)]);
-    if (datanibble) {
-      *p= ((data[i+6] & 0x0f) << 4) | (data[i+5] & 0x0f);
-    } else {
-      *p=data[5+i];
-    }
-    outcount++;
-  }
+  outcount=build_program_commands(data[0],loc,datatype,datanibble,datalen,&data[5],
+				  &msgout,&msgout2);
 
 
   /* send first program command */
 
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+  if (loc == 910)
+    prog_cache_invalidate(&shm->progcache,data[0],-1);
+  else
+    prog_cache_invalidate(&shm->progcache,data[0],loc);
+
+  ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
   if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK && loc != 910) {
     logmsg(3,"Program Data Command (#1) succeeded");
   } else {
@@ -1105,7 +1438,7 @@ void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
   /* send seconf program command (if needed) */
 
   if (outcount > 8) {
-    ret=nx_send_message(fd,protocol,&msgout2,5,3,NX_POSITIVE_ACK,&msgin);
+    ret=nx_send_message(conn,&msgout2,NX_POSITIVE_ACK,&msgin);
     if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
       logmsg(3,"Program Data Command (#2) succeeded");
     } else {
@@ -1122,14 +1455,13 @@ void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
   /* re-read programmed location to verify the new contents... */
 
-  ret = read_program_data(fd,protocol,data[0],loc,1,
-			  &datastr,&datatype,&datanibble);
+  ret = get_program_data(conn,data[0],loc,1,&prog);
   if (ret > 0) {
     datalen=ret;
 
+    format_program_data(&prog,datastr,sizeof(datastr));
     SET_MSG_REPLY(reply,msg,0,1,"Programming complete (dev=%03d,loc=%03d,len=%02d,type=%s): %s",
-		  data[0],loc,ret,nx_prog_datatype_str(datatype),datastr);
-    free(datastr);
+		  data[0],loc,ret,nx_prog_datatype_str(prog.type),datastr);
   } else {
     SET_MSG_REPLY(reply,msg,5,0,
 		      "Programming complete, but Program Data Request failed (device=%d,location=%d)",data[0],loc);
@@ -1139,7 +1471,180 @@ void process_set_program_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 }
 
 
-void process_zone_bypass_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+/* get value (byte or nibble) from program data */
+static int prog_data_value(const nx_prog_location_t *data, int i)
+{
+  if (!data->nibble) return data->data[i];
+  return (i%2 == 0 ? data->data[i/2] & 0x0f : (data->data[i/2] >> 4) & 0x0f);
+}
+
+
+void process_set_program_batch_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
+				       nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply)
+{
+  uchar devices[NX_PROG_BATCH_MAX], mdevices[NX_PROG_BATCH_MAX];
+  int locations[NX_PROG_BATCH_MAX], mlocations[NX_PROG_BATCH_MAX];
+  int midx[NX_PROG_BATCH_MAX], owner[NX_PROG_BATCH_MAX*2];
+  uchar values[NX_PROG_BATCH_MAX][PROG_DATA_MAX+1];
+  uchar types[NX_PROG_BATCH_MAX], lens[NX_PROG_BATCH_MAX];
+  nx_prog_location_t cur[NX_PROG_BATCH_MAX], tmp[NX_PROG_BATCH_MAX];
+  nx_batch_item_t *items;
+  const nx_prog_cache_entry_t *e;
+  char codes[NX_PROG_BATCH_MAX+1];
+  const uchar *data, *p, *end;
+  int count,check,i,j,n,ret,invalid,ok;
+  long long start;
+
+  if (!msg || !istatus || !reply) return;
+
+  data=msg->data;
+  count=data[0] & ~NX_PROG_BATCH_CHECK;
+  check=(data[0] & NX_PROG_BATCH_CHECK ? 1 : 0);
+
+  if ((istatus->sup_cmd_msgs[2] & 0x03) != 0x03) {
+    SET_MSG_REPLY(reply,msg,-1,0,
+		  "Program Data Request/Command not enabled. Message not sent.");
+    return;
+  }
+
+  if (count < 1 || count > NX_PROG_BATCH_MAX) {
+    SET_MSG_REPLY(reply,msg,-2,0,"Invalid program batch size: %d",count);
+    return;
+  }
+
+  /* unpack (device,location,type,len,values) tuples */
+  p=&data[1];
+  end=data + NX_IPC_MSG_DATA_LEN;
+  for(i=0; i<count; i++) {
+    if (p + 5 > end || p[4] > PROG_DATA_MAX || p + 5 + p[4] > end) {
+      SET_MSG_REPLY(reply,msg,-2,0,"Invalid program batch message (location %d)",i+1);
+      return;
+    }
+    devices[i]=p[0];
+    locations[i]=(p[1] & 0x0f) << 8 | p[2];
+    types[i]=p[3];
+    lens[i]=p[4];
+    memset(values[i],(types[i] == 3 ? ' ' : 0),sizeof(values[i]));
+    memcpy(values[i],&p[5],lens[i]);
+    p+=5+lens[i];
+  }
+
+  logmsg(2,"Start %s batch (%d locations)...",(check ? "Checking" : "Programming"),count);
+  start=nx_time_ms();
+
+
+  /* get current data type and length of locations
+     (from cache, or from the panel as a batch) */
+  n=0;
+  shm_write_begin(shm);
+  for(i=0; i<count; i++) {
+    if ((e=prog_cache_lookup(&shm->progcache,devices[i],locations[i]))) {
+      cur[i]=e->data;
+      shm->progcache.hits++;
+    } else {
+      mdevices[n]=devices[i];
+      mlocations[n]=locations[i];
+      midx[n++]=i;
+    }
+  }
+  shm->progcache.misses+=n;
+  shm_write_end(shm);
+  if (n > 0) {
+    if (read_program_data_batch(conn,mdevices,mlocations,n,tmp) < 0) {
+      SET_MSG_REPLY(reply,msg,1,0,"Program Data Request failed (batch)");
+      return;
+    }
+    for(j=0; j<n; j++) {
+      cur[midx[j]]=tmp[j];
+      if (tmp[j].state == PROG_LOC_DATA)
+	prog_cache_store(&shm->progcache,mdevices[j],mlocations[j],&tmp[j]);
+    }
+  }
+
+
+  /* validate all locations before programming any */
+  invalid=0;
+  for(i=0; i<count; i++) {
+    codes[i]='0' + NX_PROG_BATCH_OK;
+    if (cur[i].state != PROG_LOC_DATA || locations[i] == 910)
+      codes[i]='0' + NX_PROG_BATCH_READ_FAIL;
+    else if (types[i] != cur[i].type)
+      codes[i]='0' + NX_PROG_BATCH_TYPE;
+    else if (types[i] == 3 ? lens[i] > cur[i].len : lens[i] != cur[i].len)
+      codes[i]='0' + NX_PROG_BATCH_LENGTH;
+    if (codes[i] != '0' + NX_PROG_BATCH_OK) invalid++;
+  }
+  codes[count]=0;
+
+  if (invalid > 0) {
+    for(i=0; i<count; i++)
+      if (codes[i] == '0' + NX_PROG_BATCH_OK) codes[i]='0' + NX_PROG_BATCH_SKIPPED;
+    SET_MSG_REPLY(reply,msg,1,0,"Program batch rejected: %d/%d locations invalid [%s]",
+		  invalid,count,codes);
+    return;
+  }
+
+  if (check) {
+    SET_MSG_REPLY(reply,msg,0,2,"Program batch check: %d/%d locations ok [%s]",
+		  count,count,codes);
+    return;
+  }
+
+
+  /* send all program commands */
+  if (!(items=calloc(count*2,sizeof(nx_batch_item_t)))) {
+    SET_MSG_REPLY(reply,msg,-3,0,"Program batch failed: out of memory");
+    return;
+  }
+  n=0;
+  for(i=0; i<count; i++) {
+    prog_cache_invalidate(&shm->progcache,devices[i],locations[i]);
+    ret=build_program_commands(devices[i],locations[i],types[i],cur[i].nibble,cur[i].len,
+			       values[i],&items[n].req,&items[n+1].req);
+    items[n].replycmd=NX_POSITIVE_ACK;
+    owner[n++]=i;
+    if (ret > 8) {
+      items[n].replycmd=NX_POSITIVE_ACK;
+      owner[n++]=i;
+    }
+  }
+  nx_send_batch(conn,items,n,0);
+  for(j=0; j<n; j++) {
+    if (!(items[j].result == 1 && items[j].reply.msgnum == NX_POSITIVE_ACK))
+      codes[owner[j]]='0' + NX_PROG_BATCH_WRITE_FAIL;
+  }
+  free(items);
+
+
+  /* verify all locations */
+  ret=read_program_data_batch(conn,devices,locations,count,tmp);
+  ok=0;
+  for(i=0; i<count; i++) {
+    if (codes[i] != '0' + NX_PROG_BATCH_OK) continue;
+    if (ret < 0 || tmp[i].state != PROG_LOC_DATA) {
+      codes[i]='0' + NX_PROG_BATCH_VERIFY_READ;
+      continue;
+    }
+    prog_cache_store(&shm->progcache,devices[i],locations[i],&tmp[i]);
+
+    for(j=0; j<cur[i].len; j++)
+      if (prog_data_value(&tmp[i],j) != (cur[i].nibble ? values[i][j] & 0x0f : values[i][j]))
+	break;
+    if (j < cur[i].len || tmp[i].len != cur[i].len || tmp[i].type != types[i]) {
+      codes[i]='0' + NX_PROG_BATCH_VERIFY_FAIL;
+      continue;
+    }
+    ok++;
+  }
+
+  logmsg(2,"Programming batch complete (%d/%d locations ok, %lldms)",
+	 ok,count,nx_time_ms()-start);
+  SET_MSG_REPLY(reply,msg,(ok == count ? 0 : 2),1,
+		"Program batch complete: %d/%d locations ok [%s]",ok,count,codes);
+}
+
+
+void process_zone_bypass_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 				 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply)
 {
   nxmsg_t msgout,msgin;
@@ -1163,7 +1668,7 @@ void process_zone_bypass_command(int fd, int protocol, const nx_ipc_msg_t *msg,
   msgout.len=2;
   msgout.msg[0]=data[0];
 
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+  ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
   if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
     SET_MSG_REPLY(reply,msg,0,1,"Zone Bypass Toggle success: Zone=%d",data[0]+1);
   } else {
@@ -1174,7 +1679,7 @@ void process_zone_bypass_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
 
 
-void process_x10_command(int fd, int protocol, const nx_ipc_msg_t *msg,
+void process_x10_command(nx_conn_t *conn, const nx_ipc_msg_t *msg,
 			 nx_interface_status_t *istatus, nx_ipc_msg_reply_t *reply)
 {
   nxmsg_t msgout,msgin;
@@ -1206,7 +1711,7 @@ void process_x10_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 
   logmsg(2,"Sending X-10 Message (house=%c, unit=%d, func=%02x)...",house,unit,data[2]);
 
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+  ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
   if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
     SET_MSG_REPLY(reply,msg,0,1,"Send X-10 Message success: House=%c, Unit=%d, Function=%02x",house,unit,data[2]);
   } else {
@@ -1216,7 +1721,7 @@ void process_x10_command(int fd, int protocol, const nx_ipc_msg_t *msg,
 }
 
 
-int process_set_clock(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus)
+int process_set_clock(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus)
 {
   nxmsg_t msgout,msgin;
   struct tm tt;
@@ -1262,7 +1767,7 @@ int process_set_clock(int fd, int protocol, nx_system_status_t *astat, nx_interf
     logmsg(2,"setting panel time to: %02d-%02d-%02d %02d:%02d weekday=%d",
 	   msgout.msg[0],msgout.msg[1],msgout.msg[2],msgout.msg[3],
 	   msgout.msg[4],msgout.msg[5]);
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_POSITIVE_ACK,&msgin);
+    ret=nx_send_message(conn,&msgout,NX_POSITIVE_ACK,&msgin);
     if (ret == 1 && msgin.msgnum == NX_POSITIVE_ACK) {
       logmsg(1,"panel clock synchronized successfully");
     } else {
@@ -1280,11 +1785,12 @@ int process_set_clock(int fd, int protocol, nx_system_status_t *astat, nx_interf
 
 
 
-int dump_log(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus)
+int dump_log(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus)
 {
   int ret;
   nxmsg_t msgout,msgin;
-  int i = 0;
+  nx_batch_item_t *batch;
+  int i, count;
   int last = 255;
 
   if ((istatus->sup_cmd_msgs[1] & 0x04) == 0) {
@@ -1295,31 +1801,73 @@ int dump_log(int fd, int protocol, nx_system_status_t *astat, nx_interface_statu
 
   logmsg(0,"Fetching log entries from alarm...");
 
-  while (i < last) {
-    msgout.msgnum=NX_LOG_EVENT_REQ;
-    msgout.len=2;
-    msgout.msg[0]=i;
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_LOG_EVENT_MSG,&msgin);
-    if (ret==1 && msgin.msgnum == NX_LOG_EVENT_MSG) {
-      process_message(&msgin,0,0,astat,istatus);
-      last=msgin.msg[1];
+  /* get first entry to find out the log size */
+  msgout.msgnum=NX_LOG_EVENT_REQ;
+  msgout.len=2;
+  msgout.msg[0]=0;
+  ret=nx_send_message(conn,&msgout,NX_LOG_EVENT_MSG,&msgin);
+  if (ret==1 && msgin.msgnum == NX_LOG_EVENT_MSG) {
+    process_message(&msgin,0,0,astat,istatus);
+    last=msgin.msg[1];
+  } else {
+    logmsg(0,"failed to get log entry: %d",0);
+  }
+
+  /* request rest of the entries as a batch */
+  count=last-1;
+  if (count < 1) return 0;
+  if (!(batch=calloc(count,sizeof(nx_batch_item_t)))) {
+    logmsg(0,"dump_log(): out of memory");
+    return -2;
+  }
+  for (i=0; i<count; i++) {
+    batch[i].req.msgnum=NX_LOG_EVENT_REQ;
+    batch[i].req.len=2;
+    batch[i].req.msg[0]=i+1;
+    batch[i].replycmd=NX_LOG_EVENT_MSG;
+  }
+  nx_send_batch(conn,batch,count,0);
+
+  for (i=0; i<count; i++) {
+    if (batch[i].result == 1 && batch[i].reply.msgnum == NX_LOG_EVENT_MSG) {
+      process_message(&batch[i].reply,0,0,astat,istatus);
     } else {
-      logmsg(0,"failed to get log entry: %d",i);
+      logmsg(0,"failed to get log entry: %d",i+1);
     }
-    i++;
   }
+  free(batch);
+
+  /* whole log was just fetched, so continue from current log position */
+  astat->log_cursor=astat->comm_stack_ptr;
+  astat->log_sync_target=-1;
 
   return 0;
 }
 
 
 
-int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interface_status_t *istatus)
+static void set_status_intervals(nx_system_status_t *astat, nx_interface_status_t *istatus)
+{
+  astat->statuscheck_interval = (config->statuscheck > 0 ? config->statuscheck : 30);
+  astat->timesync_interval = (config->timesync > 0 ? config->timesync : 0);
+  astat->savestatus_interval = (config->status_save_interval > 0 ? config->status_save_interval : 0);
+
+  if ( (astat->timesync_interval > 0) &&
+       ((istatus->sup_cmd_msgs[3] & 0x08) == 0) ) {
+    logmsg(0,"Set Clock / Calendar command not enabled. Disabling clock sync.");
+    astat->timesync_interval=0;
+  }
+}
+
+
+int get_system_status(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus)
 {
   int ret;
   nxmsg_t msgout,msgin;
   int skip_zone_names = 0;
-  int i;
+  int i, count;
+  nx_batch_item_t *batch;
+  long long start;
 
 
   /* default make sure all zones/partitions are disabled initially */
@@ -1335,15 +1883,7 @@ int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interf
   astat->last_partition=((config->partitions > 0 && config->partitions < NX_PARTITIONS_MAX) ?
 			 config->partitions : NX_PARTITIONS_MAX);
 
-  astat->statuscheck_interval = (config->statuscheck > 0 ? config->statuscheck : 30);
-  astat->timesync_interval = (config->timesync > 0 ? config->timesync : 0);
-  astat->savestatus_interval = (config->status_save_interval > 0 ? config->status_save_interval : 0);
-
-  if ( (astat->timesync_interval > 0) &&
-       ((istatus->sup_cmd_msgs[3] & 0x08) == 0) ) {
-    logmsg(0,"Set Clock / Calendar command not enabled. Disabling clock sync.");
-    astat->timesync_interval=0;
-  }
+  set_status_intervals(astat,istatus);
 
 
   /* make sure that basic commands are enabled in NX interface */
@@ -1369,11 +1909,19 @@ int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interf
   }
 
 
+  if (!(batch=calloc(NX_ZONES_MAX,sizeof(nx_batch_item_t)))) {
+    logmsg(0,"get_system_status(): out of memory");
+    return -6;
+  }
+
   /* get alarm system status */
   msgout.msgnum=NX_SYS_STATUS_REQ;
   msgout.len=1;
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_SYS_STATUS_MSG,&msgin);
-  if (!(ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG)) return -1;
+  ret=nx_send_message(conn,&msgout,NX_SYS_STATUS_MSG,&msgin);
+  if (!(ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG)) {
+    free(batch);
+    return -1;
+  }
   process_message(&msgin,0,0,astat,istatus);
 
 
@@ -1381,19 +1929,30 @@ int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interf
   logmsg(0,"Querying partition statuses...");
   msgout.msgnum=NX_PART_SNAPSHOT_REQ;
   msgout.len=1;
-  ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PART_SNAPSHOT_MSG,&msgin);
-  if (!(ret == 1 && msgin.msgnum == NX_PART_SNAPSHOT_MSG)) return -2;
+  ret=nx_send_message(conn,&msgout,NX_PART_SNAPSHOT_MSG,&msgin);
+  if (!(ret == 1 && msgin.msgnum == NX_PART_SNAPSHOT_MSG)) {
+    free(batch);
+    return -2;
+  }
   process_message(&msgin,0,0,astat,istatus);
 
+  count=0;
   for(i=0;i<astat->last_partition;i++) {
     if (astat->partitions[i].valid) {
-      msgout.msgnum=NX_PART_STATUS_REQ;
-      msgout.len=2;
-      msgout.msg[0]=i;
-      ret=nx_send_message(fd,protocol,&msgout,5,3,NX_PART_STATUS_MSG,&msgin);
-      if (!(ret == 1 && msgin.msgnum == NX_PART_STATUS_MSG)) return -3;
-      process_message(&msgin,0,0,astat,istatus);
+      batch[count].req.msgnum=NX_PART_STATUS_REQ;
+      batch[count].req.len=2;
+      batch[count].req.msg[0]=i;
+      batch[count].replycmd=NX_PART_STATUS_MSG;
+      count++;
+    }
+  }
+  nx_send_batch(conn,batch,count,NX_BATCH_STOP_ON_ERROR);
+  for (i=0; i<count; i++) {
+    if (!(batch[i].result == 1 && batch[i].reply.msgnum == NX_PART_STATUS_MSG)) {
+      free(batch);
+      return -3;
     }
+    process_message(&batch[i].reply,0,0,astat,istatus);
   }
 
 
@@ -1401,39 +1960,91 @@ int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interf
   /* get zone info & names */
   astat->last_zone=((config->zones > 0 && config->zones <= NX_ZONES_MAX) ? config->zones : 48);
   logmsg(0,"Querying zone names and statuses...");
+  start=nx_time_ms();
 
   for (i=0;i<astat->last_zone;i++) {
     astat->zones[i].valid=1;
+    snprintf(astat->zones[i].name,sizeof(astat->zones[i].name),"Zone %02d",i+1);
+  }
 
-    /* get zone name */
-    if (skip_zone_names) {
-      snprintf(astat->zones[i].name,sizeof(astat->zones[i].name),"Zone %02d",i+1);
+  astat->zone_refresh=astat->last_zone;
+
+
+  /* fast start: get zone statuses using zone snapshots and restore zone
+     names from status file, rest of zone info is fetched in background */
+  if (config->fast_start) {
+    ret=-1;
+    if ((istatus->sup_cmd_msgs[0] & 0x20) == 0) {
+      logmsg(0,"Zones Snapshot Request command not enabled. Fast start disabled.");
+    } else if (config->status_file &&
+	       (ret=load_zone_names(config->status_file,astat)) == astat->last_zone) {
+      count=(astat->last_zone+15)/16;
+      for (i=0;i<count;i++) {
+	batch[i].req.msgnum=NX_ZONE_SNAPSHOT_REQ;
+	batch[i].req.len=2;
+	batch[i].req.msg[0]=i;
+	batch[i].replycmd=NX_ZONE_SNAPSHOT_MSG;
+      }
+      nx_send_batch(conn,batch,count,NX_BATCH_STOP_ON_ERROR);
+      for (i=0;i<count;i++) {
+	if (batch[i].result != 1 || batch[i].reply.msgnum != NX_ZONE_SNAPSHOT_MSG) {
+	  free(batch);
+	  return -5;
+	}
+	process_message(&batch[i].reply,1,0,astat,istatus);
+      }
+      astat->zone_refresh=0;
+      logmsg(0,"Zone statuses received (snapshot): %d zones in %lldms",
+	     astat->last_zone,nx_time_ms()-start);
     } else {
-      msgout.msgnum=NX_ZONE_NAME_REQ;
-      msgout.len=2;
-      msgout.msg[0]=i;
-      ret=nx_send_message(fd,protocol,&msgout,5,3,NX_ZONE_NAME_MSG,&msgin);
-      if (ret != 1 || msgin.msgnum != NX_ZONE_NAME_MSG) {
-	logmsg(1,"failed to get name for zone %d (no NX-148E present?)",i+1);
-	snprintf(astat->zones[i].name,sizeof(astat->zones[i].name),"Zone %02d",i+1);
-	skip_zone_names++;
-      } else {
-	process_message(&msgin,1,0,astat,istatus);
+      logmsg(0,"No zone names saved for this panel (%d). Fast start disabled.",ret);
+    }
+  }
+
+
+  if (astat->zone_refresh >= astat->last_zone) {
+    /* get zone names */
+    if (!skip_zone_names) {
+      for (i=0;i<astat->last_zone;i++) {
+	batch[i].req.msgnum=NX_ZONE_NAME_REQ;
+	batch[i].req.len=2;
+	batch[i].req.msg[0]=i;
+	batch[i].replycmd=NX_ZONE_NAME_MSG;
+      }
+      nx_send_batch(conn,batch,astat->last_zone,NX_BATCH_STOP_ON_ERROR);
+      for (i=0;i<astat->last_zone;i++) {
+	if (batch[i].result != 1 || batch[i].reply.msgnum != NX_ZONE_NAME_MSG) {
+	  logmsg(1,"failed to get name for zone %d (no NX-148E present?)",i+1);
+	  break;
+	}
+	process_message(&batch[i].reply,1,0,astat,istatus);
       }
     }
 
-    /* get zone status */
-    msgout.msgnum=NX_ZONE_STATUS_REQ;
-    msgout.len=2;
-    msgout.msg[0]=i;
-    ret=nx_send_message(fd,protocol,&msgout,5,3,NX_ZONE_STATUS_MSG,&msgin);
-    if (ret != 1 || msgin.msgnum != NX_ZONE_STATUS_MSG) return -5;
-    process_message(&msgin,1,0,astat,istatus);
+    /* get zone statuses */
+    for (i=0;i<astat->last_zone;i++) {
+      batch[i].req.msgnum=NX_ZONE_STATUS_REQ;
+      batch[i].req.len=2;
+      batch[i].req.msg[0]=i;
+      batch[i].replycmd=NX_ZONE_STATUS_MSG;
+    }
+    nx_send_batch(conn,batch,astat->last_zone,NX_BATCH_STOP_ON_ERROR);
+    for (i=0;i<astat->last_zone;i++) {
+      if (batch[i].result != 1 || batch[i].reply.msgnum != NX_ZONE_STATUS_MSG) {
+	free(batch);
+	return -5;
+      }
+      process_message(&batch[i].reply,1,0,astat,istatus);
 
-    printf(".");
+      printf(".");
+    }
+    printf("\n");
     fflush(stdout);
+
+    logmsg(0,"Zone names and statuses received: %d zones in %lldms (window=%d)",
+	   astat->last_zone,nx_time_ms()-start,conn->window);
   }
-  printf("\n");
+  free(batch);
 
 
   if (config->status_file) {
@@ -1459,4 +2070,258 @@ int get_system_status(int fd, int protocol, nx_system_status_t *astat, nx_interf
 }
 
 
+/* restore system status from saved state (warm start) and update it
+   with changes from the panel using snapshot requests */
+int restore_system_status(nx_conn_t *conn, const nx_system_status_t *saved,
+			  nx_system_status_t *astat, nx_interface_status_t *istatus)
+{
+  nxmsg_t msgout,msgin;
+  nx_batch_item_t batch[NX_ZONES_MAX/16 + NX_PARTITIONS_MAX];
+  char panel_model[sizeof(astat->panel_model)];
+  int ret, i, count;
+  int last_zone, last_partition;
+  long long start = nx_time_ms();
+
+
+  last_partition=((config->partitions > 0 && config->partitions < NX_PARTITIONS_MAX) ?
+		  config->partitions : NX_PARTITIONS_MAX);
+  last_zone=((config->zones > 0 && config->zones <= NX_ZONES_MAX) ? config->zones : 48);
+  if (saved->last_zone != last_zone || saved->last_partition != last_partition)
+    return -1;
+
+  if ((istatus->sup_cmd_msgs[1] & 0x01) == 0 ||
+      (istatus->sup_cmd_msgs[0] & 0xe0) != 0xe0)
+    return -2;
+
+
+  /* check that we are talking to the same panel */
+  msgout.msgnum=NX_SYS_STATUS_REQ;
+  msgout.len=1;
+  ret=nx_send_message(conn,&msgout,NX_SYS_STATUS_MSG,&msgin);
+  if (!(ret == 1 && msgin.msgnum == NX_SYS_STATUS_MSG)) return -3;
+  if (msgin.msg[0] != saved->panel_id) return -4;
+
+
+  /* restore saved state */
+  strlcpy(panel_model,astat->panel_model,sizeof(panel_model));
+  memcpy(astat,saved,sizeof(nx_system_status_t));
+  strlcpy(astat->panel_model,panel_model,sizeof(astat->panel_model));
+  set_status_intervals(astat,istatus);
+  astat->last_statuscheck=time(NULL);
+
+  process_message(&msgin,0,0,astat,istatus);
+
+
+  /* get partition statuses */
+  msgout.msgnum=NX_PART_SNAPSHOT_REQ;
+  msgout.len=1;
+  ret=nx_send_message(conn,&msgout,NX_PART_SNAPSHOT_MSG,&msgin);
+  if (!(ret == 1 && msgin.msgnum == NX_PART_SNAPSHOT_MSG)) return -5;
+  process_message(&msgin,0,0,astat,istatus);
+
+  memset(batch,0,sizeof(batch));
+  count=0;
+  for (i=0; i<astat->last_partition; i++) {
+    if (astat->partitions[i].valid) {
+      batch[count].req.msgnum=NX_PART_STATUS_REQ;
+      batch[count].req.len=2;
+      batch[count].req.msg[0]=i;
+      batch[count].replycmd=NX_PART_STATUS_MSG;
+      count++;
+    }
+  }
+
+  /* get zone statuses using zone snapshots */
+  for (i=0; i<(astat->last_zone+15)/16; i++) {
+    batch[count].req.msgnum=NX_ZONE_SNAPSHOT_REQ;
+    batch[count].req.len=2;
+    batch[count].req.msg[0]=i;
+    batch[count].replycmd=NX_ZONE_SNAPSHOT_MSG;
+    count++;
+  }
+
+  nx_send_batch(conn,batch,count,NX_BATCH_STOP_ON_ERROR);
+  for (i=0; i<count; i++) {
+    if (batch[i].result != 1 || batch[i].reply.msgnum != batch[i].replycmd)
+      return -6;
+    process_message(&batch[i].reply,0,0,astat,istatus);
+  }
+
+
+  /* refresh rest of zone info in the background */
+  astat->zone_refresh=0;
+
+  logmsg(0,"System status restored from saved state: %d zones in %lldms",
+	 astat->last_zone,nx_time_ms()-start);
+
+  return 0;
+}
+
+
+/* keep track of last log entry received from panel, called for log
+   event messages sent by the panel (when new events happen) */
+void update_log_cursor(nx_system_status_t *astat, const nxmsg_t *msg)
+{
+  int num, size;
+
+  if ((msg->msgnum & NX_MSG_MASK) != NX_LOG_EVENT_MSG) return;
+
+  num=msg->msg[0];
+  size=astat->last_log;
+
+  shm_write_begin(shm);
+  if (astat->log_cursor < 0 || size < 1 || num == (astat->log_cursor+1) % size) {
+    if (astat->log_sync_target < 0 || astat->log_sync_target == num)
+      astat->log_cursor=num;
+    if (astat->log_sync_target == num)
+      astat->log_sync_target=-1;
+  } else if (num != astat->log_cursor) {
+    /* we have missed some log entries */
+    logmsg(2,"log entries missing (%d -> %d)",astat->log_cursor,num);
+    start_log_sync(astat,num);
+  }
+  shm_write_end(shm);
+}
+
+
+/* schedule fetching of log entries between last known entry and target
+   (done in the background by sync_log()) */
+void start_log_sync(nx_system_status_t *astat, int target)
+{
+  int size = astat->last_log;
+
+  if (target < 0 || target == astat->log_cursor) return;
+
+  shm_write_begin(shm);
+  if (astat->log_cursor < 0 || size < 1 ||
+      astat->log_cursor >= size || target >= size) {
+    /* no valid log position saved, start tracking from current position */
+    astat->log_cursor=target;
+    astat->log_sync_target=-1;
+  } else {
+    if (astat->log_sync_target < 0)
+      logmsg(1,"%d new panel log entries, fetching them...",
+	     (target - astat->log_cursor + size) % size);
+    astat->log_sync_target=target;
+  }
+  shm_write_end(shm);
+}
+
+
+static int log_entry_matches(const nx_log_event_t *e, const nxmsg_t *msg)
+{
+  return (e->last_updated > 0 &&
+	  e->type == msg->msg[2] && e->num == msg->msg[3] &&
+	  e->part == msg->msg[4] && e->month == msg->msg[5] &&
+	  e->day == msg->msg[6] && e->hour == msg->msg[7] &&
+	  e->min == msg->msg[8]);
+}
+
+
+/* fetch (up to count) log entries missed while daemon was not running
+   (or communication to panel was down), returns number of entries
+   still to be fetched */
+int sync_log(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int count)
+{
+  nx_batch_item_t batch[LOG_SYNC_MAX];
+  int size = astat->last_log;
+  int target = astat->log_sync_target;
+  int i, pos;
+  int n = 0;
+
+  if (target < 0) return 0;
+  if (size < 1 || astat->log_cursor < 0 || astat->log_cursor >= size ||
+      target >= size || (istatus->sup_cmd_msgs[1] & 0x04) == 0) {
+    shm_write_begin(shm);
+    astat->log_cursor=target;
+    astat->log_sync_target=-1;
+    shm_write_end(shm);
+    return 0;
+  }
+
+  if (count > LOG_SYNC_MAX) count=LOG_SYNC_MAX;
+  pos=astat->log_cursor;
+  while (pos != target && n < count) {
+    pos=(pos+1) % size;
+    batch[n].req.msgnum=NX_LOG_EVENT_REQ;
+    batch[n].req.len=2;
+    batch[n].req.msg[0]=pos;
+    batch[n].replycmd=NX_LOG_EVENT_MSG;
+    n++;
+  }
+
+  nx_send_batch(conn,batch,n,NX_BATCH_STOP_ON_ERROR);
+
+  shm_write_begin(shm);
+  for (i=0; i<n; i++) {
+    pos=batch[i].req.msg[0];
+    if (batch[i].result != 1 || batch[i].reply.msgnum != NX_LOG_EVENT_MSG) {
+      logmsg(0,"failed to get log entry: %d",pos);
+      astat->log_sync_target=-1;
+      break;
+    }
+    /* skip entry if it was already received from panel */
+    if (!(pos == target && log_entry_matches(&astat->log[pos],&batch[i].reply)))
+      process_message(&batch[i].reply,0,0,astat,istatus);
+    astat->log_cursor=pos;
+  }
+
+  if (astat->log_cursor == target && astat->log_sync_target >= 0) {
+    logmsg(1,"Panel log synchronized (last entry: %d)",target);
+    astat->log_sync_target=-1;
+  }
+  shm_write_end(shm);
+
+  if (astat->log_sync_target < 0) return 0;
+  return (target - astat->log_cursor + size) % size;
+}
+
+
+/* refresh names and statuses of (up to count) zones in the background
+   after fast start, returns number of zones still to be refreshed */
+int refresh_zones(nx_conn_t *conn, nx_system_status_t *astat, nx_interface_status_t *istatus, int count)
+{
+  nx_batch_item_t batch[2*ZONE_REFRESH_MAX];
+  int names = ((istatus->sup_cmd_msgs[0] & 0x08) ? 1 : 0);
+  int i, zone;
+  int n = 0;
+
+  if (count > ZONE_REFRESH_MAX) count=ZONE_REFRESH_MAX;
+
+  for (zone=astat->zone_refresh; zone < astat->last_zone && count-- > 0; zone++) {
+    if (names) {
+      batch[n].req.msgnum=NX_ZONE_NAME_REQ;
+      batch[n].req.len=2;
+      batch[n].req.msg[0]=zone;
+      batch[n].replycmd=NX_ZONE_NAME_MSG;
+      n++;
+    }
+    batch[n].req.msgnum=NX_ZONE_STATUS_REQ;
+    batch[n].req.len=2;
+    batch[n].req.msg[0]=zone;
+    batch[n].replycmd=NX_ZONE_STATUS_MSG;
+    n++;
+  }
+  if (n < 1) return 0;
+
+  nx_send_batch(conn,batch,n,0);
+  shm_write_begin(shm);
+  for (i=0; i<n; i++) {
+    /* zone statuses were restored from snapshot (or saved state), so
+       differences found now (tamper, low battery, etc.) are real changes */
+    if (batch[i].result == 1 && batch[i].reply.msgnum == batch[i].replycmd)
+      process_message(&batch[i].reply,0,0,astat,istatus);
+    else
+      logmsg(1,"failed to refresh zone %d (msg %02x)",
+	     batch[i].req.msg[0]+1,batch[i].req.msgnum);
+  }
+  astat->zone_refresh=zone;
+  shm_write_end(shm);
+  if (zone >= astat->last_zone)
+    logmsg(1,"Zone names and statuses refreshed");
+
+  return astat->last_zone - zone;
+}
+
+
 /* eof :-) */
@@ -24,38 +24,83 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "nxgipd.h"
 
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+
 
 extern char **environ;
 
 
 #define MAX_ENV_ENTRIES 64
 
-void run_trigger_program(const char **envv)
+#define TRIGGER_RESTART_INTERVAL  5     /* min. seconds between worker restarts */
+#define TRIGGER_WRITE_TIMEOUT     2000  /* how long to hold back panel messages for worker (ms) */
+#define TRIGGER_BUFFER_MAX        4     /* max. buffer growth (x <buffersize>) before dropping */
+
+/* persistent trigger program (worker) state */
+static volatile pid_t worker_pid = 0;
+static volatile sig_atomic_t worker_exited = 0;
+static int worker_fd = -1;
+static char *worker_buf = NULL;
+static size_t worker_len = 0;
+static size_t worker_size = 0;
+static long long worker_progress = 0;  /* last time worker read events (ms) */
+static time_t worker_started = 0;
+
+#define TRIGGER_EVENT_SIZE 1024
+
+/* trigger queue (events waiting for free trigger process) */
+typedef struct trigger_event {
+  int  type;   /* event type (NX_EVENT_*) */
+  int  rule;   /* trigger rule (-1 = none) */
+  int  key;    /* zone number (for coalescing), 0 = none */
+  int  len;
+  char data[TRIGGER_EVENT_SIZE];  /* environment strings (NUL separated) */
+} trigger_event_t;
+
+static trigger_event_t *trigger_queue = NULL;
+static int trigger_queue_head = 0;
+
+#define TRIGGER_SLOTS 64
+
+/* running trigger processes (for collecting run time statistics),
+   filled in by SIGCHLD handler when process exits */
+typedef struct trigger_proc {
+  volatile pid_t pid;
+  int       type;
+  long long start;   /* (us) */
+  long long end;
+  int       status;
+  struct rusage ru;
+  volatile sig_atomic_t done;
+} trigger_proc_t;
+
+static trigger_proc_t trigger_procs[TRIGGER_SLOTS];
+static volatile sig_atomic_t trigger_procs_done = 0;
+static int trigger_slots_used = 0;
+
+
+/* build environment for the trigger program */
+static void trigger_env(const char **env, const char **envv)
 {
-  const char *env[MAX_ENV_ENTRIES+1];
-  char *argv[2];
   const char **e;
   int envc = 0;
-  pid_t pid;
-  int fd;
-
-
-  logmsg(3,"run_trigger_program() called");
-
-  /* check if too many trigger processes is already running... */
-  if (config->max_triggers > 0 && trigger_processes >= config->max_triggers) {
-    logmsg(0,"trigger not started: too many trigger processes already running (%d)",
-	   trigger_processes);
-    return;
-  }
 
   /* filter out environment for the trigger program */
   e=(const char **)environ;
@@ -80,44 +125,655 @@ void run_trigger_program(const char **envv)
   }
 
   env[envc]=NULL;
-  argv[0]=config->alarm_program;
+}
+
+
+static long long trigger_time_us()
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC,&ts) < 0)
+    return (long long)time(NULL) * 1000000;
+
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* make sure file descriptors inherited from our parent don't "leak" to
+   trigger programs. called once at startup, daemon opens its own file
+   descriptors with O_CLOEXEC (or sets FD_CLOEXEC) */
+void trigger_cloexec_fds()
+{
+  int fd, max;
+
+#ifdef HAVE_CLOSE_RANGE
+  if (close_range(3,~0U,CLOSE_RANGE_CLOEXEC) == 0)
+    return;
+#endif
+  if ((max=sysconf(_SC_OPEN_MAX)) < 0 || max > 65536) max=65536;
+  for (fd=3; fd<max; fd++)
+    fcntl(fd,F_SETFD,FD_CLOEXEC);
+}
+
+
+/* start trigger program, with stdin connected to infd (or /dev/null),
+   mask is the signal mask for the new process. returns pid of the new
+   process or -1 (errno set) if program could not be started */
+static pid_t spawn_trigger_program(const char *program, const char **env, int infd,
+				   const sigset_t *mask)
+{
+  char *argv[2];
+  pid_t pid;
+#ifdef HAVE_POSIX_SPAWN
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t def;
+  int r;
+#else
+  int fd;
+#endif
+
+  argv[0]=(char*)program;
   argv[1]=NULL;
-  
 
+#ifdef HAVE_POSIX_SPAWN
+  posix_spawn_file_actions_init(&fa);
+  if (infd >= 0)
+    posix_spawn_file_actions_adddup2(&fa,infd,0);
+  else
+    posix_spawn_file_actions_addopen(&fa,0,"/dev/null",O_RDONLY,0);
+  posix_spawn_file_actions_addopen(&fa,1,"/dev/null",O_WRONLY,0);
+  posix_spawn_file_actions_adddup2(&fa,1,2);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+  posix_spawn_file_actions_addclosefrom_np(&fa,3);
+#endif
+
+  /* SIGPIPE is ignored by the daemon, restore default for the program */
+  sigemptyset(&def);
+  sigaddset(&def,SIGPIPE);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr,mask);
+  posix_spawnattr_setsigdefault(&attr,&def);
+  posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  r=posix_spawnp(&pid,program,&fa,&attr,
+		 (char *const*)argv,(char *const*)env);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (r != 0) {
+    errno=r;
+    return -1;
+  }
+  return pid;
+#else
   pid=fork();
-  if (pid < 0) {
-    logmsg(0,"run_trigger_program(): fork failed: %d (%s)",errno,strerror(errno));
-  } 
-  else if (pid == 0) {
-    /* this is the child process */
-
-    /* make sure (somewhat) that file descriptors dont "leak"... */
-    if ((fd = open("/dev/null",O_RDWR)) < 0) _exit(-1);
-    dup2(fd,0);
-    dup2(fd,1);
-    dup2(fd,2);
-    close(fd);
-    /* hack: try closing first few file descriptors to avoid anything leaking...
-       maybe someday Linux will have closefrom() ... */
-    for (fd=3; fd<32; fd++) close(fd);
+  if (pid != 0) return pid;
+
+  /* this is the child process */
+  signal(SIGPIPE,SIG_DFL);
+  sigprocmask(SIG_SETMASK,mask,NULL);
+  if ((fd = open("/dev/null",O_RDWR|O_CLOEXEC)) < 0) _exit(127);
+  dup2((infd >= 0 ? infd : fd),0);
+  dup2(fd,1);
+  dup2(fd,2);
 
 #ifdef HAVE_EXECVPE
-    if (execvpe((const char *)config->alarm_program,(char *const*)argv,(char *const*)env) < 1) {
-      logmsg(0,"run_trigger_program(): excecvpe(%s,...) failed %d (%s)",
-	     config->alarm_program,errno,strerror(errno));
-    }  
+  execvpe(program,(char *const*)argv,(char *const*)env);
 #else
-    if (execve((const char *)config->alarm_program,(char *const*)argv,(char *const*)env) < 1) {
-      logmsg(0,"run_trigger_program(): excecve(%s,...) failed %d (%s)",
-	     config->alarm_program,errno,strerror(errno));
-    }  
+  execve(program,(char *const*)argv,(char *const*)env);
 #endif
+  _exit(127);
+#endif
+}
+
+
+/* start persistent trigger program, events are written to its stdin */
+int trigger_worker_start()
+{
+  const char *env[MAX_ENV_ENTRIES+1];
+  const char *envv[2];
+  sigset_t set, oldset;
+  int p[2];
+  pid_t pid;
+
+  if (worker_fd >= 0) return 0;
+
+  envv[0]=(config->trigger_format == TRIGGER_FORMAT_JSON ?
+	   "ALARM_EVENT_FORMAT=json" : "ALARM_EVENT_FORMAT=env");
+  envv[1]=NULL;
+  trigger_env(env,envv);
+
+  if (pipe(p) < 0) {
+    logmsg(0,"trigger_worker_start(): pipe failed: %d (%s)",errno,strerror(errno));
+    return -1;
+  }
+  fcntl(p[1],F_SETFD,FD_CLOEXEC);
+
+  /* make sure SIGCHLD handler knows the worker pid */
+  sigemptyset(&set);
+  sigaddset(&set,SIGCHLD);
+  sigprocmask(SIG_BLOCK,&set,&oldset);
+
+  worker_started=time(NULL);
+  pid=spawn_trigger_program(config->alarm_program,env,p[0],&oldset);
+  if (pid < 0) {
+    logmsg(0,"trigger_worker_start(): cannot start %s: %d (%s)",
+	   config->alarm_program,errno,strerror(errno));
+    sigprocmask(SIG_SETMASK,&oldset,NULL);
+    close(p[0]);
+    close(p[1]);
+    return -2;
+  }
+
+  worker_pid=pid;
+  worker_exited=0;
+  sigprocmask(SIG_SETMASK,&oldset,NULL);
+
+  close(p[0]);
+  fcntl(p[1],F_SETFL,O_NONBLOCK);
+  worker_fd=p[1];
+
+  logmsg(0,"trigger program started: pid=%u", pid);
+  return 0;
+}
+
+
+/* called from SIGCHLD handler when child process has exited,
+   returns 1 if pid was the trigger worker */
+int trigger_reaped(pid_t pid, int status, const struct rusage *ru)
+{
+  int i;
+
+  if (pid <= 0) return 0;
+  if (pid == worker_pid) {
+    worker_exited=1;
+    return 1;
+  }
+
+  for (i=0; i<TRIGGER_SLOTS; i++) {
+    if (trigger_procs[i].pid == pid && !trigger_procs[i].done) {
+      trigger_procs[i].end=trigger_time_us();
+      trigger_procs[i].status=status;
+      if (ru) trigger_procs[i].ru=*ru;
+      trigger_procs[i].done=1;
+      trigger_procs_done=1;
+      break;
+    }
+  }
+  return 0;
+}
+
+
+static int hist_bucket(unsigned long long val)
+{
+  int b = 0;
+
+  while (val > 1 && b < NX_TRIGGER_HIST_BUCKETS-1) {
+    val>>=1;
+    b++;
+  }
+  return b;
+}
+
+
+/* update statistics of trigger processes that have exited */
+static void trigger_collect()
+{
+  nx_trigger_type_stats_t *ts;
+  trigger_proc_t *p;
+  long long run;
+  int i;
+
+  trigger_procs_done=0;
+
+  for (i=0; i<TRIGGER_SLOTS; i++) {
+    p=&trigger_procs[i];
+    if (!p->pid || !p->done) continue;
+
+    run=(p->end - p->start) / 1000;
+    ts=&shm->triggerstats.types[p->type-1];
+    logmsg(3,"trigger process finished: pid=%u, run time=%lldms",p->pid,run);
+
+    shm_write_begin(shm);
+    if (WIFSIGNALED(p->status)) ts->killed++;
+    else if (WEXITSTATUS(p->status) == 0) ts->ok++;
+    else ts->failed++;
+    ts->timed++;
+    ts->run_ms_sum+=run;
+    if (run > ts->run_ms_max) ts->run_ms_max=run;
+    ts->run_hist[hist_bucket(run)]++;
+    ts->cpu_ms_sum+=(p->ru.ru_utime.tv_sec + p->ru.ru_stime.tv_sec) * 1000 +
+      (p->ru.ru_utime.tv_usec + p->ru.ru_stime.tv_usec) / 1000;
+    shm_write_end(shm);
+
+    p->done=0;
+    p->pid=0;
+    trigger_slots_used--;
+  }
+}
+
+
+/* returns 1 if no more trigger processes can be started now
+   (maxprocesses reached or all process slots in use) */
+static int trigger_limit_reached()
+{
+  if (trigger_procs_done) trigger_collect();
+  return (trigger_slots_used >= TRIGGER_SLOTS ||
+	  (config->max_triggers > 0 && trigger_processes >= config->max_triggers));
+}
+
+
+/* returns 1 if events are waiting to be written to the trigger worker */
+int trigger_worker_pending()
+{
+  return (worker_len > 0 || worker_exited);
+}
+
+
+/* (re)start worker if it has exited */
+static void trigger_worker_check()
+{
+  if (worker_exited) {
+    logmsg(0,"trigger program exited: pid=%u",worker_pid);
+    if (worker_fd >= 0) close(worker_fd);
+    worker_fd=-1;
+    worker_pid=0;
+    worker_exited=0;
+  }
+
+  if (worker_fd < 0 && worker_started + TRIGGER_RESTART_INTERVAL <= time(NULL)) {
+    if (trigger_worker_start() == 0) {
+      shm_write_begin(shm);
+      shm->triggerstats.restarts++;
+      shm_write_end(shm);
+    }
+  }
+}
+
+
+/* write buffered events to the trigger worker (without waiting),
+   returns number of bytes still in buffer. called from main loop,
+   outside of shm write sections */
+static int trigger_worker_flush()
+{
+  ssize_t n;
+
+  trigger_worker_check();
+
+  while (worker_len > 0 && worker_fd >= 0) {
+    n=write(worker_fd,worker_buf,worker_len);
+    if (n > 0) {
+      worker_len-=n;
+      memmove(worker_buf,worker_buf+n,worker_len);
+      worker_progress=nx_time_ms();
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* worker has closed its stdin, make it restart */
+      logmsg(0,"trigger program not reading events: %d (%s)",errno,strerror(errno));
+      close(worker_fd);
+      worker_fd=-1;
+      if (worker_pid > 0) kill(worker_pid,SIGTERM);
+    }
+    /* pipe full (main loop waits for it to become writable) */
+    break;
+  }
+
+  if (shm->triggerstats.buffered != worker_len) {
+    shm_write_begin(shm);
+    shm->triggerstats.buffered=worker_len;
+    shm_write_end(shm);
+  }
+
+  return worker_len;
+}
+
+
+/* format event (environment style strings) as a record for trigger worker */
+static int format_trigger_event(const char **envv, char *buf, size_t size)
+{
+  const char **e;
+  const char *s, *v;
+  size_t len = 0;
+  char c;
+
+  if (config->trigger_format == TRIGGER_FORMAT_JSON && len < size) buf[len++]='{';
+
+  for (e=envv; *e; e++) {
+    if (!(v=strchr(*e,'='))) continue;
+
+    if (config->trigger_format == TRIGGER_FORMAT_JSON) {
+      if (e != envv && len < size) buf[len++]=',';
+      if (len < size) buf[len++]='"';
+      for (s=*e; s<v && len < size; s++) buf[len++]=*s;
+      if (len + 3 < size) {
+	buf[len++]='"';
+	buf[len++]=':';
+	buf[len++]='"';
+      }
+      for (s=v+1; *s && len + 6 < size; s++) {
+	c=*s;
+	if (c == '"' || c == '\\') {
+	  buf[len++]='\\';
+	  buf[len++]=c;
+	} else if ((unsigned char)c < 0x20) {
+	  len+=snprintf(buf+len,size-len,"\\u%04x",c);
+	} else {
+	  buf[len++]=c;
+	}
+      }
+      if (len < size) buf[len++]='"';
+    } else {
+      for (s=*e; *s && len < size; s++)
+	buf[len++]=(*s == '\n' || *s == '\r' ? ' ' : *s);
+      if (len < size) buf[len++]='\n';
+    }
+  }
+
+  if (config->trigger_format == TRIGGER_FORMAT_JSON && len < size) buf[len++]='}';
+  if (len >= size) return -1;
+  buf[len++]='\n';
+
+  return len;
+}
+
+
+/* queue event for the persistent trigger program (main loop writes
+   it to the program when pipe becomes writable) */
+static void trigger_worker_send(const char **envv)
+{
+  char rec[4096];
+  size_t size;
+  int len;
+
+  if ((len=format_trigger_event(envv,rec,sizeof(rec))) < 0) {
+    logmsg(0,"trigger event too large, event dropped");
+    shm_write_begin(shm);
+    shm->triggerstats.dropped++;
+    shm_write_end(shm);
+    return;
+  }
+
+  /* buffer may grow past <buffersize> while main loop holds back
+     panel messages (see triggers_backpressure()) */
+  if (worker_len + len > worker_size) {
+    size=(worker_size > 0 ? worker_size * 2 : config->trigger_buffer);
+    while (size < worker_len + len) size*=2;
+    if (size > (size_t)config->trigger_buffer * TRIGGER_BUFFER_MAX) {
+      logmsg(0,"trigger program not reading events, event dropped (%lu bytes buffered)",
+	     (unsigned long)worker_len);
+      shm_write_begin(shm);
+      shm->triggerstats.dropped++;
+      shm_write_end(shm);
+      return;
+    }
+    if (!(worker_buf=realloc(worker_buf,size)))
+      die("out of memory");
+    worker_size=size;
+  }
+
+  if (worker_len == 0) worker_progress=nx_time_ms();
+  memcpy(worker_buf+worker_len,rec,len);
+  worker_len+=len;
+  shm_write_begin(shm);
+  shm->triggerstats.started++;
+  shm->triggerstats.buffered=worker_len;
+  shm_write_end(shm);
+}
+
+
+/* start trigger program for an event, returns 0 on success, -1 if
+   process could not be created (try again later) or -2 if program
+   could not be executed */
+static int start_trigger_program(const char **envv, int type, int rule)
+{
+  const char *program = config->alarm_program;
+  const char *env[MAX_ENV_ENTRIES+1];
+  nx_trigger_type_stats_t *ts = &shm->triggerstats.types[type-1];
+  trigger_proc_t *p = NULL;
+  sigset_t set, oldset;
+  long long start, spawn;
+  pid_t pid;
+  int i;
+
+  trigger_env(env,envv);
+  if (rule >= 0 && config->trigger_rules->program[rule])
+    program=config->trigger_rules->program[rule];
+
+  /* record process in the slot table before SIGCHLD handler can see it */
+  sigemptyset(&set);
+  sigaddset(&set,SIGCHLD);
+  sigprocmask(SIG_BLOCK,&set,&oldset);
+
+  start=trigger_time_us();
+  pid=spawn_trigger_program(program,env,-1,&oldset);
+  spawn=trigger_time_us() - start;
+
+  if (pid < 0) {
+    i=errno;
+    logmsg(0,"run_trigger_program(): cannot start %s: %d (%s)",
+	   program,i,strerror(i));
+    sigprocmask(SIG_SETMASK,&oldset,NULL);
+    shm_write_begin(shm);
+    ts->spawn_errors++;
+    shm_write_end(shm);
+    return (i == EAGAIN || i == ENOMEM ? -1 : -2);
+  }
+
+  for (i=0; i<TRIGGER_SLOTS; i++) {
+    if (!trigger_procs[i].pid) {
+      p=&trigger_procs[i];
+      p->type=type;
+      p->start=start;
+      p->done=0;
+      p->pid=pid;
+      trigger_slots_used++;
+      break;
+    }
+  }
+  trigger_processes++;
+  sigprocmask(SIG_SETMASK,&oldset,NULL);
+
+  logmsg(3,"trigger (child) process created: pid=%u (%lldus)", pid, spawn);
+  shm_write_begin(shm);
+  shm->triggerstats.started++;
+  ts->count++;
+  ts->spawn_us_sum+=spawn;
+  if (spawn > ts->spawn_us_max) ts->spawn_us_max=spawn;
+  ts->spawn_hist[hist_bucket(spawn)]++;
+  shm_write_end(shm);
+  return 0;
+}
+
+
+/* add event to the trigger queue, replacing queued event for same
+   zone (if coalescing is enabled) */
+static void trigger_queue_add(const char **envv, int type, int key, int rule)
+{
+  nx_trigger_stats_t *stats = &shm->triggerstats;
+  trigger_event_t *ev = NULL;
+  const char **e;
+  size_t l;
+  int i;
+
+  if (!trigger_queue) {
+    if (!(trigger_queue=malloc(sizeof(trigger_event_t)*config->trigger_queue)))
+      die("out of memory");
+  }
+
+  shm_write_begin(shm);
+  stats->queue_size=config->trigger_queue;
+
+  if (key > 0 && config->trigger_coalesce) {
+    for (i=0; i<stats->queued; i++) {
+      ev=&trigger_queue[(trigger_queue_head+i) % config->trigger_queue];
+      if (ev->key == key) break;
+      ev=NULL;
+    }
+    if (ev) {
+      logmsg(2,"queued trigger event replaced by newer event (zone %d)",key);
+      stats->coalesced++;
+    }
+  }
+
+  if (!ev) {
+    if (stats->queued >= config->trigger_queue) {
+      logmsg(0,"trigger queue full, dropping oldest event");
+      trigger_queue_head=(trigger_queue_head+1) % config->trigger_queue;
+      stats->queued--;
+      stats->dropped++;
+    }
+    ev=&trigger_queue[(trigger_queue_head+stats->queued) % config->trigger_queue];
+    stats->queued++;
+    if (stats->queued > stats->queue_max) stats->queue_max=stats->queued;
+    logmsg(2,"trigger event queued (%d processes running, %d events queued)",
+	   trigger_processes,stats->queued);
+  }
+
+  ev->type=type;
+  ev->rule=rule;
+  ev->key=key;
+  ev->len=0;
+  for (e=envv; *e; e++) {
+    l=strlen(*e)+1;
+    if (ev->len + l > sizeof(ev->data)) break;
+    memcpy(ev->data+ev->len,*e,l);
+    ev->len+=l;
+  }
+  shm_write_end(shm);
+}
+
+
+/* start trigger programs for queued events (if processes are available) */
+static void trigger_queue_dispatch()
+{
+  nx_trigger_stats_t *stats = &shm->triggerstats;
+  const char *envv[MAX_ENV_ENTRIES+1];
+  trigger_event_t *ev;
+  int envc, pos;
+
+  while (stats->queued > 0 && !trigger_limit_reached()) {
+    ev=&trigger_queue[trigger_queue_head];
+    envc=0;
+    for (pos=0; pos < ev->len && envc < MAX_ENV_ENTRIES; pos+=strlen(ev->data+pos)+1)
+      envv[envc++]=ev->data+pos;
+    envv[envc]=NULL;
+
+    if (start_trigger_program(envv,ev->type,ev->rule) == -1) break;
+
+    shm_write_begin(shm);
+    trigger_queue_head=(trigger_queue_head+1) % config->trigger_queue;
+    stats->queued--;
+    shm_write_end(shm);
   }
+}
+
+
+/* returns 1 if there are events waiting to be passed to trigger program */
+int triggers_pending()
+{
+  if (config->trigger_mode == TRIGGER_MODE_PERSISTENT)
+    return (worker_len > 0 || worker_exited);
+  return (shm->triggerstats.queued > 0 || trigger_procs_done);
+}
+
+
+/* returns persistent trigger program pipe (and events to poll for) if
+   there are events waiting to be written to it, otherwise -1 */
+int trigger_fd(short *events)
+{
+  if (worker_fd < 0 || worker_len == 0) return -1;
+
+  *events=POLLOUT;
+  return worker_fd;
+}
+
+
+/* returns 1 if main loop should not process more panel messages until
+   persistent trigger program has read buffered events. panel messages
+   are held back only while program is making progress, so that a hung
+   program does not stop the daemon */
+int triggers_backpressure()
+{
+  if (config->trigger_mode != TRIGGER_MODE_PERSISTENT ||
+      worker_len < config->trigger_buffer)
+    return 0;
+
+  return (nx_time_ms() - worker_progress < TRIGGER_WRITE_TIMEOUT);
+}
+
+
+/* pass waiting events to trigger program (called from main loop) */
+void process_pending_triggers()
+{
+  if (config->trigger_mode == TRIGGER_MODE_PERSISTENT)
+    trigger_worker_flush();
   else {
-    logmsg(3,"trigger (child) process created: pid=%u", pid);
-    trigger_processes++;
+    if (trigger_procs_done) trigger_collect();
+    trigger_queue_dispatch();
+  }
+}
+
+
+/* find trigger rule for an event, returns rule number, TRIGGER_RULE_NOMATCH
+   if event should not be passed to trigger program, or TRIGGER_RULE_DEFAULT
+   if there are no rules for the event type */
+int trigger_rule_match(int type, int num, uint partmask, uint old_flags, uint new_flags)
+{
+  const nx_trigger_rules_t *r = config->trigger_rules;
+  const nx_rule_table_t *t;
+  uint set = new_flags & ~old_flags;
+  uint clr = old_flags & ~new_flags;
+  uint32_t m;
+  int rule;
+
+  if (!r || type < 1 || type > NX_TRIGGER_TYPES || !r->used[type-1])
+    return TRIGGER_RULE_DEFAULT;
+  if (num < 0 || num >= NX_ZONES_MAX)
+    return TRIGGER_RULE_NOMATCH;
+
+  t=&r->table[type-1];
+  m=t->num[num] & t->part[partmask & 0xff] &
+    (t->any |
+     t->set[0][set & 0xff] | t->set[1][(set >> 8) & 0xff] | t->set[2][(set >> 16) & 0xff] |
+     t->clear[0][clr & 0xff] | t->clear[1][(clr >> 8) & 0xff] | t->clear[2][(clr >> 16) & 0xff]);
+  if (!m) return TRIGGER_RULE_NOMATCH;
+
+  rule=ffs(m)-1;
+  if (r->ignore & (1U << rule)) return TRIGGER_RULE_NOMATCH;
+  logmsg(3,"trigger rule %d matched",rule+1);
+  return rule;
+}
+
+
+void run_trigger_program(const char **envv, int type, int key, int rule)
+{
+  logmsg(3,"run_trigger_program() called");
+
+  if (config->trigger_mode == TRIGGER_MODE_PERSISTENT) {
+    trigger_worker_send(envv);
+    return;
+  }
+
+  /* check if too many trigger processes is already running... */
+  if (shm->triggerstats.queued > 0 || trigger_limit_reached()) {
+    if (config->trigger_queue > 0) {
+      trigger_queue_add(envv,type,key,rule);
+      trigger_queue_dispatch();
+      return;
+    }
+    logmsg(0,"trigger not started: too many trigger processes already running (%d)",
+	   trigger_processes);
+    shm_write_begin(shm);
+    shm->triggerstats.dropped++;
+    shm_write_end(shm);
+    return;
   }
 
+  /* retry later if trigger process could not be created */
+  if (start_trigger_program(envv,type,rule) == -1 && config->trigger_queue > 0)
+    trigger_queue_add(envv,type,key,rule);
 }
 
 
@@ -136,7 +792,7 @@ void run_trigger_program(const char **envv)
 
 
 void run_zone_trigger(int zonenum,const char* zonename, int fault, int bypass, int trouble,
-		       int tamper, int armed, const char* zonestatus)
+		       int tamper, int armed, const char* zonestatus, int rule)
 {
   char* env[MAX_TRIG_ENV+1];
   int envc = 0;
@@ -153,9 +809,11 @@ void run_zone_trigger(int zonenum,const char* zonename, int fault, int bypass, i
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_ZONE_TAMPER=%d",tamper);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_ZONE_BYPASS=%d",bypass);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_ZONE_ARMED=%d",armed);
+  if (rule >= 0 && config->trigger_rules->name[rule])
+    BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_RULE=%s",config->trigger_rules->name[rule]);
   env[envc]=NULL;
 
-  run_trigger_program((const char**)env);
+  run_trigger_program((const char**)env,NX_EVENT_ZONE,zonenum,rule);
 
   /* free the strings allocated earlier */
   e=env;
@@ -168,7 +826,7 @@ void run_zone_trigger(int zonenum,const char* zonename, int fault, int bypass, i
 
 
 void run_partition_trigger(int partnum, const char* partitionstatus,int armed, int ready,
-			   int stay, int chime, int entryd, int exitd, int palarm)
+			   int stay, int chime, int entryd, int exitd, int palarm, int rule)
 {
   char* env[MAX_TRIG_ENV+1];
   int envc = 0;
@@ -186,9 +844,11 @@ void run_partition_trigger(int partnum, const char* partitionstatus,int armed, i
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_PARTITION_ENTRY=%d",entryd);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_PARTITION_EXIT=%d",exitd);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_PARTITION_ALARM=%d",palarm);
+  if (rule >= 0 && config->trigger_rules->name[rule])
+    BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_RULE=%s",config->trigger_rules->name[rule]);
   env[envc]=NULL;
 
-  run_trigger_program((const char**)env);
+  run_trigger_program((const char**)env,NX_EVENT_PARTITION,0,rule);
 
 
   /* free the strings allocated earlier */
@@ -201,7 +861,7 @@ void run_partition_trigger(int partnum, const char* partitionstatus,int armed, i
 }
 
 
-void run_log_trigger(nx_log_event_t *log)
+void run_log_trigger(nx_log_event_t *log, int rule)
 {
   char* env[MAX_TRIG_ENV+1];
   int envc = 0;
@@ -236,9 +896,11 @@ void run_log_trigger(nx_log_event_t *log)
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_LOG_DAY=%d",log->day);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_LOG_HOUR=%02d",log->hour);
   BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_LOG_MIN=%02d",log->min);
+  if (rule >= 0 && config->trigger_rules->name[rule])
+    BUF_snprintf(env,MAX_TRIG_ENV,envc,tmp,"ALARM_EVENT_RULE=%s",config->trigger_rules->name[rule]);
   env[envc]=NULL;
 
-  run_trigger_program((const char**)env);
+  run_trigger_program((const char**)env,NX_EVENT_LOG,0,rule);
 
   /* free the strings allocated earlier */
   e=env;